@@ -16,6 +16,8 @@
 #include <unordered_set>
 
 #include "CallGraph/CallGraph.h"
+#include "DefUse/MemorySSACache.h"
+#include "PointsTo/PointsTo.h"
 #include "Utils/LLVM.h"
 
 #include "llvm/IR/Argument.h"
@@ -131,6 +133,16 @@ namespace defuse {
 
 enum class UserGraphWalkType { BFS, DFS };
 
+// Optional helpers of the walk, shared by all the walks over one module
+struct UserGraphContext {
+  // Reads function bodies of a lazily loaded module on demand
+  FunctionMaterializer *materializer = nullptr;
+  // Only follow loads that the store leading to a pointer may reach
+  MemorySSACache *mssa = nullptr;
+  // Resolve indirect calls, and drop nodes that cannot reach the object
+  pointsto::PointsToAnalysis *pts = nullptr;
+};
+
 // comp = [](const GetElementPtrInst &i1, const GetElementPtrInst &i2) {
 //   return isAccessingSameStructVar(&i1, &i2);
 // };
@@ -151,16 +163,22 @@ public:
   typedef std::unordered_map<Function *, std::unordered_set<Instruction *>>
       CalleeCallerMap;
 
-  UserGraph(Value *v, CallGraph *cg, Function *target,
-            const AllocRules &alloc_rules, int depth = -1)
+  UserGraph(Value *v, ::CallGraph *cg, Function *target,
+            const AllocRules &alloc_rules, int depth = -1,
+            const UserGraphContext &ctx = {})
     : functionsVisited(),
       root(v), maxDepth(depth), callGraph(cg), target(target),
-      alloc_rules(alloc_rules)
+      alloc_rules(alloc_rules), ctx(ctx)
   {}
   ~UserGraph() {}
 
   bool run(UserGraphWalkType t = UserGraphWalkType::DFS);
 
+  // Only run the first phase, which follows the object through the whole
+  // program, and add the values that hold a pointer to the object itself
+  // (rather than to one of its fields) to `pointers`
+  void findObjectPointers(SmallPtrSetImpl<Value *> &pointers);
+
   // functions for second phase analysis
   void prepareSecondPhase(UserGraphWalkType walk);
   bool prepareThirdPhase(UserGraphWalkType walk);
@@ -175,6 +193,19 @@ protected:
 private:
   bool isIncompatibleFun(Function *fun);
 
+  // Lazy loading support: read the body of a function when the walk enters
+  // it (false if it cannot be read), or the bodies that refer to a constant
+  // when the walk needs its complete use list.
+  bool enterFunction(Function *fun);
+  void requireUsersOf(Constant *c);
+  // Stores through which the walk reached the pointer of the given node
+  void findIncomingStores(Value *elem, ssize_t last,
+                          SmallPtrSetImpl<StoreInst *> &stores);
+  // Points-to support: callees of a call site (resolving indirect calls),
+  // and whether a node may still lead to the allocated object
+  std::vector<Function *> findCallees(CallSite call);
+  bool mayReachRoot(Value *elem, const FieldChain &chain);
+
   bool processUser(Value *elem, const FieldChain &chain, ssize_t last,
       UserGraphWalkType walk, bool scoped);
   void processCall(CallSite call, Value *arg, const FieldChain &chain,
@@ -198,10 +229,13 @@ private:
   VisitedNodeSet visited;
   VisitQueue visit_queue;
   VisitStack visit_stack;
-  CallGraph *callGraph;
+  ::CallGraph *callGraph;
   Function *target;
   CalleeCallerMap calleeCallerMap;
   const AllocRules &alloc_rules;
+  UserGraphContext ctx;
+  // Points-to class of the allocated object, -1 if unknown
+  int rootClass = -1;
 };
 
 }  // namespace defuse
@@ -0,0 +1,62 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef __MEMORY_SSA_CACHE_H_
+#define __MEMORY_SSA_CACHE_H_
+
+#include <memory>
+#include <unordered_map>
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BasicAliasAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+
+namespace llvm {
+namespace defuse {
+
+// MemorySSA of the functions visited by the user graph walks. Each function
+// is analyzed once on first use and kept for all later walks, so one cache
+// should be shared by every walk over the same module.
+class MemorySSACache {
+ public:
+  MemorySSACache() {}
+
+  // The store that wrote the value `load` reads: its clobbering def, when
+  // that is a store to exactly the loaded location. Null if the value may
+  // come from anything else, e.g. a call, a store that only may alias, one
+  // of several paths, or the caller.
+  StoreInst *getDefiningStore(LoadInst *load);
+
+  size_t getFunctionCnt() const { return _cache.size(); }
+
+ private:
+  struct FunctionInfo {
+    FunctionInfo(Function &F, const TargetLibraryInfo &TLI);
+
+    DominatorTree dt;
+    AssumptionCache ac;
+    BasicAAResult basic_aa;
+    AAResults aa;
+    std::unique_ptr<MemorySSA> mssa;
+  };
+
+  FunctionInfo &get(Function *F);
+
+  std::unique_ptr<TargetLibraryInfoImpl> _tlii;
+  std::unique_ptr<TargetLibraryInfo> _tli;
+  std::unordered_map<Function *, std::unique_ptr<FunctionInfo>> _cache;
+};
+
+}  // namespace defuse
+}  // namespace llvm
+
+#endif /* __MEMORY_SSA_CACHE_H_ */
@@ -12,6 +12,7 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/IRBuilder.h"
@@ -22,11 +23,13 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Instrumentation.h"
 
+#include "Instrument/SiteTable.h"
 #include "Utils/LLVM.h"
 
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace llvm {
 
@@ -35,7 +38,6 @@ class Slice;
 }
 
 namespace instrument {
-extern unsigned int AllocVarGuidStart;
 
 /* String constants for the names of tracker functions defined in
  * runtime/gobj_tracker.h
@@ -47,6 +49,33 @@ inline StringRef getRuntimeHookInitName() {
 
 inline StringRef getRuntimeHookName() { return "__orbit_alloc_gobj"; }
 
+inline StringRef getCallocHookName() { return "__orbit_calloc_gobj"; }
+
+// Takes the arena size class of a constant size along with it
+inline StringRef getAllocClassHookName() {
+  return "__orbit_alloc_gobj_class";
+}
+
+inline StringRef getAllocHookName() { return "__orbit_alloc_hook"; }
+
+inline StringRef getAllocHookSampledName() {
+  return "__orbit_alloc_hook_sampled";
+}
+
+/* The sampler state of runtime/gobj_sampler.h, which inline hooks update
+ * directly
+ */
+
+inline StringRef getSampleCountdownName() { return "orbit_sample_countdown"; }
+
+inline StringRef getSampleByBytesName() { return "orbit_sample_by_bytes"; }
+
+inline StringRef getFreeHookName() { return "__orbit_free_hook"; }
+
+inline StringRef getReallocHookName() { return "__orbit_realloc_hook"; }
+
+inline StringRef getWriteHookName() { return "__orbit_write_hook"; }
+
 inline StringRef getTrackDumpHookName() { return "__orbit_gobj_tracker_dump"; }
 
 inline StringRef getTrackHookFinishName() {
@@ -64,13 +93,112 @@ class AllocInstrumenter {
 
   bool initHookFuncs(Module *M, LLVMContext &context);
 
-  // instrument a call to hook func before an instruction.
-  // this instruction must be an allocation call instruction
+  // The allocators to hook and how to read their calls (see AllocDesc) come
+  // from the rules. Calls to movable allocators are replaced with an
+  // allocation from the tracker's arena, the others are observed after they
+  // return. The deallocation and reallocation sites the rules describe are
+  // hooked too, unless setHookFrees(false).
+  void setAllocRules(const AllocRules *rules) { _rules = rules; }
+  void setHookFrees(bool hook_frees) { _hook_frees = hook_frees; }
+
+  // With setReplaceAllocs(false), the calls to movable allocators are kept
+  // and observed like the others, so the code stays exactly as it was
+  // around them. Their objects are then not in the tracker's arena.
+  void setReplaceAllocs(bool replace) { _replace_allocs = replace; }
+
+  // Inline the sampling test of __orbit_alloc_hook at the observed sites, so
+  // that an allocation that is not sampled costs no call. Must come before
+  // initHookFuncs.
+  void setInlineHooks(bool inline_hooks) { _inline_hooks = inline_hooks; }
+
+  // In loops with a trip count known on entry, count the observed
+  // allocations of all the iterations down at once before the loop, and skip
+  // their hooks in the loop if none of them is sampled. Must come before
+  // initHookFuncs.
+  void setCoalesceLoops(bool coalesce) { _coalesce_loops = coalesce; }
+
+  // Describe the sites of all the functions on `threads` threads (0 for one
+  // per core) before instrumenting any of them. This is where the cost of
+  // computeSiteGuid goes, and it only reads the module; the instrumentation
+  // itself still follows module order, so the GUIDs and the output are the
+  // same for any number of threads.
+  void setPlanThreads(unsigned threads) { _plan_threads = threads; }
+
+  // Only instrument the allocation sites whose GUID (see computeSiteGuid) is
+  // in `guids`, e.g. those the analysis found to reach the target. The other
+  // allocations are left untouched. Deallocation and reallocation sites are
+  // still all hooked, as tracked objects may be released anywhere.
+  void setSelectedSites(const std::set<uint32_t> *guids) { _selected = guids; }
+
+  // Hook an allocation, deallocation or reallocation call. Calls in the
+  // allocators themselves (see AllocRules::should_ignore) are left alone, so
+  // an object is only tracked at the site that called the outer allocator.
   bool instrumentInstr(Instruction *instr);
 
+  // Instrument every site in the module. The sites are found through the
+  // users of the allocator (and deallocator) functions, so the cost depends
+  // on the number of sites rather than on the size of the module.
+  bool instrumentModule(Module &M);
+
+  // Hook the instructions that may write into a tracked object, e.g. those
+  // from findObjectWrites, with __orbit_write_hook. In each function, a hook
+  // is left out when a hook for the same base and a range that covers its
+  // own runs on every path to it with no call in between, and the hooks of
+  // writes to an address that does not change in a loop without calls run
+  // once before the loop. A mark may thus come before the write it stands
+  // for, see runtime/gobj_tracker.h.
+  bool instrumentWrites(const std::vector<Instruction *> &writes);
+
   uint32_t getInstrumentedCnt() { return _instrument_cnt; }
+  // Sites whose hooks were coalesced with setCoalesceLoops
+  uint32_t getCoalescedCnt() { return _coalesced_cnt; }
+  // Replaced sites of a constant size, which call the size class hook
+  uint32_t getSizeClassCnt() { return _size_class_cnt; }
+  // Hooks inserted by instrumentWrites, and the hooks it left out
+  uint32_t getWriteHookCnt() { return _write_hook_cnt; }
+  uint32_t getElidedWriteCnt() { return _elided_write_cnt; }
+
+  const std::vector<AllocSite> &getSites() const { return _sites; }
+  // Write the table of the instrumented sites, one tab-separated line
+  // (GUID, kind, file:line:column, function, allocator) per site
+  bool writeSiteTable(StringRef path) const;
 
  protected:
+  // Read the size and element count of an allocation to instrument. Returns
+  // false if it is not selected, or does not match `desc`.
+  bool getAllocArgs(CallSite cs, const AllocDesc &desc, Value *&size,
+                    Value *&count);
+  // Whether the allocation is replaced with the tracker's, or observed
+  bool isReplaced(CallSite cs, const AllocDesc &desc);
+  bool instrumentAlloc(CallSite cs, const AllocDesc &desc);
+  // Replace the allocation `cs` with the tracker's `new_instr`, which
+  // returns an i8*, and cast the result back to the original type
+  void replaceWithCast(CallSite cs, Instruction *new_instr);
+  // Find the observed allocations of `sites` (in F) that can be coalesced,
+  // and emit the count down of their loops
+  void planLoopGuards(Function &F, const std::vector<Instruction *> &sites);
+  // Emit orbit_sample() of runtime/gobj_sampler.h before `insert_pt`, calling
+  // __orbit_alloc_hook_sampled when the allocation is sampled
+  void emitInlineHook(Instruction *insert_pt, Value *ptr8, Value *size64,
+                      Value *site);
+  void instrumentWritesIn(Function &F,
+                          const std::vector<Instruction *> &writes);
+  bool instrumentDealloc(CallSite cs, unsigned arg_no);
+  bool instrumentRealloc(CallSite cs, unsigned arg_no);
+  // Where to insert code that uses the result of a call site
+  Instruction *getInsertPointAfter(CallSite cs);
+  // "alloc", "free" or "realloc", for the site table, or empty if the call
+  // is not instrumented
+  StringRef getSiteKind(CallSite cs);
+  // Describe the sites of each function in parallel, see setPlanThreads
+  void planSites(const std::vector<std::vector<Instruction *>> &sites);
+  // The description of the site planSites made, or a new one
+  AllocSite getSite(Instruction *instr, Function *callee, StringRef kind);
+  // Give the site its GUID from computeSiteGuid, unless another site has it
+  // already, and add the site to the table
+  uint32_t assignSiteGuid(Instruction *instr, Function *callee,
+                          StringRef kind);
+
   bool _initialized;
   uint32_t _instrument_cnt;
   // instrument printf to track alloc, useful for testing
@@ -80,14 +208,41 @@ class AllocInstrumenter {
   Function *_printf_func;
 
   Function *_track_gobj_func;
+  Function *_calloc_gobj_func;
+  Function *_alloc_gobj_class_func;
+  Function *_alloc_hook_func;
+  Function *_alloc_hook_sampled_func;
+  GlobalVariable *_sample_countdown;
+  GlobalVariable *_sample_by_bytes;
   Function *_tracker_init_func;
   Function *_tracker_dump_func;
   Function *_tracker_finish_func;
+  Function *_free_hook_func;
+  Function *_realloc_hook_func;
+  Function *_write_hook_func;
+
+  const AllocRules *_rules = nullptr;
+  bool _hook_frees = true;
+  bool _replace_allocs = true;
+  bool _inline_hooks = false;
+  bool _coalesce_loops = false;
+  uint32_t _coalesced_cnt = 0;
+  // Coalesced allocation -> whether its hook must run, i.e. its loop could
+  // not be counted down at once
+  std::map<Instruction *, Value *> _loop_guards;
+  uint32_t _write_hook_cnt = 0;
+  uint32_t _elided_write_cnt = 0;
+  uint32_t _size_class_cnt = 0;
+  const std::set<uint32_t> *_selected = nullptr;
+  unsigned _plan_threads = 1;
+  std::map<const Instruction *, AllocSite> _planned_sites;
 
   std::map<uint64_t, Instruction *> _guid_hook_point_map;
   std::map<Instruction *, uint64_t> _hook_point_guid_map;
+  std::vector<AllocSite> _sites;
 
   IntegerType *_I32Ty;
+  IntegerType *_I64Ty;
   PointerType *_I8PtrTy;
 };
 
@@ -26,11 +26,10 @@ class InstrumentAllocPass: public ModulePass {
   bool runOnModule(Module &M) override;
   void getAnalysisUsage(AnalysisUsage &AU) const override;
 
- protected:
-  bool runOnFunction(Function &F);
-
  protected:
   std::unique_ptr<instrument::AllocInstrumenter> _instrumenter;
+  std::unique_ptr<AllocRules> _rules;
+  std::set<uint32_t> _selected_sites;
 };
 
 } // end of namespace llvm
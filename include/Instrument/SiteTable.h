@@ -0,0 +1,57 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _SITE_TABLE_H_
+#define _SITE_TABLE_H_
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace instrument {
+
+// An instrumented allocation, deallocation or reallocation site
+struct AllocSite {
+  uint32_t guid;
+  std::string kind;
+  // Empty without debug information
+  std::string file;
+  unsigned line = 0;
+  unsigned column = 0;
+  std::string function;
+  std::string allocator;
+};
+
+// Derive the GUID of the call `instr` to `callee` from its debug location,
+// caller, callee and `kind` ("alloc", "free" or "realloc"), so that it is
+// stable across rebuilds and the same in the analysis and the instrumentor.
+// Without debug information, the position of the call among the calls to
+// `callee` in the caller is used instead. The result is never 0 or ~0, but
+// two sites may share it; the instrumentor resolves such collisions.
+uint32_t computeSiteGuid(const Instruction *instr, const Function *callee,
+                         StringRef kind);
+
+// Describe the site, with the GUID from computeSiteGuid
+AllocSite describeSite(const Instruction *instr, const Function *callee,
+                       StringRef kind);
+
+// The table of sites is a text file with one tab-separated line (GUID, kind,
+// file:line:column, function, allocator) per site, and '#' comments
+bool writeSiteTable(StringRef path, const std::vector<AllocSite> &sites);
+// Read the GUIDs listed in a table of sites into `guids`
+bool readSiteGuids(StringRef path, std::set<uint32_t> &guids);
+
+}  // namespace instrument
+}  // namespace llvm
+
+#endif /* _SITE_TABLE_H_ */
@@ -11,16 +11,21 @@
 
 #include "CallGraph/CallGraph.h"
 #include "DefUse/DefUse.h"
+#include "ObiWanAnalysis/ShadowModule.h"
 #include "Utils/LLVM.h"
 
 #include "llvm/IR/Value.h"
 
+#include <set>
+#include <string>
+#include <vector>
+
 using namespace llvm;
 using namespace defuse;
 
 class ObiWanAnalysis {
  private:
-  CallGraph callGraph;
+  ::CallGraph callGraph;
   Value *root;      // llvm Value to track
   Function *start;  // heap allocation's parent function
   Function *end;    // target function (eg: check_and_resolve)
@@ -29,10 +34,37 @@ class ObiWanAnalysis {
 
  public:
   ObiWanAnalysis(Value *root, Function *start, Function *end,
-      const AllocRules &rules);
+      const AllocRules &rules, const UserGraphContext &ctx = {});
   ~ObiWanAnalysis() {};
   bool isAllocationPoint();
   void performDefUse();
 };
 
+// Allocation, deallocation and ignore rules for the systems we analyze
+AllocRules::Initializer getDefaultAllocRules(const Module &M);
+
+// Run the analysis on every call site of the allocation functions in `rules`
+// and return those whose allocated object can reach `target`. If `callers`
+// is not empty, only the sites inside these (demangled) functions are used.
+std::vector<Instruction *> findAllocationPoints(
+    Function *target, const AllocRules &rules,
+    const UserGraphContext &ctx = {},
+    const std::set<std::string> &callers = {});
+
+// Same as above, but the analysis runs on the canonicalized shadow module
+// (`target` and `rules` refer to the original module), and the allocation
+// points are mapped back to the original call instructions.
+std::vector<Instruction *> findAllocationPoints(
+    Function *target, ShadowModule &shadow, const AllocRules &rules,
+    const UserGraphContext &ctx = {},
+    const std::set<std::string> &callers = {});
+
+// The instructions that may write into the objects allocated at `points`:
+// the stores, atomic updates and memory intrinsics whose address derives
+// (through casts, GEPs, phis and selects) from a value that the walk found
+// to hold a pointer to one of the objects. They are in module order.
+std::vector<Instruction *> findObjectWrites(
+    const std::vector<Instruction *> &points, const AllocRules &rules,
+    const UserGraphContext &ctx = {});
+
 #endif  // _OBIWANANALYSIS_H_
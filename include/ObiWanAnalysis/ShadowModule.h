@@ -0,0 +1,57 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _SHADOW_MODULE_H_
+#define _SHADOW_MODULE_H_
+
+#include <map>
+#include <memory>
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+// A canonicalized copy of a module to run the analysis on.
+//
+// Targets built at -O0 keep every local in an alloca, so the user graph walk
+// has to go through a store, the alloca and a load for each variable. The
+// shadow module is a clone of the original with mem2reg, SROA and a cheap
+// instcombine applied, which leaves a much smaller SSA graph. Instructions of
+// interest (the allocation sites) can be mapped between both modules, so the
+// verdicts on the shadow sites can be reported and instrumented on the
+// original ones.
+class ShadowModule {
+ public:
+  // The original module must be fully materialized
+  ShadowModule(Module &M);
+
+  Module &get() { return *_shadow; }
+
+  // Run the canonicalizing passes on the shadow module
+  void canonicalize();
+
+  // The shadow counterpart of an original value, or nullptr if it was
+  // optimized away
+  Value *toShadow(const Value *orig) const;
+  Function *toShadow(const Function *orig) const;
+  // The original allocation site of a shadow one, or nullptr if the shadow
+  // instruction does not come from a call in the original module
+  Instruction *toOriginal(const Instruction *shadow) const;
+
+ private:
+  Module &_orig;
+  ValueToValueMapTy _vmap;
+  std::unique_ptr<Module> _shadow;
+  // Built after canonicalization, since the passes may delete or replace
+  // instructions tracked by the value map
+  std::map<const Instruction *, Instruction *> _reverse;
+};
+
+#endif  // _SHADOW_MODULE_H_
@@ -0,0 +1,96 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef __POINTS_TO_H_
+#define __POINTS_TO_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+namespace llvm {
+namespace pointsto {
+
+// Unification-based (Steensgaard-style) points-to analysis.
+//
+// Every value gets a node, and nodes are merged into equivalence classes with
+// a union-find. A class has at most one pointee class, so assignments simply
+// unify the pointee classes of both sides, which makes the whole analysis
+// near-linear in the size of the module. It is flow-, context- and
+// field-insensitive. External functions returning noalias pointers are
+// treated as allocators; everything passed to or returned by the other
+// external functions is merged into a single unknown class, which points to
+// itself.
+//
+// Function objects carry the classes of their parameters and return value,
+// so a call through a pointer is resolved to all the functions in the
+// pointee class of the called value.
+class PointsToAnalysis {
+ public:
+  PointsToAnalysis(Module &M);
+
+  // Class of the object that `v` points to after following `derefs` more
+  // dereferences, or -1 if the analysis knows nothing about it, including
+  // when it may come from or go to unknown library code
+  int getPointeeClass(const Value *v, unsigned derefs = 0) const;
+
+  // Possible callees of an indirect call, empty for direct calls
+  const std::vector<Function *> &getCallees(CallSite cs) const;
+  // Indirect call sites that may call `fun`
+  const std::vector<Instruction *> &getIndirectCallers(Function *fun) const;
+
+  size_t getNodeCnt() const { return _nodes.size(); }
+  size_t getIndirectCallCnt() const { return _callees.size(); }
+
+ private:
+  struct Node {
+    unsigned parent;
+    unsigned rank;
+    int pointee;
+    // Function objects: classes of the parameters and of the return value
+    std::vector<unsigned> args;
+    int ret;
+    std::vector<Function *> funs;
+  };
+
+  unsigned makeNode();
+  unsigned find(unsigned n);
+  unsigned findConst(unsigned n) const;
+  void join(unsigned a, unsigned b);
+  unsigned pointee(unsigned n);
+  unsigned pts(const Value *v) { return pointee(nodeOf(v)); }
+  unsigned lamArg(unsigned fun_class, unsigned i);
+  unsigned lamRet(unsigned fun_class);
+
+  unsigned nodeOf(const Value *v);
+  int lookup(const Value *v) const;
+  // getPointeeClass, but with the unknown class as it is
+  int findClass(const Value *v, unsigned derefs) const;
+
+  void addFunction(Function &F);
+  void addInitializer(unsigned obj, const Constant *init);
+  void addCall(CallSite cs);
+  void addInstruction(Instruction &I);
+  void resolveCalls();
+
+  std::vector<Node> _nodes;
+  unsigned _unknown;
+  std::unordered_map<const Value *, unsigned> _value_nodes;
+  std::vector<Instruction *> _indirect_calls;
+  std::unordered_map<const Instruction *, std::vector<Function *>> _callees;
+  std::unordered_map<const Function *, std::vector<Instruction *>> _callers;
+};
+
+}  // namespace pointsto
+}  // namespace llvm
+
+#endif /* __POINTS_TO_H_ */
@@ -8,6 +8,7 @@
 #ifndef _UTILS_LLVM_H_
 #define _UTILS_LLVM_H_
 
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -28,13 +29,60 @@
 #include "llvm/Demangle/Demangle.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/CallSite.h"
 
 using namespace llvm;
 
+// Parse an IR or bitcode file. With `lazy` set, only the module skeleton is
+// read and function bodies are left to be materialized on demand (see
+// FunctionMaterializer below).
 std::unique_ptr<llvm::Module> parseModule(llvm::LLVMContext& context,
-                                          std::string inputFile);
+                                          std::string inputFile,
+                                          bool lazy = false);
+
+// Materializes function bodies of a lazily loaded module when they are first
+// needed, and counts how many bodies were actually read from the bitcode.
+// For a fully loaded module every call is a no-op.
+class FunctionMaterializer {
+ public:
+  FunctionMaterializer(Module& M);
+
+  // Read the body of F if it has not been read yet
+  bool materialize(Function* F);
+  // Read the bodies that refer to GV, directly or through constant
+  // expressions, so that its use list is complete (uses in the initializers
+  // of globals are always read). The first call prescans the bitcode file
+  // once for the globals that each body refers to, keeping a single body in
+  // memory at a time; if that fails, every body is read instead.
+  bool materializeUsersOf(const GlobalValue* GV);
+  // Read all remaining bodies. This is needed before any query that relies on
+  // complete use lists of the whole module (e.g. the points-to analysis), and
+  // before verifying or writing the module.
+  bool materializeAll();
+
+  bool isLazy() const { return _lazy_cnt > 0; }
+  // Whether a body could not be read, so that results are incomplete. The
+  // errors were reported as they happened.
+  bool hasFailed() const { return _failed; }
+  unsigned getMaterializedCnt() const { return _materialized_cnt; }
+  unsigned getLazyCnt() const { return _lazy_cnt; }
+  void printStats(raw_ostream& os) const;
+
+ private:
+  bool indexUsers();
+
+  Module& _M;
+  bool _all_materialized;
+  unsigned _lazy_cnt;
+  unsigned _materialized_cnt;
+  bool _failed = false;
+  // The functions whose bodies refer to each global, once indexUsers ran
+  bool _indexed = false;
+  bool _index_failed = false;
+  std::map<const GlobalValue*, std::vector<Function*>> _users;
+};
 
 std::string demangleName(std::string);
 
@@ -56,13 +104,28 @@ extractCallerCallee(CallSite call, unsigned arg_no);
 
 Constant *stripBitCastsAndAlias(Constant *c);
 
+// How to read a call to an allocation function. The allocated pointer is
+// the return value; argument numbers are -1 when there is no such argument.
+struct AllocDesc {
+  // The size in bytes, or of each element with count_arg. Without it (e.g.
+  // strdup) the size is unknown.
+  int size_arg = -1;
+  // The number of elements, for calloc-like functions
+  int count_arg = -1;
+  // The pool the object is allocated from, for pool allocators
+  int pool_arg = -1;
+  // The objects are released with free() or realloc(), or never, so the
+  // tracker may allocate them from its own arena instead
+  bool movable = false;
+};
+
 // TODO: lifecycle based alloc/dealloc rule
 struct AllocRules {
   struct Initializer {
     // Module of functions to search for
     const Module &M;
     // Initialize the rules by searching for function names
-    std::set<std::string> alloc;
+    std::map<std::string, AllocDesc> alloc;
     std::map<std::string, unsigned> dealloc;
     std::map<std::string, unsigned> realloc;
     std::set<std::string> ignored;
@@ -70,7 +133,7 @@ struct AllocRules {
 
   // Current rule for alloc does not allow data flow into allocation
   // functions, and the allocated pointer defaults to the return value.
-  std::set<const Function *> alloc;
+  std::map<const Function *, AllocDesc> alloc;
   // Dealloc and realloc allow specifying the argument number of
   // previously allocated value.
   std::map<const Function *, unsigned> dealloc;
@@ -80,10 +143,23 @@ struct AllocRules {
   // use exact matching. This will be the last rule to match on.
   std::set<const Function *> ignored;
 
+  AllocRules() = default;
   AllocRules(const Initializer &init);
 
   // TODO: split this into several different predicates
   bool should_ignore(const Function* fun) const;
 };
 
+// Add the rules of a text file to `init`, replacing those for the same
+// functions, so that a new system can be described without rebuilding the
+// tools. Each line has a kind, a demangled function name (or an ignore
+// pattern) and the arguments, separated by tabs; '#' starts a comment:
+//
+//   alloc    calloc       count=0 size=1 movable
+//   alloc    ngx_palloc   pool=0 size=1
+//   dealloc  ngx_pfree    1
+//   realloc  zrealloc     0
+//   ignore   ngx_pool_*
+bool readAllocRules(StringRef path, AllocRules::Initializer &init);
+
 #endif /* _UTILS_LLVM_H_ */
@@ -103,6 +103,7 @@ static void explainDefUseChain(const UserGraph::UserNodeList &userList,
 
 /* Entry function of allocation point usage analysis */
 bool UserGraph::run(UserGraphWalkType t) {
+  if (ctx.pts) rootClass = ctx.pts->getPointeeClass(root);
   if (t == UserGraphWalkType::DFS) {
     // FIXME: DFS will not work right now
     return false;
@@ -124,6 +125,13 @@ bool UserGraph::run(UserGraphWalkType t) {
   return false;
 }
 
+void UserGraph::findObjectPointers(SmallPtrSetImpl<Value *> &pointers) {
+  if (ctx.pts) rootClass = ctx.pts->getPointeeClass(root);
+  doBFS(false);
+  for (auto &[value, chains] : visited)
+    if (chains.count(nullptr) != 0) pointers.insert(value);
+}
+
 /*
  * Rebuild visited information to only include target function arguments
  * and global variables. Also rebuild queue/stack to start second phase
@@ -180,7 +188,8 @@ bool UserGraph::prepareThirdPhase(UserGraphWalkType walk) {
 }
 
 bool UserGraph::addCallScope(Function *fun, UserGraphWalkType walk) {
-  if (fun == nullptr || isIncompatibleFun(fun)) return false;
+  if (fun == nullptr || isIncompatibleFun(fun) || !enterFunction(fun))
+    return false;
 
   // Find visits, match the chains, and insert elements to the queue/stack.
   // This helper also handles nested constexpr GEP.
@@ -258,15 +267,14 @@ bool UserGraph::addCallScope(Function *fun, UserGraphWalkType walk) {
     }
     // Recursively handle function calls
     else if (isa<CallInst>(&I) || isa<InvokeInst>(&I)) {
-      auto [caller, callee, _] = extractCallerCallee(CallSite(&I), 0);
-      if (callee == nullptr) continue;
-
-      auto callee_insts = calleeCallerMap.find(callee);
-      if (callee_insts == calleeCallerMap.end()) {
-        calleeCallerMap[callee].insert(&I);
-        addCallScope(callee, walk);
-      } else {
-        callee_insts->second.insert(&I);
+      for (Function *callee : findCallees(CallSite(&I))) {
+        auto callee_insts = calleeCallerMap.find(callee);
+        if (callee_insts == calleeCallerMap.end()) {
+          calleeCallerMap[callee].insert(&I);
+          addCallScope(callee, walk);
+        } else {
+          callee_insts->second.insert(&I);
+        }
       }
     }
 
@@ -572,6 +580,7 @@ bool UserGraph::processUser(Value *elem, const FieldChain &chain,
       for (auto inst : calleeCallerMap[this_func])
         insertElement(inst, chain, last, walk);
     } else if (!scoped) {
+      requireUsersOf(this_func);
       for (auto user : this_func->users()) {
         if (Instruction *inst = dyn_cast<Instruction>(user)) {
           if (!(isa<CallInst>(inst) || isa<InvokeInst>(inst)))
@@ -585,6 +594,14 @@ bool UserGraph::processUser(Value *elem, const FieldChain &chain,
           insertElement(user, chain, last, walk);
         }
       }
+      if (ctx.pts) {
+        for (Instruction *inst : ctx.pts->getIndirectCallers(this_func)) {
+          if (isIncompatibleFun(inst->getFunction())) continue;
+          callGraph->addEdge(this_func, inst->getFunction());
+          calleeCallerMap[this_func].insert(inst);
+          insertElement(inst, chain, last, walk);
+        }
+      }
     }
   }
   // Modification was in a return value, then add the return instructions
@@ -625,6 +642,22 @@ bool UserGraph::processUser(Value *elem, const FieldChain &chain,
    *
    * One exception is that src finding for StoreInst is merged into this loop.
    */
+  // Users of a global may be spread over any function body
+  if (Constant *c = dyn_cast<Constant>(elem)) requireUsersOf(c);
+
+  // If the walk got to this pointer through a store, a load is only left
+  // out when another store definitely wrote the value it reads, and that
+  // store's value is not followed by the walk either
+  SmallPtrSet<StoreInst *, 4> incoming_stores;
+  if (ctx.mssa && !isa<Constant>(elem))
+    findIncomingStores(elem, last, incoming_stores);
+  auto store_reaches = [this, &incoming_stores](LoadInst *load) {
+    if (incoming_stores.empty()) return true;
+    StoreInst *store = ctx.mssa->getDefiningStore(load);
+    return store == nullptr || incoming_stores.count(store) != 0 ||
+           visited.count(store->getValueOperand()) != 0;
+  };
+
   for (User *user : elem->users()) {
     if (scoped && !isa<Instruction>(user)) continue;
 
@@ -645,6 +678,7 @@ bool UserGraph::processUser(Value *elem, const FieldChain &chain,
         }
       }
     } else if (isa<LoadInst>(user)) {
+      if (!store_reaches(cast<LoadInst>(user))) continue;
       auto newchain = match_deref(chain);
       if (newchain.hasValue()) {
         if (newchain.getValue().get() == nullptr)
@@ -689,16 +723,11 @@ bool UserGraph::processUser(Value *elem, const FieldChain &chain,
           // Unsupported global var usage
           continue;
         }
-      } else if (Function *fun = dyn_cast<Function>(c)) {
-        (void)fun;
-        // TODO: add function pointer into data flow analysis
-        continue;
-        /* auto newchain = match_call(chain, fun);
-        if (newchain.hasValue()) {
-          if (newchain.getValue().get() == nullptr)
-            returnTrueIfScoped;
-            // addHitPoint(load);
-        } */
+      } else if (isa<Function>(c)) {
+        // A cast of a function pointer, e.g. a callback stored into a table
+        // of another type: follow it as-is, calls through it are resolved
+        // with the points-to sets
+        insertElement(user, chain, last, walk);
       } else if (isa<GlobalVariable>(c)) {
         // Do nothing, fall to search for users
         insertElement(user, chain, last, walk);
@@ -744,18 +773,29 @@ void UserGraph::processCall(CallSite call, Value *arg, const FieldChain &chain,
   for (arg_no = 0; arg_no < call.getNumArgOperands(); arg_no++) {
     if (call.getArgOperand(arg_no) == arg) break;
   }
+  // The tracked pointer is the called function, not passed to it
+  if (arg_no == call.getNumArgOperands()) return;
   auto [caller, callee, new_arg_no] = extractCallerCallee(call, arg_no);
   arg_no = new_arg_no;
+  std::vector<Function *> callees;
+  if (callee)
+    callees.push_back(callee);
+  else
+    callees = findCallees(call);
   // Still cannot get callee with either direct or indirect call, skip.
-  if (!callee) return;
-
-  if (isIncompatibleFun(callee) || callee->isVarArg()) return;
-  callGraph->addEdge(caller, callee);
-  Argument *passed_arg = callee->arg_begin() + arg_no;
-  insertElement(passed_arg, chain, last, walk);
-
-  // TODO: Take care of arg shift like pthread_create
-  calleeCallerMap[callee].insert(inst);
+  for (Function *callee : callees) {
+    if (isIncompatibleFun(callee) || callee->isVarArg()) continue;
+    // A callee of a cast function pointer may take fewer arguments
+    if (arg_no >= callee->arg_size()) continue;
+    // A body that cannot be read would look like a declaration
+    if (!enterFunction(callee)) continue;
+    callGraph->addEdge(caller, callee);
+    Argument *passed_arg = callee->arg_begin() + arg_no;
+    insertElement(passed_arg, chain, last, walk);
+
+    // TODO: Take care of arg shift like pthread_create
+    calleeCallerMap[callee].insert(inst);
+  }
 }
 
 void UserGraph::processArgument(Argument *arg, const FieldChain &chain,
@@ -770,9 +810,9 @@ void UserGraph::processArgument(Argument *arg, const FieldChain &chain,
   if (DBG) errs() << "    function name is: " << fun->getName() << "\n";
 
   auto add_caller_arg = [this, arg, &chain, last, walk, fun](CallSite call_site) {
-    // TODO: handle indirect call
     auto [caller, callee, _] = extractCallerCallee(call_site, arg->getArgNo());
-    if (callee != fun)
+    // Indirect calls are only known to call `fun` through the points-to sets
+    if (callee != fun && !(callee == nullptr && ctx.pts))
       return;
     Value *caller_arg = call_site.getArgOperand(arg->getArgNo());
     if (DBG) errs() << "    func user: " << *call_site.getInstruction() << '\n';
@@ -787,6 +827,7 @@ void UserGraph::processArgument(Argument *arg, const FieldChain &chain,
       add_caller_arg(CallSite(call_inst));
     }
   } else if (!scoped) {
+    requireUsersOf(fun);
     for (User *call_inst : fun->users()) {
       if (isa<CallInst>(call_inst) || isa<InvokeInst>(call_inst)) {
         add_caller_arg(CallSite(call_inst));
@@ -796,7 +837,10 @@ void UserGraph::processArgument(Argument *arg, const FieldChain &chain,
             add_caller_arg(CallSite(call));
         }
       }
-      // TODO: function pointer data flow
+    }
+    if (ctx.pts) {
+      for (Instruction *call_inst : ctx.pts->getIndirectCallers(fun))
+        add_caller_arg(CallSite(call_inst));
     }
   }
 }
@@ -817,6 +861,10 @@ void UserGraph::insertElementWalk(Value *elem, const FieldChain &chain,
 void UserGraph::insertElement(Value *elem, const FieldChain &chain,
                               ssize_t last, UserGraphWalkType walk)
 {
+  if (!mayReachRoot(elem, chain)) {
+    if (DBG) errs() << "        insert pruned by points-to: " << *elem << '\n';
+    return;
+  }
   auto &visited_elem = visited[elem];
   bool is_new_chain = visited_elem.insert({chain, last}).second;
   if (is_new_chain && visited_elem.size() <= 3 && chain.length() < 10) {
@@ -850,3 +898,71 @@ bool UserGraph::isIncompatibleFun(Function *fun) {
   }
   return false;
 }
+
+bool UserGraph::enterFunction(Function *fun) {
+  return ctx.materializer == nullptr || ctx.materializer->materialize(fun);
+}
+
+/*
+ * Use lists only cover bodies that were read, so any lookup of the users of
+ * a constant on a lazily loaded module has to read the bodies that refer to
+ * the globals it is made of first.
+ */
+void UserGraph::requireUsersOf(Constant *c) {
+  if (ctx.materializer == nullptr) return;
+  SmallPtrSet<Constant *, 8> seen;
+  SmallVector<Constant *, 8> worklist{c};
+  while (!worklist.empty()) {
+    Constant *cur = worklist.pop_back_val();
+    if (!seen.insert(cur).second) continue;
+    if (GlobalValue *GV = dyn_cast<GlobalValue>(cur)) {
+      ctx.materializer->materializeUsersOf(GV);
+      continue;
+    }
+    for (Value *op : cur->operands()) worklist.push_back(cast<Constant>(op));
+  }
+}
+
+/*
+ * A pointer reached from `store %src, %ptr` is inserted with %src's node as
+ * its previous node, so the stores can be recovered from the walk history.
+ * Only available for BFS, which keeps the history.
+ */
+void UserGraph::findIncomingStores(Value *elem, ssize_t last,
+                                   SmallPtrSetImpl<StoreInst *> &stores) {
+  if (last < 0 || (size_t)last >= userList.size()) return;
+  ssize_t prev = std::get<2>(userList[last]);
+  if (prev < 0) return;
+  Value *src = std::get<0>(userList[prev]);
+  for (User *user : src->users()) {
+    if (StoreInst *store = dyn_cast<StoreInst>(user)) {
+      if (store->getValueOperand() == src && store->getPointerOperand() == elem)
+        stores.insert(store);
+    }
+  }
+}
+
+std::vector<Function *> UserGraph::findCallees(CallSite call) {
+  auto [caller, callee, _] = extractCallerCallee(call, 0);
+  if (callee) return {callee};
+  if (ctx.pts) return ctx.pts->getCallees(call);
+  return {};
+}
+
+/*
+ * A node reaches the object through its chain: each deref in the chain is
+ * one more level of indirection, while fields and offsets stay within the
+ * same (field-insensitive) class. If the points-to class at that depth is
+ * known and is not the object's class, nothing allocated at the root can
+ * flow through this node. Values that external code may have produced or
+ * seen have no known class, so they are always followed.
+ */
+bool UserGraph::mayReachRoot(Value *elem, const FieldChain &chain) {
+  if (ctx.pts == nullptr || rootClass < 0) return true;
+  unsigned derefs = 0;
+  for (FieldChainElem *e = chain.get(); e != nullptr; e = e->next.get()) {
+    if (e->type == FieldChainElem::type::deref) derefs++;
+  }
+  int cls = ctx.pts->getPointeeClass(elem, derefs);
+  return cls < 0 || cls == rootClass;
+}
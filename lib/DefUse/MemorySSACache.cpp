@@ -0,0 +1,54 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#include "DefUse/MemorySSACache.h"
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::defuse;
+
+MemorySSACache::FunctionInfo::FunctionInfo(Function &F,
+                                           const TargetLibraryInfo &TLI)
+    : dt(F),
+      ac(F),
+      basic_aa(F.getParent()->getDataLayout(), TLI, ac, &dt),
+      aa(TLI) {
+  aa.addAAResult(basic_aa);
+  mssa = std::make_unique<MemorySSA>(F, &aa, &dt);
+}
+
+MemorySSACache::FunctionInfo &MemorySSACache::get(Function *F) {
+  auto it = _cache.find(F);
+  if (it != _cache.end()) return *it->second;
+  if (!_tli) {
+    _tlii = std::make_unique<TargetLibraryInfoImpl>(
+        Triple(F->getParent()->getTargetTriple()));
+    _tli = std::make_unique<TargetLibraryInfo>(*_tlii);
+  }
+  auto &info = _cache[F];
+  info = std::make_unique<FunctionInfo>(*F, *_tli);
+  return *info;
+}
+
+StoreInst *MemorySSACache::getDefiningStore(LoadInst *load) {
+  FunctionInfo &info = get(load->getFunction());
+  MemorySSA &mssa = *info.mssa;
+  // The walker already skips the defs that cannot alias the location
+  MemoryAccess *clobber = mssa.getWalker()->getClobberingMemoryAccess(load);
+  MemoryDef *def = dyn_cast<MemoryDef>(clobber);
+  if (def == nullptr || mssa.isLiveOnEntryDef(def)) return nullptr;
+  StoreInst *store = dyn_cast_or_null<StoreInst>(def->getMemoryInst());
+  if (store == nullptr ||
+      info.aa.alias(MemoryLocation::get(store), MemoryLocation::get(load)) !=
+          MustAlias)
+    return nullptr;
+  return store;
+}
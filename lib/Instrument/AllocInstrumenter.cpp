@@ -8,20 +8,41 @@
 
 #include "Instrument/AllocInstrumenter.h"
 
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#if LLVM_VERSION_MAJOR >= 11
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#else
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#endif
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
+#include "gobj_arena.h"
+
 #include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/DebugLoc.h>
 
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #define DEBUG_TYPE "alloc-instrumenter"
 
@@ -30,9 +51,6 @@ using namespace llvm;
 using namespace llvm::slicing;
 using namespace llvm::instrument;
 
-unsigned int llvm::instrument::AllocVarGuidStart = 200;
-static unsigned int AllocVarCurrentGuid = llvm::instrument::AllocVarGuidStart;
-
 bool AllocInstrumenter::initHookFuncs(Module *M, LLVMContext &llvm_context) {
   if (_initialized) {
     errs() << "already initialized\n";
@@ -48,6 +66,7 @@ bool AllocInstrumenter::initHookFuncs(Module *M, LLVMContext &llvm_context) {
   auto VoidTy = Type::getVoidTy(llvm_context);
 
   _I32Ty = Type::getInt32Ty(llvm_context);
+  _I64Ty = Type::getInt64Ty(llvm_context);
 
   // need i8* for later orbit_track_gobj call
   _I8PtrTy = Type::getInt8PtrTy(llvm_context);
@@ -73,8 +92,8 @@ bool AllocInstrumenter::initHookFuncs(Module *M, LLVMContext &llvm_context) {
                    << "\n");
     }
 
-    _track_gobj_func = cast<Function>(
-        M->getOrInsertFunction(getRuntimeHookName(), _I8PtrTy, _I32Ty));
+    _track_gobj_func = cast<Function>(M->getOrInsertFunction(
+        getRuntimeHookName(), _I8PtrTy, _I64Ty, _I32Ty));
     if (!_track_gobj_func) {
       errs() << "could not find function " << getRuntimeHookName() << "\n";
       return false;
@@ -83,6 +102,80 @@ bool AllocInstrumenter::initHookFuncs(Module *M, LLVMContext &llvm_context) {
                    << "\n");
     }
 
+    _calloc_gobj_func = cast<Function>(M->getOrInsertFunction(
+        getCallocHookName(), _I8PtrTy, _I64Ty, _I64Ty, _I32Ty));
+    if (!_calloc_gobj_func) {
+      errs() << "could not find function " << getCallocHookName() << "\n";
+      return false;
+    } else {
+      DEBUG(dbgs() << "found calloc gobj function " << getCallocHookName()
+                   << "\n");
+    }
+
+    _alloc_gobj_class_func = cast<Function>(M->getOrInsertFunction(
+        getAllocClassHookName(), _I8PtrTy, _I64Ty, _I32Ty, _I32Ty));
+    if (!_alloc_gobj_class_func) {
+      errs() << "could not find function " << getAllocClassHookName() << "\n";
+      return false;
+    } else {
+      DEBUG(dbgs() << "found alloc gobj class function "
+                   << getAllocClassHookName() << "\n");
+    }
+
+    _alloc_hook_func = cast<Function>(M->getOrInsertFunction(
+        getAllocHookName(), VoidTy, _I8PtrTy, _I64Ty, _I32Ty));
+    if (!_alloc_hook_func) {
+      errs() << "could not find function " << getAllocHookName() << "\n";
+      return false;
+    } else {
+      DEBUG(dbgs() << "found alloc hook function " << getAllocHookName()
+                   << "\n");
+    }
+
+    if (_inline_hooks)
+      _alloc_hook_sampled_func = cast<Function>(M->getOrInsertFunction(
+          getAllocHookSampledName(), VoidTy, _I8PtrTy, _I64Ty, _I32Ty));
+    if (_inline_hooks || _coalesce_loops) {
+      // Declared like in runtime/gobj_sampler.h: the runtime is linked into
+      // the program, so the initial-exec model is enough
+      _sample_countdown = cast<GlobalVariable>(
+          M->getOrInsertGlobal(getSampleCountdownName(), _I64Ty));
+      _sample_countdown->setThreadLocalMode(
+          GlobalValue::InitialExecTLSModel);
+      _sample_by_bytes = cast<GlobalVariable>(
+          M->getOrInsertGlobal(getSampleByBytesName(), _I32Ty));
+    }
+
+    _free_hook_func = cast<Function>(
+        M->getOrInsertFunction(getFreeHookName(), VoidTy, _I8PtrTy, _I32Ty));
+    if (!_free_hook_func) {
+      errs() << "could not find function " << getFreeHookName() << "\n";
+      return false;
+    } else {
+      DEBUG(dbgs() << "found free hook function " << getFreeHookName()
+                   << "\n");
+    }
+
+    _realloc_hook_func = cast<Function>(M->getOrInsertFunction(
+        getReallocHookName(), VoidTy, _I8PtrTy, _I8PtrTy, _I64Ty, _I32Ty));
+    if (!_realloc_hook_func) {
+      errs() << "could not find function " << getReallocHookName() << "\n";
+      return false;
+    } else {
+      DEBUG(dbgs() << "found realloc hook function " << getReallocHookName()
+                   << "\n");
+    }
+
+    _write_hook_func = cast<Function>(
+        M->getOrInsertFunction(getWriteHookName(), VoidTy, _I8PtrTy, _I64Ty));
+    if (!_write_hook_func) {
+      errs() << "could not find function " << getWriteHookName() << "\n";
+      return false;
+    } else {
+      DEBUG(dbgs() << "found write hook function " << getWriteHookName()
+                   << "\n");
+    }
+
     _tracker_dump_func =
         cast<Function>(M->getOrInsertFunction(getTrackDumpHookName(), I1Ty));
     if (!_tracker_dump_func) {
@@ -138,6 +231,186 @@ bool AllocInstrumenter::initHookFuncs(Module *M, LLVMContext &llvm_context) {
   return true;
 }
 
+bool AllocInstrumenter::instrumentModule(Module &M) {
+  if (_rules == nullptr) return false;
+  std::set<const Function *> callees;
+  for (auto &alloc : _rules->alloc) callees.insert(alloc.first);
+  if (_hook_frees) {
+    for (auto &dealloc : _rules->dealloc) callees.insert(dealloc.first);
+    for (auto &realloc : _rules->realloc) callees.insert(realloc.first);
+  }
+
+  std::map<const Function *, std::set<Instruction *>> sites;
+  for (const Function *callee : callees) {
+    for (const User *user : callee->users()) {
+      CallSite cs((Value *)user);
+      // Also a user: the function passed as an argument
+      if (!cs || cs.getCalledFunction() != callee ||
+          _rules->should_ignore(cs.getCaller()))
+        continue;
+      sites[cs.getCaller()].insert(cs.getInstruction());
+    }
+  }
+
+  // Instrument in module order, so that the site table and the resolution
+  // of GUID collisions do not depend on the order of the use lists
+  std::vector<Function *> funcs;
+  std::vector<std::vector<Instruction *>> ordered;
+  for (Function &F : M) {
+    auto caller = sites.find(&F);
+    if (caller == sites.end()) continue;
+    funcs.push_back(&F);
+    ordered.emplace_back();
+    for (Instruction &I : instructions(F))
+      if (caller->second.count(&I) != 0) ordered.back().push_back(&I);
+  }
+  planSites(ordered);
+
+  bool modified = false;
+  for (size_t i = 0; i < funcs.size(); i++) {
+    if (_coalesce_loops) planLoopGuards(*funcs[i], ordered[i]);
+    for (Instruction *instr : ordered[i]) modified |= instrumentInstr(instr);
+    _loop_guards.clear();
+  }
+  _planned_sites.clear();
+  return modified;
+}
+
+StringRef AllocInstrumenter::getSiteKind(CallSite cs) {
+  Function *callee = cs.getCalledFunction();
+  // The calls inside the allocators themselves, e.g. the malloc in zmalloc,
+  // belong to the sites that call the allocator
+  if (_rules->should_ignore(cs.getCaller())) return "";
+  if (_hook_frees) {
+    if (_rules->dealloc.count(callee) != 0) return "free";
+    if (_rules->realloc.count(callee) != 0) return "realloc";
+  }
+  return _rules->alloc.count(callee) != 0 ? "alloc" : "";
+}
+
+void AllocInstrumenter::planSites(
+    const std::vector<std::vector<Instruction *>> &sites) {
+  // Only reads the module. Each function's sites are described into a slot
+  // of their own, so the result does not depend on the thread that did it.
+  std::vector<std::vector<AllocSite>> described(sites.size());
+  std::atomic<size_t> next(0);
+  auto work = [this, &sites, &described, &next]() {
+    for (size_t i; (i = next++) < sites.size();) {
+      for (Instruction *instr : sites[i]) {
+        CallSite cs(instr);
+        StringRef kind = getSiteKind(cs);
+        described[i].push_back(
+            kind.empty() ? AllocSite()
+                         : describeSite(instr, cs.getCalledFunction(), kind));
+      }
+    }
+  };
+  size_t threads = _plan_threads;
+  if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+  threads = std::min(threads, sites.size());
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < threads; t++) workers.emplace_back(work);
+  work();
+  for (std::thread &worker : workers) worker.join();
+
+  for (size_t i = 0; i < sites.size(); i++)
+    for (size_t j = 0; j < sites[i].size(); j++)
+      _planned_sites[sites[i][j]] = std::move(described[i][j]);
+}
+
+AllocSite AllocInstrumenter::getSite(Instruction *instr, Function *callee,
+                                     StringRef kind) {
+  auto planned = _planned_sites.find(instr);
+  if (planned != _planned_sites.end() && planned->second.kind == kind)
+    return planned->second;
+  return describeSite(instr, callee, kind);
+}
+
+void AllocInstrumenter::planLoopGuards(
+    Function &F, const std::vector<Instruction *> &sites) {
+  if (_track_with_printf || _rules == nullptr) return;
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+
+  // The observed allocations that run exactly once per iteration of their
+  // loop, with a size that does not change in the loop
+  std::map<Loop *, std::vector<Instruction *>> loop_sites;
+  for (Instruction *instr : sites) {
+    CallSite cs(instr);
+    if (!cs.isCall() || cs.getCalledFunction() == nullptr) continue;
+    auto alloc = _rules->alloc.find(cs.getCalledFunction());
+    Value *size, *count;
+    if (alloc == _rules->alloc.end() || isReplaced(cs, alloc->second) ||
+        !getAllocArgs(cs, alloc->second, size, count))
+      continue;
+    Loop *L = LI.getLoopFor(instr->getParent());
+    if (L == nullptr || L->getLoopPreheader() == nullptr ||
+        L->getExitingBlock() != L->getLoopLatch() ||
+        !DT.dominates(instr->getParent(), L->getLoopLatch()) ||
+        !L->isLoopInvariant(size) ||
+        (count != nullptr && !L->isLoopInvariant(count)))
+      continue;
+    loop_sites[L].push_back(instr);
+  }
+  if (loop_sites.empty()) return;
+
+  Module &M = *F.getParent();
+  TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+  TargetLibraryInfo TLI(TLII);
+  AssumptionCache AC(F);
+  ScalarEvolution SE(F, TLI, AC, DT, LI);
+  SCEVExpander expander(SE, M.getDataLayout(), "orbit");
+  for (auto &loop : loop_sites) {
+    Loop *L = loop.first;
+    const SCEV *taken = SE.getBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(taken) ||
+        SE.getTypeSizeInBits(taken->getType()) > 64)
+      continue;
+    Instruction *entry = L->getLoopPreheader()->getTerminator();
+    const SCEV *trips = SE.getAddExpr(SE.getZeroExtendExpr(taken, _I64Ty),
+                                      SE.getOne(_I64Ty));
+    Value *trip_cnt = expander.expandCodeFor(trips, _I64Ty, entry);
+
+    // Count all the allocations of the loop down at once. If none of them
+    // would be sampled, the hooks are skipped in the loop; otherwise the
+    // countdown is left alone and the hooks run as usual.
+    IRBuilder<> builder(entry);
+    Value *by_bytes =
+        builder.CreateICmpNE(builder.CreateLoad(_I32Ty, _sample_by_bytes),
+                             ConstantInt::get(_I32Ty, 0));
+    Value *step = nullptr;
+    for (Instruction *instr : loop.second) {
+      CallSite cs(instr);
+      Value *size, *count;
+      getAllocArgs(cs, _rules->alloc.find(cs.getCalledFunction())->second,
+                   size, count);
+      Value *bytes = builder.CreateIntCast(size, _I64Ty, false);
+      if (count != nullptr)
+        bytes = builder.CreateMul(
+            builder.CreateIntCast(count, _I64Ty, false), bytes);
+      Value *site_step =
+          builder.CreateSelect(by_bytes, bytes, ConstantInt::get(_I64Ty, 1));
+      step = step ? builder.CreateAdd(step, site_step) : site_step;
+    }
+    Function *umul = Intrinsic::getDeclaration(
+        &M, Intrinsic::umul_with_overflow, {_I64Ty});
+    Value *product = builder.CreateCall(umul, {trip_cnt, step});
+    Value *budget = builder.CreateExtractValue(product, 0);
+    Value *left = builder.CreateLoad(_I64Ty, _sample_countdown);
+    Value *covered = builder.CreateAnd(
+        builder.CreateNot(builder.CreateExtractValue(product, 1)),
+        builder.CreateAnd(
+            builder.CreateICmpSGE(budget, ConstantInt::get(_I64Ty, 0)),
+            builder.CreateICmpSGT(left, budget)));
+    builder.CreateStore(
+        builder.CreateSelect(covered, builder.CreateSub(left, budget), left),
+        _sample_countdown);
+    Value *hooked = builder.CreateNot(covered);
+    for (Instruction *instr : loop.second) _loop_guards[instr] = hooked;
+    _coalesced_cnt += loop.second.size();
+  }
+}
+
 bool AllocInstrumenter::instrumentInstr(Instruction *instr) {
   // first check if this instruction has been instrumented before
   if (_hook_point_guid_map.find(instr) != _hook_point_guid_map.end()) {
@@ -146,61 +419,535 @@ bool AllocInstrumenter::instrumentInstr(Instruction *instr) {
     return false;
   }
 
-  Value *alloc_size;
-  Value *alloc_addr;
-
   CallSite cs(instr);
   if (!cs.isInvoke() && !cs.isCall()) return false;
   Function *callee = cs.getCalledFunction();
-  if (callee == NULL) return false;
+  if (callee == NULL || _rules == nullptr) return false;
+  // Inside an allocator, see getSiteKind
+  if (_rules->should_ignore(instr->getFunction())) return false;
 
-  alloc_addr = instr;
-  std::string demangled = demangleFunctionName(callee);
-  errs() << "Got " << demangled << "\n";
+  if (_hook_frees) {
+    auto dealloc = _rules->dealloc.find(callee);
+    if (dealloc != _rules->dealloc.end())
+      return instrumentDealloc(cs, dealloc->second);
+    auto realloc = _rules->realloc.find(callee);
+    if (realloc != _rules->realloc.end())
+      return instrumentRealloc(cs, realloc->second);
+  }
 
-  if (demangled.compare("mem_heap_alloc") == 0) {
-    alloc_size = cs.getArgument(1);
-  } else if (demangled.compare("ut_allocator<unsigned char>::allocate") == 0) {
-    alloc_size = cs.getArgOperand(1);
-  } else {
+  auto alloc = _rules->alloc.find(callee);
+  if (alloc == _rules->alloc.end()) return false;
+  return instrumentAlloc(cs, alloc->second);
+}
+
+// The integer argument `arg_no` of the call, or null
+static Value *getIntArgument(CallSite cs, int arg_no) {
+  if (arg_no < 0 || (unsigned)arg_no >= cs.arg_size()) return nullptr;
+  Value *arg = cs.getArgument(arg_no);
+  return arg->getType()->isIntegerTy() ? arg : nullptr;
+}
+
+bool AllocInstrumenter::getAllocArgs(CallSite cs, const AllocDesc &desc,
+                                     Value *&size, Value *&count) {
+  Instruction *instr = cs.getInstruction();
+  size = getIntArgument(cs, desc.size_arg);
+  count = getIntArgument(cs, desc.count_arg);
+  // Objects of unknown size cannot be tracked. The other checks catch rules
+  // that do not match the signature of the allocator.
+  if (size == nullptr || (desc.count_arg >= 0 && count == nullptr) ||
+      !instr->getType()->isPointerTy())
     return false;
-  }
+  if (desc.pool_arg >= 0 &&
+      ((unsigned)desc.pool_arg >= cs.arg_size() ||
+       !cs.getArgument(desc.pool_arg)->getType()->isPointerTy()))
+    return false;
+  return _selected == nullptr ||
+         _selected->count(
+             getSite(instr, cs.getCalledFunction(), "alloc").guid) != 0;
+}
 
-  // insert a call instruction to the hook function with CallInst::Create.
-  // Pass addr as an argument to this call instruction
-  IRBuilder<> builder(instr);
-  builder.SetInsertPoint(instr);
+bool AllocInstrumenter::isReplaced(CallSite cs, const AllocDesc &desc) {
+  // The tracker's allocation returns an i8*, which is cast back to the
+  // pointer type of the original
+  Type *type = cs.getInstruction()->getType();
+  return !_track_with_printf && _replace_allocs && desc.movable &&
+         type->isPointerTy() && type->getPointerAddressSpace() == 0;
+}
 
-  if (_track_with_printf) {
-    Value *str = builder.CreateGlobalStringPtr("orbit alloc: %zu => %p\n");
-    std::vector<llvm::Value *> params;
-    params.push_back(str);
-    params.push_back(alloc_size);
-    params.push_back(alloc_addr);
-    builder.CreateCall(_printf_func, params);
-  } else {
-    // Replace callInst with an __orbit_track_gobj call
-    // We use ReplaceInstWithInst
-    // need to explicitly cast the address, which could be i32* or i64*, to i8*
-    _hook_point_guid_map[instr] = AllocVarCurrentGuid;
-    _guid_hook_point_map[AllocVarCurrentGuid] = instr;
+// The attributes of the allocation `cs` that still hold for its replacement
+// `hook`, which takes the element count (if `count`) and the size first
+static AttributeList getReplacementAttributes(CallSite cs,
+                                              const AllocDesc &desc,
+                                              Function *hook, bool count) {
+  LLVMContext &ctx = cs.getInstruction()->getContext();
+  AttributeList attrs = cs.getAttributes();
+  // Allocation sizes and builtin semantics refer to the original allocator;
+  // the tracker's has its own allocation size
+  AttrBuilder fn_attrs(attrs.getFnAttributes());
+  fn_attrs.removeAttribute(Attribute::AllocSize);
+  fn_attrs.removeAttribute(Attribute::Builtin);
+  fn_attrs.removeAttribute(Attribute::NoBuiltin);
+  if (count)
+    fn_attrs.addAllocSizeAttr(1, 0);
+  else
+    fn_attrs.addAllocSizeAttr(0, None);
+  // What the allocator promises about its result, e.g. noalias
+  AttrBuilder ret_attrs(attrs.getRetAttributes());
+  ret_attrs.merge(
+      AttrBuilder(cs.getCalledFunction()->getAttributes().getRetAttributes()));
+  // Argument attributes only stay with arguments that keep their type
+  auto arg_attrs = [&cs, &attrs](int arg_no) {
+    if (cs.getArgument(arg_no)->getType()->isIntegerTy(64))
+      return attrs.getParamAttributes(arg_no);
+    return AttributeSet();
+  };
+  std::vector<AttributeSet> params;
+  if (count) params.push_back(arg_attrs(desc.count_arg));
+  params.push_back(arg_attrs(desc.size_arg));
+  params.resize(hook->arg_size());
+  return AttributeList::get(ctx, AttributeSet::get(ctx, fn_attrs),
+                            AttributeSet::get(ctx, ret_attrs), params);
+}
+
+bool AllocInstrumenter::instrumentAlloc(CallSite cs, const AllocDesc &desc) {
+  Instruction *instr = cs.getInstruction();
+  Value *size, *count;
+  if (!getAllocArgs(cs, desc, size, count)) return false;
+  uint32_t guid = assignSiteGuid(instr, cs.getCalledFunction(), "alloc");
+  Value *site = ConstantInt::get(_I32Ty, guid);
+
+  if (isReplaced(cs, desc)) {
+    // Replace the call with one to __orbit_alloc_gobj, or __orbit_calloc_gobj
+    // which also checks the product for overflow and clears the object. The
+    // size class of a constant size is computed here rather than by the
+    // arena on every call.
+    IRBuilder<> builder(instr);
     std::vector<llvm::Value *> args;
-    auto i32size = builder.CreateIntCast(alloc_size, _I32Ty, false);
-    args.push_back(i32size);
+    Function *hook = _track_gobj_func;
+    if (count != nullptr) {
+      args.push_back(builder.CreateIntCast(count, _I64Ty, false));
+      hook = _calloc_gobj_func;
+    }
+    args.push_back(builder.CreateIntCast(size, _I64Ty, false));
+    ConstantInt *const_size = dyn_cast<ConstantInt>(size);
+    if (count == nullptr && const_size != nullptr &&
+        !const_size->isZero() &&
+        const_size->getValue().ule(ORBIT_ARENA_MAX_SMALL)) {
+      unsigned cls = orbit_arena_size_class(const_size->getZExtValue());
+      args.push_back(ConstantInt::get(_I32Ty, cls));
+      hook = _alloc_gobj_class_func;
+      _size_class_cnt++;
+    }
+    args.push_back(site);
+    // E.g. the funclet of an exception handler the call is in
+    SmallVector<OperandBundleDef, 1> bundles;
+    cs.getOperandBundlesAsDefs(bundles);
     Instruction *newInstr = NULL;
-    if (isa<CallInst>(instr)) {
-      newInstr = CallInst::Create(_track_gobj_func, args);
-    } else if (isa<InvokeInst>(instr)) {
-      InvokeInst *ii = dyn_cast<InvokeInst>(instr);
-      newInstr = InvokeInst::Create(_track_gobj_func, ii->getNormalDest(),
-                                    ii->getUnwindDest(), args);
+    if (CallInst *ci = dyn_cast<CallInst>(instr)) {
+      CallInst *call = CallInst::Create(hook, args, bundles);
+      // A musttail call would not match the signature of the hook
+      if (!ci->isMustTailCall()) call->setTailCallKind(ci->getTailCallKind());
+      newInstr = call;
     } else {
-      return false;
+      InvokeInst *ii = cast<InvokeInst>(instr);
+      newInstr = InvokeInst::Create(hook, ii->getNormalDest(),
+                                    ii->getUnwindDest(), args, bundles);
     }
-    ReplaceInstWithInst(instr, newInstr);
+    // Keep the debug location, the profile and the other metadata of the
+    // call, and what its attributes tell later passes about the object
+    newInstr->copyMetadata(*instr);
+    CallSite(newInstr).setAttributes(
+        getReplacementAttributes(cs, desc, hook, count != nullptr));
+    if (instr->getType() == _I8PtrTy) {
+      ReplaceInstWithInst(instr, newInstr);
+    } else {
+      replaceWithCast(cs, newInstr);
+    }
+    _hook_point_guid_map[newInstr] = guid;
+    _guid_hook_point_map[guid] = newInstr;
+    _instrument_cnt++;
+    return true;
+  }
+
+  // The address is only known once the allocation returns. The call
+  // succeeded if it returned anything, so the product cannot overflow.
+  IRBuilder<> builder(getInsertPointAfter(cs));
+  Value *size64 = builder.CreateIntCast(size, _I64Ty, false);
+  if (count != nullptr)
+    size64 = builder.CreateMul(builder.CreateIntCast(count, _I64Ty, false),
+                               size64);
+  Value *ptr8 = builder.CreatePointerCast(instr, _I8PtrTy);
+  auto guard = _loop_guards.find(instr);
+  if (guard != _loop_guards.end()) {
+    // Skipped when the loop's allocations were counted down before it
+    Instruction *hook_pt = SplitBlockAndInsertIfThen(
+        guard->second, &*builder.GetInsertPoint(), false);
+    builder.SetInsertPoint(hook_pt);
+  }
+  if (_track_with_printf) {
+    Value *str =
+        builder.CreateGlobalStringPtr("orbit alloc: %zu => %p site=%u\n");
+    builder.CreateCall(_printf_func, {str, size64, ptr8, site});
+  } else if (_inline_hooks) {
+    emitInlineHook(&*builder.GetInsertPoint(), ptr8, size64, site);
+  } else {
+    builder.CreateCall(_alloc_hook_func, {ptr8, size64, site});
+  }
+  _instrument_cnt++;
+  return true;
+}
+
+void AllocInstrumenter::emitInlineHook(Instruction *insert_pt, Value *ptr8,
+                                       Value *size64, Value *site) {
+  // orbit_sample_countdown -= orbit_sample_by_bytes ? size : 1;
+  // if (orbit_sample_countdown <= 0)
+  //   __orbit_alloc_hook_sampled(ptr, size, site);
+  //
+  // A failed allocation is counted as well; the runtime ignores it, and the
+  // next allocation takes the sample instead.
+  IRBuilder<> builder(insert_pt);
+  Value *by_bytes =
+      builder.CreateICmpNE(builder.CreateLoad(_I32Ty, _sample_by_bytes),
+                           ConstantInt::get(_I32Ty, 0));
+  Value *step =
+      builder.CreateSelect(by_bytes, size64, ConstantInt::get(_I64Ty, 1));
+  Value *left =
+      builder.CreateSub(builder.CreateLoad(_I64Ty, _sample_countdown), step);
+  builder.CreateStore(left, _sample_countdown);
+  Value *sampled = builder.CreateICmpSLE(left, ConstantInt::get(_I64Ty, 0));
+  MDNode *weights =
+      MDBuilder(insert_pt->getContext()).createBranchWeights(1, 1000);
+  Instruction *slow = SplitBlockAndInsertIfThen(sampled, insert_pt, false,
+                                                weights);
+  builder.SetInsertPoint(slow);
+  builder.CreateCall(_alloc_hook_sampled_func, {ptr8, size64, site});
+}
+
+bool AllocInstrumenter::instrumentDealloc(CallSite cs, unsigned arg_no) {
+  Instruction *instr = cs.getInstruction();
+  if (arg_no >= cs.arg_size()) return false;
+  Value *ptr = cs.getArgument(arg_no);
+  if (!ptr->getType()->isPointerTy()) return false;
+  uint32_t guid = assignSiteGuid(instr, cs.getCalledFunction(), "free");
+
+  // The hook runs before the object is released
+  IRBuilder<> builder(instr);
+  Value *ptr8 = builder.CreatePointerCast(ptr, _I8PtrTy);
+  Value *site = ConstantInt::get(_I32Ty, guid);
+  if (_track_with_printf) {
+    Value *str = builder.CreateGlobalStringPtr("orbit free: %p site=%u\n");
+    builder.CreateCall(_printf_func, {str, ptr8, site});
+  } else {
+    builder.CreateCall(_free_hook_func, {ptr8, site});
+  }
+  _instrument_cnt++;
+  return true;
+}
 
-    AllocVarCurrentGuid++;
+bool AllocInstrumenter::instrumentRealloc(CallSite cs, unsigned arg_no) {
+  Instruction *instr = cs.getInstruction();
+  if (arg_no >= cs.arg_size()) return false;
+  Value *old_ptr = cs.getArgument(arg_no);
+  if (!old_ptr->getType()->isPointerTy() || !instr->getType()->isPointerTy())
+    return false;
+  uint32_t guid = assignSiteGuid(instr, cs.getCalledFunction(), "realloc");
+
+  // The rules only give the pointer argument; the reallocation functions we
+  // know of all take the new size right after it
+  Value *size = nullptr;
+  if (arg_no + 1 < cs.arg_size() &&
+      cs.getArgument(arg_no + 1)->getType()->isIntegerTy())
+    size = cs.getArgument(arg_no + 1);
+
+  // The hook needs the returned pointer, so it runs after the call
+  IRBuilder<> builder(getInsertPointAfter(cs));
+  Value *old_ptr8 = builder.CreatePointerCast(old_ptr, _I8PtrTy);
+  Value *new_ptr8 = builder.CreatePointerCast(instr, _I8PtrTy);
+  Value *size64 = size ? builder.CreateIntCast(size, _I64Ty, false)
+                       : ConstantInt::get(_I64Ty, 0);
+  Value *site = ConstantInt::get(_I32Ty, guid);
+  if (_track_with_printf) {
+    Value *str = builder.CreateGlobalStringPtr(
+        "orbit realloc: %p => %p (%zu) site=%u\n");
+    builder.CreateCall(_printf_func, {str, old_ptr8, new_ptr8, size64, site});
+  } else {
+    builder.CreateCall(_realloc_hook_func,
+                       {old_ptr8, new_ptr8, size64, site});
   }
   _instrument_cnt++;
   return true;
-}
\ No newline at end of file
+}
+
+namespace {
+
+// A hook for a write of [base + offset, base + offset + size), which runs
+// before `insert_pt`
+struct WriteHook {
+  Instruction *write;
+  Value *addr;
+  Value *size;
+  Value *base;
+  int64_t offset;
+  Instruction *insert_pt;
+};
+
+}  // namespace
+
+// The address and size of a write, or false if it cannot be hooked
+static bool getWriteRange(Instruction *write, const DataLayout &DL,
+                          Value *&addr, Value *&size) {
+  Type *value_ty = nullptr;
+  if (StoreInst *store = dyn_cast<StoreInst>(write)) {
+    addr = store->getPointerOperand();
+    value_ty = store->getValueOperand()->getType();
+  } else if (AtomicRMWInst *rmw = dyn_cast<AtomicRMWInst>(write)) {
+    addr = rmw->getPointerOperand();
+    value_ty = rmw->getValOperand()->getType();
+  } else if (AtomicCmpXchgInst *xchg = dyn_cast<AtomicCmpXchgInst>(write)) {
+    addr = xchg->getPointerOperand();
+    value_ty = xchg->getNewValOperand()->getType();
+  } else if (MemIntrinsic *mem = dyn_cast<MemIntrinsic>(write)) {
+    addr = mem->getRawDest();
+    size = mem->getLength();
+  } else {
+    return false;
+  }
+  if (value_ty != nullptr)
+    size = ConstantInt::get(Type::getInt64Ty(write->getContext()),
+                            DL.getTypeStoreSize(value_ty));
+  // The hook takes a pointer in the default address space
+  return addr->getType()->getPointerAddressSpace() == 0;
+}
+
+// Whether the hook `a` marks everything `b` would
+static bool coversWrite(const WriteHook &a, const WriteHook &b) {
+  if (a.base != b.base) return false;
+  ConstantInt *a_size = dyn_cast<ConstantInt>(a.size);
+  ConstantInt *b_size = dyn_cast<ConstantInt>(b.size);
+  if (a_size == nullptr || b_size == nullptr)
+    return a.size == b.size && a.offset == b.offset;
+  return a.offset <= b.offset &&
+         b.offset + (int64_t)b_size->getZExtValue() <=
+             a.offset + (int64_t)a_size->getZExtValue();
+}
+
+// Whether `I` may call code that clears the write marks, e.g. the sync point
+// of an orbit task that the writer itself reaches. Only the intrinsics that
+// never call out are known not to.
+static bool mayReachSyncPoint(const Instruction &I) {
+  if (!isa<CallInst>(I) && !isa<InvokeInst>(I)) return false;
+  if (isa<DbgInfoIntrinsic>(I) || isa<MemIntrinsic>(I)) return false;
+  if (const IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I)) {
+    switch (II->getIntrinsicID()) {
+      case Intrinsic::lifetime_start:
+      case Intrinsic::lifetime_end:
+      case Intrinsic::invariant_start:
+      case Intrinsic::invariant_end:
+      case Intrinsic::assume:
+      case Intrinsic::expect:
+      case Intrinsic::prefetch:
+        return false;
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+static bool mayReachSyncPoint(BasicBlock::iterator begin,
+                              BasicBlock::iterator end) {
+  for (; begin != end; ++begin)
+    if (mayReachSyncPoint(*begin)) return true;
+  return false;
+}
+
+// Whether a path from `from` to the first `to` after it may reach a sync
+// point, where `from` dominates `to`. Both are excluded, as the hooks are
+// inserted before them.
+static bool mayReachSyncPoint(Instruction *from, Instruction *to) {
+  BasicBlock *from_bb = from->getParent(), *to_bb = to->getParent();
+  if (from_bb == to_bb)
+    return mayReachSyncPoint(from->getIterator(), to->getIterator());
+  if (mayReachSyncPoint(from->getIterator(), from_bb->end()) ||
+      mayReachSyncPoint(to_bb->begin(), to->getIterator()))
+    return true;
+  // The blocks in between: reachable from `from` without passing either
+  // block again, and reaching `to` in the same way. Every path through
+  // from_bb passes `from`, which marks again.
+  SmallPtrSet<BasicBlock *, 16> after, before;
+  SmallVector<BasicBlock *, 16> worklist(succ_begin(from_bb),
+                                         succ_end(from_bb));
+  while (!worklist.empty()) {
+    BasicBlock *BB = worklist.pop_back_val();
+    if (BB == from_bb || BB == to_bb || !after.insert(BB).second) continue;
+    worklist.append(succ_begin(BB), succ_end(BB));
+  }
+  worklist.append(pred_begin(to_bb), pred_end(to_bb));
+  while (!worklist.empty()) {
+    BasicBlock *BB = worklist.pop_back_val();
+    if (BB == from_bb || BB == to_bb || !before.insert(BB).second) continue;
+    if (after.count(BB) && mayReachSyncPoint(BB->begin(), BB->end()))
+      return true;
+    worklist.append(pred_begin(BB), pred_end(BB));
+  }
+  return false;
+}
+
+bool AllocInstrumenter::instrumentWrites(
+    const std::vector<Instruction *> &writes) {
+  if (!_initialized) return false;
+  // Functions in the order of their first write
+  std::vector<Function *> funcs;
+  std::map<Function *, std::vector<Instruction *>> func_writes;
+  for (Instruction *write : writes) {
+    auto &list = func_writes[write->getFunction()];
+    if (list.empty()) funcs.push_back(write->getFunction());
+    list.push_back(write);
+  }
+  uint32_t hooked = _write_hook_cnt;
+  for (Function *F : funcs) instrumentWritesIn(*F, func_writes[F]);
+  return _write_hook_cnt != hooked;
+}
+
+void AllocInstrumenter::instrumentWritesIn(
+    Function &F, const std::vector<Instruction *> &writes) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  // A hook comes after the hooks that dominate it in this order
+  std::map<const Instruction *, unsigned> order;
+  unsigned pos = 0;
+  for (BasicBlock *BB : ReversePostOrderTraversal<Function *>(&F))
+    for (Instruction &I : *BB) order[&I] = pos++;
+  auto available = [&DT](Value *v, Instruction *pt) {
+    Instruction *def = dyn_cast<Instruction>(v);
+    return def == nullptr || DT.dominates(def, pt);
+  };
+  std::map<Loop *, bool> loop_calls;
+  auto has_calls = [&loop_calls](Loop *L) {
+    auto it = loop_calls.find(L);
+    if (it != loop_calls.end()) return it->second;
+    bool calls = false;
+    for (BasicBlock *BB : L->blocks())
+      if ((calls = mayReachSyncPoint(BB->begin(), BB->end()))) break;
+    return loop_calls[L] = calls;
+  };
+
+  std::vector<WriteHook> hooks;
+  for (Instruction *write : writes) {
+    WriteHook hook;
+    if (order.count(write) == 0 ||
+        !getWriteRange(write, DL, hook.addr, hook.size))
+      continue;
+    hook.write = write;
+    // After the write
+    hook.insert_pt = write->getNextNode();
+    // A loop that keeps writing to the same place needs a single mark. It
+    // is made before the loop rather than after, as the loop may not end,
+    // so only out of loops without calls: a writer that clears the marks
+    // in its loop would lose the writes after the first clear.
+    for (Loop *L = LI.getLoopFor(write->getParent()); L != nullptr;
+         L = L->getParentLoop()) {
+      BasicBlock *preheader = L->getLoopPreheader();
+      if (preheader == nullptr || has_calls(L) ||
+          !L->isLoopInvariant(hook.addr) ||
+          !L->isLoopInvariant(hook.size) ||
+          !available(hook.addr, preheader->getTerminator()) ||
+          !available(hook.size, preheader->getTerminator()))
+        break;
+      hook.insert_pt = preheader->getTerminator();
+    }
+    hook.offset = 0;
+    hook.base = GetPointerBaseWithConstantOffset(hook.addr, hook.offset, DL);
+    hooks.push_back(hook);
+  }
+  std::stable_sort(hooks.begin(), hooks.end(),
+                   [&order](const WriteHook &a, const WriteHook &b) {
+                     return order.at(a.insert_pt) < order.at(b.insert_pt);
+                   });
+
+  // Leave out the hooks that a hook on every path to them already covers,
+  // unless a call in between may clear the mark
+  std::vector<const WriteHook *> kept;
+  for (const WriteHook &hook : hooks) {
+    bool redundant = false;
+    for (const WriteHook *prev : kept) {
+      if (coversWrite(*prev, hook) &&
+          (prev->insert_pt == hook.insert_pt ||
+           DT.dominates(prev->insert_pt, hook.insert_pt)) &&
+          !mayReachSyncPoint(prev->insert_pt, hook.insert_pt)) {
+        redundant = true;
+        break;
+      }
+    }
+    if (!redundant) kept.push_back(&hook);
+  }
+
+  for (const WriteHook *hook : kept) {
+    IRBuilder<> builder(hook->insert_pt);
+    builder.SetCurrentDebugLocation(hook->write->getDebugLoc());
+    Value *ptr8 = builder.CreatePointerCast(hook->addr, _I8PtrTy);
+    Value *size64 = builder.CreateIntCast(hook->size, _I64Ty, false);
+    if (_track_with_printf) {
+      Value *str = builder.CreateGlobalStringPtr("orbit write: %p (%zu)\n");
+      builder.CreateCall(_printf_func, {str, ptr8, size64});
+    } else {
+      builder.CreateCall(_write_hook_func, {ptr8, size64});
+    }
+  }
+  _write_hook_cnt += kept.size();
+  _elided_write_cnt += hooks.size() - kept.size();
+}
+
+uint32_t AllocInstrumenter::assignSiteGuid(Instruction *instr,
+                                           Function *callee, StringRef kind) {
+  AllocSite site = getSite(instr, callee, kind);
+  // Resolve the rare collisions by rehashing
+  uint64_t hash = site.guid;
+  for (unsigned salt = 1; site.guid == 0 || site.guid == UINT32_MAX ||
+                          _guid_hook_point_map.count(site.guid) != 0;
+       salt++) {
+    hash = hash * 0x100000001b3ULL + salt;
+    site.guid = (uint32_t)(hash ^ (hash >> 32));
+  }
+  _hook_point_guid_map[instr] = site.guid;
+  _guid_hook_point_map[site.guid] = instr;
+  _sites.push_back(site);
+  return site.guid;
+}
+
+bool AllocInstrumenter::writeSiteTable(StringRef path) const {
+  return instrument::writeSiteTable(path, _sites);
+}
+
+void AllocInstrumenter::replaceWithCast(CallSite cs, Instruction *new_instr) {
+  Instruction *instr = cs.getInstruction();
+  Instruction *insert_pt = instr;
+  if (InvokeInst *ii = dyn_cast<InvokeInst>(instr)) {
+    // The cast goes at the start of the normal destination, in a block of
+    // its own if phis there (or other predecessors) need the result
+    BasicBlock *normal = ii->getNormalDest();
+    if (!normal->getSinglePredecessor() || isa<PHINode>(normal->front()))
+      normal = SplitEdge(ii->getParent(), normal);
+    cast<InvokeInst>(new_instr)->setNormalDest(normal);
+    insert_pt = &*normal->getFirstInsertionPt();
+  }
+  new_instr->insertBefore(instr);
+  Value *result = CastInst::CreatePointerCast(new_instr, instr->getType(), "",
+                                              insert_pt);
+  instr->replaceAllUsesWith(result);
+  result->takeName(instr);
+  instr->eraseFromParent();
+}
+
+Instruction *AllocInstrumenter::getInsertPointAfter(CallSite cs) {
+  Instruction *instr = cs.getInstruction();
+  if (InvokeInst *ii = dyn_cast<InvokeInst>(instr)) {
+    BasicBlock *normal = ii->getNormalDest();
+    // Other blocks may branch to the normal destination as well
+    if (!normal->getSinglePredecessor())
+      normal = SplitEdge(ii->getParent(), normal);
+    return &*normal->getFirstInsertionPt();
+  }
+  return instr->getNextNode();
+}
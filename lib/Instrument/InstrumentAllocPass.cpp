@@ -7,6 +7,7 @@
 //
 
 #include "Instrument/InstrumentAllocPass.h"
+#include "ObiWanAnalysis/ObiWanAnalysis.h"
 
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
@@ -17,38 +18,43 @@ using namespace std;
 using namespace llvm;
 using namespace llvm::instrument;
 
+static cl::opt<string> SitesFrom(
+    "instm-sites-from",
+    cl::desc("Only instrument the allocation sites listed in this table of "
+             "sites, e.g. written by the analyzer's -site-list"),
+    cl::value_desc("file"));
+
+static cl::opt<string> AllocRulesFile(
+    "instm-alloc-rules",
+    cl::desc("Read more allocation rules from this file, see "
+             "readAllocRules in include/Utils/LLVM.h"),
+    cl::value_desc("file"));
+
 void InstrumentAllocPass::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.setPreservesAll();
 }
 
 bool InstrumentAllocPass::runOnModule(Module &M) {
-  bool modified = false;
+  AllocRules::Initializer init = getDefaultAllocRules(M);
+  if (!AllocRulesFile.empty() && !readAllocRules(AllocRulesFile, init))
+    return false;
+  _rules = make_unique<AllocRules>(init);
   _instrumenter = make_unique<AllocInstrumenter>();
+  _instrumenter->setAllocRules(_rules.get());
+  if (!SitesFrom.empty()) {
+    if (!readSiteGuids(SitesFrom, _selected_sites)) return false;
+    _instrumenter->setSelectedSites(&_selected_sites);
+  }
   LLVMContext &context = M.getContext();
   if (!_instrumenter->initHookFuncs(&M, context)) {
     return false;
   }
-  for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I) {
-    Function &F = *I;
-    if (!F.isDeclaration()) {
-      modified |= runOnFunction(F);
-    }
-  }
+  bool modified = _instrumenter->instrumentModule(M);
   errs() << "Instrumented " << _instrumenter->getInstrumentedCnt()
          << " instructions in total\n";
   return modified;
 }
 
-bool InstrumentAllocPass::runOnFunction(Function &F) {
-  bool instrumented = false;
-  Instruction *instr;
-  for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii) {
-    instr = &*ii;
-    instrumented |= _instrumenter->instrumentInstr(instr);
-  }
-  return instrumented;
-}
-
 char InstrumentAllocPass::ID = 2;
 static RegisterPass<InstrumentAllocPass> X(
     "instm", "Instruments allocation related code");
@@ -0,0 +1,132 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#include "Instrument/SiteTable.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Utils/LLVM.h"
+
+using namespace llvm;
+using namespace llvm::instrument;
+
+// 64-bit FNV-1a
+static uint64_t hashString(StringRef str,
+                           uint64_t hash = 0xcbf29ce484222325ULL) {
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Position of `instr` among the calls to `callee` in its function
+static unsigned getCallOrdinal(const Instruction *instr,
+                               const Function *callee) {
+  unsigned ordinal = 0;
+  for (const Instruction &I : instructions(instr->getFunction())) {
+    if (&I == instr) break;
+    ImmutableCallSite cs(&I);
+    if (cs && cs.getCalledFunction() == callee) ordinal++;
+  }
+  return ordinal;
+}
+
+uint32_t llvm::instrument::computeSiteGuid(const Instruction *instr,
+                                           const Function *callee,
+                                           StringRef kind) {
+  // The key only depends on where the call is in the source, so the GUID
+  // stays the same across rebuilds. Inlined calls also include the location
+  // they were inlined at.
+  std::string key;
+  raw_string_ostream os(key);
+  if (const DILocation *loc = instr->getDebugLoc().get()) {
+    for (; loc != nullptr; loc = loc->getInlinedAt())
+      os << loc->getFilename() << ':' << loc->getLine() << ':'
+         << loc->getColumn() << '@';
+  } else {
+    os << '#' << getCallOrdinal(instr, callee) << '@';
+  }
+  os << instr->getFunction()->getName() << '|'
+     << demangleFunctionName(const_cast<Function *>(callee)) << '|' << kind;
+  os.flush();
+
+  // Zero means an unknown site and the runtime reserves ~0 for its own use
+  uint64_t hash = hashString(key);
+  uint32_t guid = (uint32_t)(hash ^ (hash >> 32));
+  for (unsigned salt = 1; guid == 0 || guid == UINT32_MAX; salt++) {
+    hash = hashString(std::to_string(salt), hash);
+    guid = (uint32_t)(hash ^ (hash >> 32));
+  }
+  return guid;
+}
+
+AllocSite llvm::instrument::describeSite(const Instruction *instr,
+                                         const Function *callee,
+                                         StringRef kind) {
+  AllocSite site;
+  site.guid = computeSiteGuid(instr, callee, kind);
+  site.kind = kind;
+  site.function =
+      demangleFunctionName(const_cast<Function *>(instr->getFunction()));
+  site.allocator = demangleFunctionName(const_cast<Function *>(callee));
+  if (const DILocation *loc = instr->getDebugLoc().get()) {
+    site.file = loc->getFilename().str();
+    site.line = loc->getLine();
+    site.column = loc->getColumn();
+  }
+  return site;
+}
+
+bool llvm::instrument::writeSiteTable(StringRef path,
+                                      const std::vector<AllocSite> &sites) {
+  std::error_code ec;
+  raw_fd_ostream os(path, ec, sys::fs::F_None);
+  if (ec) {
+    errs() << "Failed to open " << path << ": " << ec.message() << "\n";
+    return false;
+  }
+  os << "# guid\tkind\tlocation\tfunction\tallocator\n";
+  for (const AllocSite &site : sites) {
+    os << site.guid << '\t' << site.kind << '\t';
+    if (site.file.empty())
+      os << "??";
+    else
+      os << site.file << ':' << site.line << ':' << site.column;
+    os << '\t' << site.function << '\t' << site.allocator << '\n';
+  }
+  return true;
+}
+
+bool llvm::instrument::readSiteGuids(StringRef path,
+                                     std::set<uint32_t> &guids) {
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    errs() << "Failed to open '" << path
+           << "': " << buffer.getError().message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 0> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    if (line.startswith("#")) continue;
+    uint32_t guid;
+    if (line.split('\t').first.trim().getAsInteger(10, guid)) {
+      errs() << "Malformed line in '" << path << "': " << line << "\n";
+      return false;
+    }
+    guids.insert(guid);
+  }
+  return true;
+}
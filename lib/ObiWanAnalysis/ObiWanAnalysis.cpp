@@ -8,10 +8,12 @@
 
 #include "ObiWanAnalysis/ObiWanAnalysis.h"
 
+#include "llvm/IR/IntrinsicInst.h"
+
 ObiWanAnalysis::ObiWanAnalysis(Value *root, Function *start, Function *end,
-    const AllocRules &rules)
+    const AllocRules &rules, const UserGraphContext &ctx)
   : callGraph(), root(root), start(start), end(end),
-    ug(root, &callGraph, end, rules),
+    ug(root, &callGraph, end, rules, -1, ctx),
     calcIsAllocationPoint()
 {}
 
@@ -27,3 +29,215 @@ void ObiWanAnalysis::performDefUse() {
 bool ObiWanAnalysis::isAllocationPoint() {
   return calcIsAllocationPoint.getValueOr(false);
 }
+
+AllocRules::Initializer getDefaultAllocRules(const Module &M) {
+  return {
+    .M = M,
+    .alloc{
+      // standard
+      {"malloc", {.size_arg = 0, .movable = true}},
+      {"calloc", {.size_arg = 1, .count_arg = 0, .movable = true}},
+      // MySQL
+      {"mem_heap_alloc", {.size_arg = 1, .pool_arg = 0}},
+      {"mem_heap_zalloc", {.size_arg = 1, .pool_arg = 0}},
+      {"mem_strdup", {}}, {"mem_strdupl", {}}, {"mem_heap_strdupl", {}},
+      {"ut_allocator<unsigned char>::allocate",
+       {.size_arg = 1, .movable = true}},
+      // Redis
+      {"zmalloc", {.size_arg = 0}}, {"zcalloc", {.size_arg = 0}},
+      {"zstrdup", {}},
+      // Nginx
+      {"ngx_alloc", {.size_arg = 0, .movable = true}},
+      {"ngx_calloc", {.size_arg = 0}},
+      {"ngx_memalign", {.size_arg = 1}},
+      {"ngx_palloc", {.size_arg = 1, .pool_arg = 0}},
+      {"ngx_pcalloc", {.size_arg = 1, .pool_arg = 0}},
+      {"ngx_pnalloc", {.size_arg = 1, .pool_arg = 0}},
+      {"ngx_pmemalign", {.size_arg = 1, .pool_arg = 0}},
+      {"ngx_palloc_large", {.size_arg = 1, .pool_arg = 0}},
+      // Apache
+      {"apr_pcalloc", {.size_arg = 1, .pool_arg = 0}},
+      {"apr_palloc", {.size_arg = 1, .pool_arg = 0}},
+      {"ap_malloc", {.size_arg = 0, .movable = true}},
+      {"ap_calloc", {.size_arg = 1, .count_arg = 0, .movable = true}},
+      {"apr_itoa", {}}, {"apr_ltoa", {}}, {"apr_off_t_toa", {}},
+      {"apr_pmemdup", {.size_arg = 2, .pool_arg = 0}},
+      {"apr_pstrdup", {}}, {"apr_pstrmemdup", {}}, {"apr_pstrndup", {}},
+      {"apr_pvsprintf", {}}, {"apr_psprintf", {}}, {"apr_pstrcat", {}},
+      {"apr_pstrcatv", {}},
+    },
+    .dealloc{
+      // standard
+      {"free", 0},
+      // MySQL
+      {"ut_allocator<unsigned char>::deallocate", 1},
+      // Redis
+      {"zfree", 0},
+      // Nginx
+      {"ngx_free", 0}, {"ngx_pfree", 1},
+    },
+    .realloc{
+      // standard
+      {"realloc", 0},
+      // MySQL
+      {"ut_allocator<unsigned char>::reallocate", 1},
+      // Redis
+      {"zrealloc", 0},
+    },
+    .ignored{
+      // MySQL
+      "mem_heap_*", "ut_allocator*",
+      // Redis
+      "zmalloc_*", "je_*",
+      // Apache
+      "apr_allocator_*", "apr_pool_*",
+      // Nginx
+      "ngx_pool_*", "ngx_palloc_*", "ngx_create_pool", "ngx_destroy_pool", "ngx_reset_pool",
+    }
+  };
+}
+
+static bool isAllocationCall(CallSite cs, const AllocRules &rules) {
+  if (!(cs.isCall() || cs.isInvoke())) return false;
+  if (rules.should_ignore(cs.getCaller())) return false;
+  Function *callee = cs.getCalledFunction();
+  if (callee == nullptr || callee->isIntrinsic()) return false;
+  return rules.alloc.count(callee) != 0 || rules.realloc.count(callee) != 0;
+}
+
+std::vector<Instruction *> findAllocationPoints(
+    Function *target, const AllocRules &rules,
+    const UserGraphContext &ctx,
+    const std::set<std::string> &callers) {
+  FunctionMaterializer *materializer = ctx.materializer;
+  std::vector<Instruction *> sites;
+  if (callers.empty()) {
+    // Allocation sites are found through the use lists of the allocation
+    // functions, which are only complete once the bodies that call them
+    // have been read.
+    for (auto &[alloc_func, desc] : rules.alloc) {
+      if (materializer) materializer->materializeUsersOf(alloc_func);
+      for (const User *user : alloc_func->users())
+        if (isAllocationCall(CallSite((User *)user), rules))
+          sites.push_back((Instruction *)user);
+    }
+    for (auto &[alloc_func, arg_no] : rules.realloc) {
+      if (materializer) materializer->materializeUsersOf(alloc_func);
+      for (const User *user : alloc_func->users())
+        if (isAllocationCall(CallSite((User *)user), rules))
+          sites.push_back((Instruction *)user);
+    }
+  } else {
+    // Only the bodies of the requested callers need to be read
+    for (Function &F : *target->getParent()) {
+      if (callers.count(demangleFunctionName(&F)) == 0) continue;
+      if (materializer) materializer->materialize(&F);
+      for (Instruction &I : instructions(F))
+        if (isAllocationCall(CallSite(&I), rules))
+          sites.push_back(&I);
+    }
+  }
+
+  std::vector<Instruction *> heapCalls;
+  for (Instruction *alloc_site : sites) {
+    CallSite cs(alloc_site);
+    ObiWanAnalysis ob(alloc_site, cs.getCaller(), target, rules, ctx);
+    ob.performDefUse();
+    if (ob.isAllocationPoint()) heapCalls.push_back(alloc_site);
+  }
+  return heapCalls;
+}
+
+// The same rules, for the functions of the shadow module
+static AllocRules toShadowRules(const AllocRules &rules,
+                                const ShadowModule &shadow) {
+  AllocRules shadow_rules;
+  for (auto &[func, desc] : rules.alloc)
+    if (Function *F = shadow.toShadow(func)) shadow_rules.alloc[F] = desc;
+  for (auto &[func, arg_no] : rules.dealloc)
+    if (Function *F = shadow.toShadow(func)) shadow_rules.dealloc[F] = arg_no;
+  for (auto &[func, arg_no] : rules.realloc)
+    if (Function *F = shadow.toShadow(func)) shadow_rules.realloc[F] = arg_no;
+  for (const Function *func : rules.ignored)
+    if (Function *F = shadow.toShadow(func)) shadow_rules.ignored.insert(F);
+  return shadow_rules;
+}
+
+std::vector<Instruction *> findAllocationPoints(
+    Function *target, ShadowModule &shadow, const AllocRules &rules,
+    const UserGraphContext &ctx,
+    const std::set<std::string> &callers) {
+  std::vector<Instruction *> heapCalls;
+  Function *shadow_target = shadow.toShadow(target);
+  if (shadow_target == nullptr) return heapCalls;
+
+  // The shadow module is never lazily loaded
+  UserGraphContext shadow_ctx = ctx;
+  shadow_ctx.materializer = nullptr;
+  const AllocRules shadow_rules = toShadowRules(rules, shadow);
+  for (Instruction *point :
+       findAllocationPoints(shadow_target, shadow_rules, shadow_ctx, callers)) {
+    if (Instruction *orig = shadow.toOriginal(point)) {
+      heapCalls.push_back(orig);
+    } else {
+      errs() << "Cannot map allocation point back to the original module: "
+             << *point << '\n';
+    }
+  }
+  return heapCalls;
+}
+
+// The address `inst` writes to, or null if it does not write memory
+static Value *getWrittenAddress(Instruction *inst) {
+  if (StoreInst *store = dyn_cast<StoreInst>(inst))
+    return store->getPointerOperand();
+  if (AtomicRMWInst *rmw = dyn_cast<AtomicRMWInst>(inst))
+    return rmw->getPointerOperand();
+  if (AtomicCmpXchgInst *xchg = dyn_cast<AtomicCmpXchgInst>(inst))
+    return xchg->getPointerOperand();
+  if (MemIntrinsic *mem = dyn_cast<MemIntrinsic>(inst))
+    return mem->getRawDest();
+  return nullptr;
+}
+
+std::vector<Instruction *> findObjectWrites(
+    const std::vector<Instruction *> &points, const AllocRules &rules,
+    const UserGraphContext &ctx) {
+  // The first phase of the walk is enough: it already follows the object
+  // into every function, whatever the target
+  SmallPtrSet<Value *, 32> addrs;
+  for (Instruction *point : points) {
+    ::CallGraph callGraph;
+    UserGraph ug(point, &callGraph, nullptr, rules, -1, ctx);
+    ug.findObjectPointers(addrs);
+  }
+
+  // Follow the pointers to the addresses of the fields, which the walk only
+  // tracks as far as it needs to reach the stored pointers
+  SmallVector<Value *, 64> worklist(addrs.begin(), addrs.end());
+  SmallPtrSet<Instruction *, 32> writes;
+  std::set<Function *> funcs;
+  while (!worklist.empty()) {
+    Value *addr = worklist.pop_back_val();
+    for (User *user : addr->users()) {
+      Instruction *inst = dyn_cast<Instruction>(user);
+      if (inst == nullptr) continue;
+      if (getWrittenAddress(inst) == addr) {
+        writes.insert(inst);
+        funcs.insert(inst->getFunction());
+      } else if (isa<GetElementPtrInst>(inst) || isa<BitCastInst>(inst) ||
+                 isa<PHINode>(inst) || isa<SelectInst>(inst)) {
+        if (addrs.insert(inst).second) worklist.push_back(inst);
+      }
+    }
+  }
+
+  std::vector<Instruction *> ordered;
+  if (funcs.empty()) return ordered;
+  for (Function &F : *(*funcs.begin())->getParent()) {
+    if (funcs.count(&F) == 0) continue;
+    for (Instruction &I : instructions(F))
+      if (writes.count(&I) != 0) ordered.push_back(&I);
+  }
+  return ordered;
+}
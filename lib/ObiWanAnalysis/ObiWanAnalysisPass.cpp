@@ -15,10 +15,12 @@
 
 #include "DefUse/DefUse.h"
 #include "Instrument/AllocInstrumenter.h"
+#include "Instrument/SiteTable.h"
 #include "ObiWanAnalysis/ObiWanAnalysis.h"
 #include "Utils/LLVM.h"
 
 #include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/InstrTypes.h"
@@ -37,10 +39,42 @@ static cl::list<std::string> TargetFunctions("target-functions",
                                              cl::desc("<Function>"),
                                              cl::ZeroOrMore);
 
+static cl::opt<bool> UseMemorySSA(
+    "obi-wan-memssa",
+    cl::desc("Only follow loads that the store which led the analysis to "
+             "the pointer may reach, according to MemorySSA"));
+
+static cl::opt<bool> CanonicalizeModule(
+    "obi-wan-canonicalize",
+    cl::desc("Analyze a copy of the module canonicalized with mem2reg, SROA "
+             "and instcombine, and map the results back"));
+
+static cl::opt<bool> UsePointsTo(
+    "obi-wan-points-to",
+    cl::desc("Resolve indirect calls and prune the walk with a "
+             "unification-based points-to analysis"));
+
+static cl::opt<bool> InstrumentPoints(
+    "obi-wan-instrument",
+    cl::desc("Instrument the allocation points found, and only those"));
+
+static cl::opt<std::string> AllocRulesFile(
+    "obi-wan-alloc-rules",
+    cl::desc("Read more allocation rules from this file, see "
+             "readAllocRules in include/Utils/LLVM.h"),
+    cl::value_desc("file"));
+
+static cl::opt<std::string> SiteListFile(
+    "obi-wan-site-list",
+    cl::desc("Write the allocation points found to this table of sites, "
+             "for the instrumentor's -sites-from"),
+    cl::value_desc("file"));
+
 struct ObiWanAnalysisPass : public llvm::ModulePass {
   static char ID;
 
-  std::vector<Instruction *> heapCalls;
+  // An allocation point may reach several targets, it is only listed once
+  SetVector<Instruction *> heapCalls;
 
   ObiWanAnalysisPass() : llvm::ModulePass(ID) {}
   // Pool<trx_t, TrxFactory, TrxPoolLock>::Pool
@@ -49,56 +83,25 @@ struct ObiWanAnalysisPass : public llvm::ModulePass {
     bool modified = false;
     addFunctionAttributes(M);
 
-    // TODO: turn this into CLI arguments
-    const AllocRules rules({
-      .M = M,
-      .alloc{
-        // standard
-        "malloc", "calloc",
-        // MySQL
-        "mem_heap_alloc", "mem_heap_zalloc",
-        "mem_strdup", "mem_strdupl", "mem_heap_strdupl",
-        "ut_allocator<unsigned char>::allocate",
-        // Redis
-        "zmalloc", "zcalloc", "zstrdup",
-        // Nginx
-        "ngx_alloc", "ngx_calloc", "ngx_memalign",
-        "ngx_palloc", "ngx_pcalloc", "ngx_pnalloc", "ngx_pmemalign", "ngx_palloc_large",
-        // Apache
-        "apr_pcalloc", "apr_palloc", "ap_malloc", "ap_calloc",
-        "apr_itoa", "apr_ltoa", "apr_off_t_toa",
-        "apr_pmemdup", "apr_pstrdup", "apr_pstrmemdup", "apr_pstrndup",
-        "apr_pvsprintf", "apr_psprintf", "apr_pstrcat", "apr_pstrcatv",
-      },
-      .dealloc{
-        // standard
-        {"free", 0},
-        // MySQL
-        {"ut_allocator<unsigned char>::deallocate", 1},
-        // Redis
-        {"zfree", 0},
-        // Nginx
-        {"ngx_free", 0}, {"ngx_pfree", 1},
-      },
-      .realloc{
-        // standard
-        {"realloc", 0},
-        // MySQL
-        {"ut_allocator<unsigned char>::reallocate", 1},
-        // Redis
-        {"zrealloc", 0},
-      },
-      .ignored{
-        // MySQL
-        "mem_heap_*", "ut_allocator*",
-        // Redis
-        "zmalloc_*", "je_*",
-        // Apache
-        "apr_allocator_*", "apr_pool_*",
-        // Nginx
-        "ngx_pool_*", "ngx_palloc_*", "ngx_create_pool", "ngx_destroy_pool", "ngx_reset_pool",
-      }
-    });
+    AllocRules::Initializer init = getDefaultAllocRules(M);
+    if (!AllocRulesFile.empty() && !readAllocRules(AllocRulesFile, init))
+      return false;
+    const AllocRules rules(init);
+    std::unique_ptr<ShadowModule> shadow;
+    if (CanonicalizeModule) {
+      shadow = std::make_unique<ShadowModule>(M);
+      shadow->canonicalize();
+    }
+
+    MemorySSACache mssa;
+    UserGraphContext ctx;
+    if (UseMemorySSA) ctx.mssa = &mssa;
+    std::unique_ptr<pointsto::PointsToAnalysis> pts;
+    if (UsePointsTo) {
+      pts = std::make_unique<pointsto::PointsToAnalysis>(shadow ? shadow->get()
+                                                                : M);
+      ctx.pts = pts.get();
+    }
 
     // Find Allocation Points
     std::set<std::string> targetFunctionSet(TargetFunctions.begin(),
@@ -114,28 +117,43 @@ struct ObiWanAnalysisPass : public llvm::ModulePass {
         continue;
       }
 
-      for (auto &alloc_func : rules.alloc)
-        modified |= identifyHeapAlloc((Function *)alloc_func, targetFun, rules);
-      for (auto &[alloc_func, arg_no] : rules.realloc)
-        modified |= identifyHeapAlloc((Function *)alloc_func, targetFun, rules);
+      auto points = shadow
+                        ? findAllocationPoints(targetFun, *shadow, rules, ctx)
+                        : findAllocationPoints(targetFun, rules, ctx);
+      heapCalls.insert(points.begin(), points.end());
     }
 
     errs() << "Found heapCalls " << heapCalls.size() << "\n";
 
-    return false;
+    std::vector<AllocSite> sites;
+    std::set<uint32_t> selected;
+    for (Instruction *heapCall : heapCalls) {
+      Function *callee = CallSite(heapCall).getCalledFunction();
+      sites.push_back(describeSite(
+          heapCall, callee,
+          rules.realloc.count(callee) != 0 ? "realloc" : "alloc"));
+      selected.insert(sites.back().guid);
+    }
 
-    if (heapCalls.size() == 0) return false;
+    if (!SiteListFile.empty()) {
+      if (writeSiteTable(SiteListFile, sites))
+        errs() << "Saved " << sites.size() << " allocation points to "
+               << SiteListFile << "\n";
+    }
 
-    // Perform Instrumentation
+    if (!InstrumentPoints || heapCalls.size() == 0) return false;
+
+    // Perform Instrumentation of the allocation points only, by GUID like
+    // the instrumentor's -sites-from, and of all the deallocation and
+    // reallocation sites
     AllocInstrumenter instrumenter(false);
+    instrumenter.setAllocRules(&rules);
+    instrumenter.setSelectedSites(&selected);
     if (!instrumenter.initHookFuncs(&M, M.getContext())) {
       errs() << "Failed to initialize hook functions\n";
       return false;
     }
-
-    for (auto heapCall : heapCalls) {
-      modified |= instrumentInstruction(&instrumenter, heapCall);
-    }
+    modified |= instrumenter.instrumentModule(M);
 
     errs() << "Instrumented " << instrumenter.getInstrumentedCnt()
            << " instructions in total\n";
@@ -151,34 +169,10 @@ struct ObiWanAnalysisPass : public llvm::ModulePass {
     }
 
     errs() << "Successfully saved instrumented file " << outputFilename << "\n";
+    instrumenter.writeSiteTable(outputFilename + ".sites");
     return modified;
   }
 
-  bool instrumentInstruction(AllocInstrumenter *instrumenter,
-                             Instruction *inst) {
-    return instrumenter->instrumentInstr(inst);
-  }
-
-  bool identifyHeapAlloc(Function *allocFunc, Function *targetFun, const AllocRules &rules) {
-    if (allocFunc->isIntrinsic()) return false;
-
-    for (const User *const_alloc_site : allocFunc->users()) {
-      User *alloc_site = (User *)const_alloc_site;
-      CallSite cs(alloc_site);
-      if (!(cs.isCall() || cs.isInvoke())) continue;
-      if (rules.should_ignore(cs.getCaller())) continue;
-
-      // if (demangleFunctionName(cs.getCaller()) != "dbg_func_name") continue;
-
-      ObiWanAnalysis ob(alloc_site, cs.getCaller(), targetFun, rules);
-      ob.performDefUse();
-      if (ob.isAllocationPoint()) {
-        heapCalls.push_back(dyn_cast<Instruction>(alloc_site));
-      }
-    }
-    return false;
-  }
-
   bool saveModule(Module *M, std::string outFile) {
     if (verifyModule(*M, &errs())) {
       errs() << "Error: module failed verification.\n";
@@ -0,0 +1,63 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#include "ObiWanAnalysis/ShadowModule.h"
+
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+ShadowModule::ShadowModule(Module &M) : _orig(M) {
+  _shadow = CloneModule(&M, _vmap);
+}
+
+void ShadowModule::canonicalize() {
+  legacy::FunctionPassManager FPM(_shadow.get());
+  FPM.add(createPromoteMemoryToRegisterPass());
+  FPM.add(createSROAPass());
+  // Skip the expensive combines, we only want the cheap peepholes that
+  // clean up the casts and GEPs left behind by the first two passes
+  FPM.add(createInstructionCombiningPass(false));
+  FPM.doInitialization();
+  for (Function &F : *_shadow) {
+    if (!F.isDeclaration()) FPM.run(F);
+  }
+  FPM.doFinalization();
+
+  // Only calls matter for mapping results back. The value map tracks
+  // replacements, so a shadow call that was folded into something else or
+  // deleted is simply not mapped.
+  _reverse.clear();
+  for (Function &F : _orig) {
+    for (Instruction &I : instructions(F)) {
+      if (!isa<CallInst>(&I) && !isa<InvokeInst>(&I)) continue;
+      auto it = _vmap.find(&I);
+      if (it == _vmap.end() || !it->second) continue;
+      if (Instruction *shadow = dyn_cast<Instruction>((Value *)it->second))
+        if (isa<CallInst>(shadow) || isa<InvokeInst>(shadow))
+          _reverse[shadow] = &I;
+    }
+  }
+}
+
+Value *ShadowModule::toShadow(const Value *orig) const {
+  auto it = _vmap.find(orig);
+  if (it == _vmap.end()) return nullptr;
+  return it->second;
+}
+
+Function *ShadowModule::toShadow(const Function *orig) const {
+  return dyn_cast_or_null<Function>(toShadow((const Value *)orig));
+}
+
+Instruction *ShadowModule::toOriginal(const Instruction *shadow) const {
+  auto it = _reverse.find(shadow);
+  return it == _reverse.end() ? nullptr : it->second;
+}
@@ -0,0 +1,312 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#include "PointsTo/PointsTo.h"
+
+#include "llvm/IR/GlobalAlias.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+using namespace llvm;
+using namespace llvm::pointsto;
+
+static const std::vector<Function *> noCallees;
+static const std::vector<Instruction *> noCallers;
+
+// Strip the casts and address computations of a constant down to the global
+// it refers to, if any
+static const Value *stripConstant(const Value *v) {
+  while (true) {
+    if (const GlobalAlias *alias = dyn_cast<GlobalAlias>(v)) {
+      v = alias->getAliasee();
+    } else if (const ConstantExpr *expr = dyn_cast<ConstantExpr>(v)) {
+      switch (expr->getOpcode()) {
+        case Instruction::BitCast:
+        case Instruction::AddrSpaceCast:
+        case Instruction::GetElementPtr:
+        case Instruction::IntToPtr:
+        case Instruction::PtrToInt:
+          v = expr->getOperand(0);
+          break;
+        default:
+          return v;
+      }
+    } else {
+      return v;
+    }
+  }
+}
+
+PointsToAnalysis::PointsToAnalysis(Module &M) {
+  // Whatever the library has can be reached from anything else it has
+  _unknown = makeNode();
+  _nodes[_unknown].pointee = _unknown;
+  for (GlobalVariable &G : M.globals()) {
+    if (G.hasInitializer()) addInitializer(pts(&G), G.getInitializer());
+  }
+  for (Function &F : M) {
+    if (!F.isDeclaration()) addFunction(F);
+  }
+  // Functions whose address reached the library may be called back by it
+  // with anything it has, and what they return goes back to it
+  for (unsigned i = 0; i < _nodes[find(_unknown)].args.size(); i++)
+    join(lamArg(_unknown, i), _unknown);
+  join(lamRet(_unknown), _unknown);
+  resolveCalls();
+}
+
+unsigned PointsToAnalysis::makeNode() {
+  unsigned n = _nodes.size();
+  _nodes.push_back(Node{n, 0, -1, {}, -1, {}});
+  return n;
+}
+
+unsigned PointsToAnalysis::find(unsigned n) {
+  unsigned root = n;
+  while (_nodes[root].parent != root) root = _nodes[root].parent;
+  while (_nodes[n].parent != root) {
+    unsigned next = _nodes[n].parent;
+    _nodes[n].parent = root;
+    n = next;
+  }
+  return root;
+}
+
+unsigned PointsToAnalysis::findConst(unsigned n) const {
+  while (_nodes[n].parent != n) n = _nodes[n].parent;
+  return n;
+}
+
+/*
+ * Merge two classes. Merging the classes also merges what they point to and,
+ * for function objects, their parameter and return classes, so the pending
+ * pairs are kept on a worklist instead of recursing.
+ */
+void PointsToAnalysis::join(unsigned a, unsigned b) {
+  std::vector<std::pair<unsigned, unsigned>> pending{{a, b}};
+  auto merge = [&](int &into, int from) {
+    if (from < 0) return;
+    if (into < 0)
+      into = from;
+    else
+      pending.emplace_back(into, from);
+  };
+
+  while (!pending.empty()) {
+    unsigned x = find(pending.back().first);
+    unsigned y = find(pending.back().second);
+    pending.pop_back();
+    if (x == y) continue;
+    if (_nodes[x].rank < _nodes[y].rank) std::swap(x, y);
+    if (_nodes[x].rank == _nodes[y].rank) _nodes[x].rank++;
+
+    Node &X = _nodes[x], &Y = _nodes[y];
+    Y.parent = x;
+    merge(X.pointee, Y.pointee);
+    merge(X.ret, Y.ret);
+    for (size_t i = 0; i < Y.args.size(); i++) {
+      if (i < X.args.size())
+        pending.emplace_back(X.args[i], Y.args[i]);
+      else
+        X.args.push_back(Y.args[i]);
+    }
+    X.funs.insert(X.funs.end(), Y.funs.begin(), Y.funs.end());
+    Y.args.clear();
+    Y.funs.clear();
+  }
+}
+
+unsigned PointsToAnalysis::pointee(unsigned n) {
+  unsigned root = find(n);
+  if (_nodes[root].pointee < 0) {
+    unsigned p = makeNode();
+    _nodes[root].pointee = p;
+    return p;
+  }
+  return find(_nodes[root].pointee);
+}
+
+unsigned PointsToAnalysis::lamArg(unsigned fun_class, unsigned i) {
+  unsigned root = find(fun_class);
+  while (_nodes[root].args.size() <= i) {
+    unsigned arg = makeNode();
+    _nodes[root].args.push_back(arg);
+  }
+  return _nodes[root].args[i];
+}
+
+unsigned PointsToAnalysis::lamRet(unsigned fun_class) {
+  unsigned root = find(fun_class);
+  if (_nodes[root].ret < 0) {
+    unsigned ret = makeNode();
+    _nodes[root].ret = ret;
+    return ret;
+  }
+  return _nodes[root].ret;
+}
+
+/*
+ * Globals and instructions get one node each. Other constants (null, undef,
+ * integers) get a fresh node every time, otherwise everything assigned a null
+ * pointer would end up in the same class.
+ */
+unsigned PointsToAnalysis::nodeOf(const Value *v) {
+  if (isa<Constant>(v)) v = stripConstant(v);
+  if (isa<Constant>(v) && !isa<GlobalValue>(v)) return makeNode();
+
+  auto it = _value_nodes.find(v);
+  if (it != _value_nodes.end()) return it->second;
+  unsigned n = makeNode();
+  _value_nodes[v] = n;
+
+  if (const Function *F = dyn_cast<Function>(v)) {
+    // The function object keeps track of which functions are in its class
+    unsigned obj = pointee(n);
+    _nodes[obj].funs.push_back(const_cast<Function *>(F));
+  }
+  return n;
+}
+
+int PointsToAnalysis::lookup(const Value *v) const {
+  if (isa<Constant>(v)) v = stripConstant(v);
+  auto it = _value_nodes.find(v);
+  if (it == _value_nodes.end()) return -1;
+  return it->second;
+}
+
+void PointsToAnalysis::addInitializer(unsigned obj, const Constant *init) {
+  if (isa<ConstantAggregate>(init)) {
+    for (const Use &op : init->operands())
+      addInitializer(obj, cast<Constant>(op.get()));
+    return;
+  }
+  const Value *base = stripConstant(init);
+  if (isa<GlobalValue>(base)) join(pointee(obj), pts(base));
+}
+
+void PointsToAnalysis::addFunction(Function &F) {
+  unsigned fun_class = pts(&F);
+  unsigned i = 0;
+  for (Argument &arg : F.args()) join(lamArg(fun_class, i++), pts(&arg));
+  for (Instruction &I : instructions(F)) addInstruction(I);
+}
+
+void PointsToAnalysis::addCall(CallSite cs) {
+  Instruction *inst = cs.getInstruction();
+  const Value *called = stripConstant(cs.getCalledValue());
+  const Function *F = dyn_cast<Function>(called);
+
+  if (F && F->isDeclaration()) {
+    if (const MemTransferInst *mem = dyn_cast<MemTransferInst>(inst)) {
+      join(pointee(pts(mem->getRawDest())), pointee(pts(mem->getRawSource())));
+    } else if (!F->isIntrinsic()) {
+      // A noalias result is a fresh object, which realloc-like calls fill
+      // with the one they are given. Any other library call may return or
+      // store anything reachable from its arguments, e.g. strchr or a
+      // container getter, so all of it goes to the unknown class.
+      bool allocates = cs.hasRetAttr(Attribute::NoAlias);
+      if (inst->getType()->isPointerTy())
+        join(pts(inst), allocates ? makeNode() : _unknown);
+      for (Value *arg : cs.args()) {
+        if (arg->getType()->isPointerTy())
+          join(pts(arg), allocates ? pts(inst) : _unknown);
+      }
+    }
+    return;
+  }
+  if (F == nullptr) _indirect_calls.push_back(inst);
+
+  // Direct and indirect calls go through the function object in the same way
+  unsigned fun_class = pts(called);
+  for (unsigned i = 0; i < cs.arg_size(); i++)
+    join(lamArg(fun_class, i), pts(cs.getArgument(i)));
+  if (!inst->getType()->isVoidTy()) join(pts(inst), lamRet(fun_class));
+}
+
+void PointsToAnalysis::addInstruction(Instruction &I) {
+  auto copy = [&](Value *from) { join(pts(&I), pts(from)); };
+
+  if (isa<CallInst>(&I) || isa<InvokeInst>(&I)) {
+    addCall(CallSite(&I));
+  } else if (isa<AllocaInst>(&I)) {
+    join(pts(&I), makeNode());
+  } else if (LoadInst *load = dyn_cast<LoadInst>(&I)) {
+    join(pts(&I), pointee(pts(load->getPointerOperand())));
+  } else if (StoreInst *store = dyn_cast<StoreInst>(&I)) {
+    join(pointee(pts(store->getPointerOperand())),
+         pts(store->getValueOperand()));
+  } else if (AtomicRMWInst *rmw = dyn_cast<AtomicRMWInst>(&I)) {
+    unsigned cell = pointee(pts(rmw->getPointerOperand()));
+    join(cell, pts(rmw->getValOperand()));
+    join(pts(&I), cell);
+  } else if (AtomicCmpXchgInst *xchg = dyn_cast<AtomicCmpXchgInst>(&I)) {
+    unsigned cell = pointee(pts(xchg->getPointerOperand()));
+    join(cell, pts(xchg->getNewValOperand()));
+    join(pts(&I), cell);
+  } else if (isa<CastInst>(&I) || isa<GetElementPtrInst>(&I) ||
+             isa<ExtractValueInst>(&I)) {
+    copy(I.getOperand(0));
+  } else if (isa<InsertValueInst>(&I)) {
+    copy(I.getOperand(0));
+    copy(I.getOperand(1));
+  } else if (SelectInst *select = dyn_cast<SelectInst>(&I)) {
+    copy(select->getTrueValue());
+    copy(select->getFalseValue());
+  } else if (PHINode *phi = dyn_cast<PHINode>(&I)) {
+    for (Value *incoming : phi->incoming_values()) copy(incoming);
+  } else if (ReturnInst *ret = dyn_cast<ReturnInst>(&I)) {
+    if (Value *value = ret->getReturnValue())
+      join(lamRet(pts(I.getFunction())), pts(value));
+  }
+}
+
+// Once all the classes are final, record the targets of each indirect call
+void PointsToAnalysis::resolveCalls() {
+  for (Instruction *inst : _indirect_calls) {
+    CallSite cs(inst);
+    int called = findClass(cs.getCalledValue(), 0);
+    if (called < 0) continue;
+    std::vector<Function *> &callees = _callees[inst];
+    for (Function *F : _nodes[called].funs) {
+      // Drop the functions that cannot be called with these arguments
+      if (F->isVarArg() ? cs.arg_size() < F->arg_size()
+                        : cs.arg_size() != F->arg_size())
+        continue;
+      callees.push_back(F);
+      _callers[F].push_back(inst);
+    }
+  }
+}
+
+int PointsToAnalysis::findClass(const Value *v, unsigned derefs) const {
+  int n = lookup(v);
+  for (unsigned i = 0; i <= derefs && n >= 0; i++)
+    n = _nodes[findConst(n)].pointee;
+  if (n < 0) return -1;
+  return findConst(n);
+}
+
+int PointsToAnalysis::getPointeeClass(const Value *v, unsigned derefs) const {
+  int cls = findClass(v, derefs);
+  if (cls >= 0 && (unsigned)cls == findConst(_unknown)) return -1;
+  return cls;
+}
+
+const std::vector<Function *> &PointsToAnalysis::getCallees(
+    CallSite cs) const {
+  auto it = _callees.find(cs.getInstruction());
+  if (it == _callees.end()) return noCallees;
+  return it->second;
+}
+
+const std::vector<Instruction *> &PointsToAnalysis::getIndirectCallers(
+    Function *fun) const {
+  auto it = _callers.find(fun);
+  if (it == _callers.end()) return noCallers;
+  return it->second;
+}
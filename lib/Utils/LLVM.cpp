@@ -11,19 +11,27 @@
 //
 
 #include "Utils/LLVM.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 using namespace std;
 using namespace llvm;
 
-unique_ptr<Module> parseModule(LLVMContext &context, string inputFile) {
+unique_ptr<Module> parseModule(LLVMContext &context, string inputFile,
+                               bool lazy) {
   SMDiagnostic SMD;
 
 #if ((LLVM_VERSION_MAJOR == 3) && (LLVM_VERSION_MINOR <= 5))
-  auto _M = ParseIRFile(inputFile, SMD, context);
+  auto _M = lazy ? getLazyIRFileModule(inputFile, SMD, context)
+                 : ParseIRFile(inputFile, SMD, context);
   auto M = unique_ptr<Module>(_M);
 #else
-  auto M = parseIRFile(inputFile, SMD, context);
+  auto M = lazy ? getLazyIRFileModule(inputFile, SMD, context)
+                : parseIRFile(inputFile, SMD, context);
 #endif
 
   if (!M) {
@@ -32,6 +40,116 @@ unique_ptr<Module> parseModule(LLVMContext &context, string inputFile) {
   return M;
 }
 
+FunctionMaterializer::FunctionMaterializer(Module &M)
+    : _M(M), _all_materialized(false), _lazy_cnt(0), _materialized_cnt(0) {
+  for (Function &F : M) {
+    if (F.isMaterializable()) _lazy_cnt++;
+  }
+  if (_lazy_cnt == 0) _all_materialized = true;
+}
+
+bool FunctionMaterializer::materialize(Function *F) {
+  if (F == nullptr || !F->isMaterializable()) return true;
+  if (Error err = F->materialize()) {
+    logAllUnhandledErrors(std::move(err), errs(),
+                          "Failed to materialize " + F->getName() + ": ");
+    _failed = true;
+    return false;
+  }
+  _materialized_cnt++;
+  return true;
+}
+
+// The globals of `M` in an order that only depends on the file it was read
+// from, which is how a second copy of the module maps back to it
+static vector<GlobalValue *> listGlobals(Module &M) {
+  vector<GlobalValue *> globals;
+  for (Function &F : M) globals.push_back(&F);
+  for (GlobalVariable &G : M.globals()) globals.push_back(&G);
+  for (GlobalAlias &A : M.aliases()) globals.push_back(&A);
+  for (GlobalIFunc &I : M.ifuncs()) globals.push_back(&I);
+  return globals;
+}
+
+bool FunctionMaterializer::indexUsers() {
+  _indexed = true;
+  LLVMContext context;
+  unique_ptr<Module> scan =
+      parseModule(context, _M.getModuleIdentifier(), true);
+  if (!scan) return false;
+  vector<GlobalValue *> globals = listGlobals(_M);
+  vector<GlobalValue *> scan_globals = listGlobals(*scan);
+  if (globals.size() != scan_globals.size()) return false;
+  map<const GlobalValue *, GlobalValue *> to_main;
+  for (size_t i = 0; i < globals.size(); i++)
+    to_main[scan_globals[i]] = globals[i];
+
+  for (Function &F : *scan) {
+    if (!F.isMaterializable()) continue;
+    if (Error err = F.materialize()) {
+      logAllUnhandledErrors(std::move(err), errs(),
+                            "Failed to prescan " + F.getName() + ": ");
+      return false;
+    }
+    Function *main_F = cast<Function>(to_main[&F]);
+    SmallPtrSet<const Constant *, 32> seen;
+    SmallVector<const Constant *, 32> worklist;
+    for (Instruction &I : instructions(F))
+      for (Value *op : I.operands())
+        if (const Constant *c = dyn_cast<Constant>(op)) worklist.push_back(c);
+    while (!worklist.empty()) {
+      const Constant *c = worklist.pop_back_val();
+      if (!seen.insert(c).second) continue;
+      // Not into initializers, whose uses are always read
+      if (const GlobalValue *GV = dyn_cast<GlobalValue>(c)) {
+        _users[to_main[GV]].push_back(main_F);
+        continue;
+      }
+      for (const Value *op : c->operands())
+        worklist.push_back(cast<Constant>(op));
+    }
+    F.deleteBody();
+  }
+  return true;
+}
+
+bool FunctionMaterializer::materializeUsersOf(const GlobalValue *GV) {
+  if (_all_materialized) return true;
+  if (!_indexed && !indexUsers()) {
+    errs() << "Cannot prescan " << _M.getModuleIdentifier()
+           << ", reading every function instead\n";
+    _index_failed = true;
+  }
+  if (_index_failed) return materializeAll();
+  auto users = _users.find(GV);
+  if (users == _users.end()) return true;
+  bool ok = true;
+  for (Function *F : users->second) ok &= materialize(F);
+  return ok;
+}
+
+bool FunctionMaterializer::materializeAll() {
+  if (_all_materialized) return true;
+  for (Function &F : _M) {
+    if (!materialize(&F)) return false;
+  }
+  // Also pull in the remaining module-level metadata and mark the module as
+  // fully materialized so it can be verified and written.
+  if (Error err = _M.materializeAll()) {
+    logAllUnhandledErrors(std::move(err), errs(), "Failed to materialize: ");
+    _failed = true;
+    return false;
+  }
+  _all_materialized = true;
+  return true;
+}
+
+void FunctionMaterializer::printStats(raw_ostream &os) const {
+  if (!isLazy()) return;
+  os << "Materialized " << _materialized_cnt << " out of " << _lazy_cnt
+     << " lazily loaded functions\n";
+}
+
 // Helper function to demangle a function name given a mangled name
 // Note: This strips out the function arguments along with the function number
 std::string demangleName(std::string mangledName) {
@@ -198,7 +316,7 @@ AllocRules::AllocRules(const Initializer &init) {
   for (const Function &F : init.M) {
     std::string demangled = demangleName(F.getName());
     if (init.alloc.find(demangled) != init.alloc.end())
-      alloc.insert(&F);
+      alloc.insert({&F, init.alloc.find(demangled)->second});
     if (init.dealloc.find(demangled) != init.dealloc.end())
       dealloc.insert({&F, init.dealloc.find(demangled)->second});
     if (init.realloc.find(demangled) != init.realloc.end())
@@ -222,3 +340,64 @@ bool AllocRules::should_ignore(const Function* fun) const {
       realloc.find(fun) != realloc.end() ||
       ignored.find(fun) != ignored.end());
 }
+
+// Parse the arguments of an alloc rule, e.g. "count=0 size=1 movable"
+static bool parseAllocDesc(StringRef args, AllocDesc &desc) {
+  SmallVector<StringRef, 4> fields;
+  args.split(fields, ' ', -1, false);
+  for (StringRef field : fields) {
+    if (field == "movable") {
+      desc.movable = true;
+      continue;
+    }
+    auto key_value = field.split('=');
+    int *arg_no = StringSwitch<int *>(key_value.first)
+                      .Case("size", &desc.size_arg)
+                      .Case("count", &desc.count_arg)
+                      .Case("pool", &desc.pool_arg)
+                      .Default(nullptr);
+    if (arg_no == nullptr || key_value.second.getAsInteger(10, *arg_no) ||
+        *arg_no < 0)
+      return false;
+  }
+  return true;
+}
+
+bool readAllocRules(StringRef path, AllocRules::Initializer &init) {
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    errs() << "Failed to open '" << path
+           << "': " << buffer.getError().message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 0> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    line = line.split('#').first.trim();
+    if (line.empty()) continue;
+    SmallVector<StringRef, 3> fields;
+    line.split(fields, '\t', 2, false);
+    StringRef kind = fields[0].trim();
+    std::string name = fields.size() > 1 ? fields[1].trim().str() : "";
+    StringRef args = fields.size() > 2 ? fields[2].trim() : "";
+    bool ok = !name.empty();
+    if (ok && kind == "alloc") {
+      AllocDesc desc;
+      ok = parseAllocDesc(args, desc);
+      if (ok) init.alloc[name] = desc;
+    } else if (ok && (kind == "dealloc" || kind == "realloc")) {
+      unsigned arg_no;
+      ok = !args.getAsInteger(10, arg_no);
+      if (ok) (kind == "dealloc" ? init.dealloc : init.realloc)[name] = arg_no;
+    } else if (ok && kind == "ignore") {
+      init.ignored.insert(name);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      errs() << "Malformed rule in '" << path << "': " << line << "\n";
+      return false;
+    }
+  }
+  return true;
+}
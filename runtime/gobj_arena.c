@@ -0,0 +1,377 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Arena allocator for tracked objects. All tracked objects live in a single
+// reserved region, so an orbit task can find, map or copy them at once.
+//
+// The region is handed out slab by slab with a bump pointer. Small objects
+// are segregated by size class; each thread keeps a free list per class and
+// exchanges batches of objects with a central list per class. The class of
+// an object is found from a table indexed by slab, so objects need no
+// header. Large objects take whole slabs and are recycled through a
+// first-fit list of free slab runs, which are merged with the free runs
+// next to them when they are freed.
+//
+
+#include "gobj_arena.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+// Objects moved between a thread cache and the central list at once
+#define BATCH_SIZE 32
+
+// Slab table entries
+#define SLAB_UNUSED 0
+#define SLAB_LARGE 0x80000000u
+#define SLAB_LARGE_CONT 0x40000000u
+// On the first and last slab of a free run, along with its length
+#define SLAB_FREE 0x20000000u
+#define SLAB_RUN_MASK (SLAB_FREE - 1)
+
+struct free_obj {
+  struct free_obj *next;
+};
+
+struct class_cache {
+  struct free_obj *head;
+  unsigned cnt;
+};
+
+struct central_list {
+  pthread_mutex_t lock;
+  struct free_obj *head;
+  size_t cnt;
+};
+
+// A run of free large slabs, stored in its first slab
+struct free_run {
+  struct free_run *next;
+  struct free_run *prev;
+  size_t slabs;
+};
+
+static char *arena_base;
+static size_t arena_reserved;
+static size_t arena_slabs;
+static _Atomic size_t next_slab;
+// Per slab: SLAB_UNUSED, size class + 1, SLAB_LARGE | run length on the
+// first slab of a large object and SLAB_LARGE_CONT on the others, with
+// SLAB_FREE once it is freed
+static uint32_t *slab_table;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static struct central_list central[ORBIT_ARENA_NUM_CLASSES];
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct free_run *large_free;
+
+static __thread struct class_cache thread_cache[ORBIT_ARENA_NUM_CLASSES];
+static __thread bool cache_registered;
+
+static void flush_thread_cache(void *arg);
+
+static void arena_init(void) {
+  const char *env = getenv("ORBIT_ARENA_SIZE");
+  size_t reserve = env ? strtoull(env, NULL, 0) : ORBIT_ARENA_RESERVE;
+  size_t slabs = reserve >> ORBIT_ARENA_SLAB_SHIFT;
+  void *base, *table;
+  unsigned i;
+
+  for (i = 0; i < ORBIT_ARENA_NUM_CLASSES; i++)
+    pthread_mutex_init(&central[i].lock, NULL);
+  pthread_key_create(&cache_key, flush_thread_cache);
+  if (slabs == 0) return;
+
+  // Align the region to a slab, so slab boundaries are address boundaries
+  base = mmap(NULL, reserve + ORBIT_ARENA_SLAB_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) return;
+  table = mmap(NULL, slabs * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED) {
+    munmap(base, reserve + ORBIT_ARENA_SLAB_SIZE);
+    return;
+  }
+  slab_table = table;
+  arena_slabs = slabs;
+  arena_reserved = slabs << ORBIT_ARENA_SLAB_SHIFT;
+  arena_base = (char *)(((uintptr_t)base + ORBIT_ARENA_SLAB_SIZE - 1) &
+                        ~(ORBIT_ARENA_SLAB_SIZE - 1));
+}
+
+static inline size_t slab_of(const void *ptr) {
+  return ((const char *)ptr - arena_base) >> ORBIT_ARENA_SLAB_SHIFT;
+}
+
+static inline void *slab_addr(size_t slab) {
+  return arena_base + (slab << ORBIT_ARENA_SLAB_SHIFT);
+}
+
+// Take `n` fresh slabs from the end of the used part of the region
+static size_t bump_slabs(size_t n) {
+  size_t slab = atomic_fetch_add(&next_slab, n);
+  if (slab + n > arena_slabs) return (size_t)-1;
+  return slab;
+}
+
+bool orbit_arena_contains(const void *ptr) {
+  return arena_base != NULL && (const char *)ptr >= arena_base &&
+         (const char *)ptr < arena_base + arena_reserved;
+}
+
+/* Small objects */
+
+static void flush_thread_cache(void *arg) {
+  unsigned cls;
+  (void)arg;
+  for (cls = 0; cls < ORBIT_ARENA_NUM_CLASSES; cls++) {
+    struct class_cache *cache = &thread_cache[cls];
+    struct free_obj *tail = cache->head;
+    if (tail == NULL) continue;
+    while (tail->next != NULL) tail = tail->next;
+    pthread_mutex_lock(&central[cls].lock);
+    tail->next = central[cls].head;
+    central[cls].head = cache->head;
+    central[cls].cnt += cache->cnt;
+    pthread_mutex_unlock(&central[cls].lock);
+    cache->head = NULL;
+    cache->cnt = 0;
+  }
+}
+
+// Hand the cached objects back when the thread exits
+static inline void register_cache(void) {
+  if (unlikely(!cache_registered)) {
+    pthread_setspecific(cache_key, (void *)1);
+    cache_registered = true;
+  }
+}
+
+static bool refill(unsigned cls) {
+  struct class_cache *cache = &thread_cache[cls];
+  struct central_list *list = &central[cls];
+  size_t obj_size, slab, off;
+  char *start;
+
+  register_cache();
+
+  pthread_mutex_lock(&list->lock);
+  while (list->head != NULL && cache->cnt < BATCH_SIZE) {
+    struct free_obj *obj = list->head;
+    list->head = obj->next;
+    list->cnt--;
+    obj->next = cache->head;
+    cache->head = obj;
+    cache->cnt++;
+  }
+  pthread_mutex_unlock(&list->lock);
+  if (cache->head != NULL) return true;
+
+  // Carve a new slab into objects of this class
+  slab = bump_slabs(1);
+  if (slab == (size_t)-1) return false;
+  slab_table[slab] = cls + 1;
+  obj_size = orbit_arena_class_size(cls);
+  start = slab_addr(slab);
+  for (off = ORBIT_ARENA_SLAB_SIZE / obj_size * obj_size; off > 0;) {
+    struct free_obj *obj;
+    off -= obj_size;
+    obj = (struct free_obj *)(start + off);
+    obj->next = cache->head;
+    cache->head = obj;
+    cache->cnt++;
+  }
+  return true;
+}
+
+static inline void *alloc_class(unsigned cls) {
+  struct class_cache *cache = &thread_cache[cls];
+  struct free_obj *obj;
+  if (unlikely(cache->head == NULL) && !refill(cls)) return NULL;
+  obj = cache->head;
+  cache->head = obj->next;
+  cache->cnt--;
+  return obj;
+}
+
+static void free_small(void *ptr, unsigned cls) {
+  struct class_cache *cache = &thread_cache[cls];
+  struct free_obj *obj = ptr;
+  register_cache();
+  obj->next = cache->head;
+  cache->head = obj;
+  cache->cnt++;
+
+  // Do not let one thread hoard the objects freed into its cache
+  if (unlikely(cache->cnt >
+               2 * (ORBIT_ARENA_SLAB_SIZE / orbit_arena_class_size(cls) + BATCH_SIZE))) {
+    struct free_obj *batch = cache->head, *tail = batch;
+    unsigned n = 1;
+    while (n < BATCH_SIZE) {
+      tail = tail->next;
+      n++;
+    }
+    cache->head = tail->next;
+    cache->cnt -= n;
+    pthread_mutex_lock(&central[cls].lock);
+    tail->next = central[cls].head;
+    central[cls].head = batch;
+    central[cls].cnt += n;
+    pthread_mutex_unlock(&central[cls].lock);
+  }
+}
+
+/* Large objects */
+
+// The free runs are only touched with large_lock held
+static void unlink_run(struct free_run *run) {
+  if (run->prev != NULL)
+    run->prev->next = run->next;
+  else
+    large_free = run->next;
+  if (run->next != NULL) run->next->prev = run->prev;
+}
+
+// Record the free run of `slabs` slabs at `slab` in the slab table and in
+// its first slab, without linking it
+static struct free_run *mark_run(size_t slab, size_t slabs) {
+  struct free_run *run = slab_addr(slab);
+  run->slabs = slabs;
+  slab_table[slab] = SLAB_LARGE | SLAB_FREE | slabs;
+  if (slabs > 1)
+    slab_table[slab + slabs - 1] = SLAB_LARGE_CONT | SLAB_FREE | slabs;
+  return run;
+}
+
+static void *alloc_large(size_t size) {
+  size_t slabs = (size + ORBIT_ARENA_SLAB_SIZE - 1) >> ORBIT_ARENA_SLAB_SHIFT;
+  struct free_run *run;
+  size_t slab = (size_t)-1, i;
+
+  pthread_mutex_lock(&large_lock);
+  for (run = large_free; run != NULL; run = run->next) {
+    if (run->slabs < slabs) continue;
+    slab = slab_of(run);
+    if (run->slabs == slabs) {
+      unlink_run(run);
+    } else {
+      // Keep the head of the run on the list and take its tail
+      slab += run->slabs - slabs;
+      mark_run(slab_of(run), run->slabs - slabs);
+    }
+    // Before the lock is released, so that a neighbor being freed does
+    // not see these slabs free
+    slab_table[slab] = SLAB_LARGE | slabs;
+    for (i = 1; i < slabs; i++) slab_table[slab + i] = SLAB_LARGE_CONT;
+    break;
+  }
+  pthread_mutex_unlock(&large_lock);
+  if (slab != (size_t)-1) return slab_addr(slab);
+
+  slab = bump_slabs(slabs);
+  if (slab == (size_t)-1) return NULL;
+  slab_table[slab] = SLAB_LARGE | slabs;
+  for (i = 1; i < slabs; i++) slab_table[slab + i] = SLAB_LARGE_CONT;
+  return slab_addr(slab);
+}
+
+// Merge the run with the free runs right before and after it, so that the
+// arena does not fragment into runs too short for the larger objects
+static void free_large(void *ptr, size_t slabs) {
+  size_t slab = slab_of(ptr), end = slab + slabs;
+  struct free_run *run;
+  uint32_t entry;
+
+  pthread_mutex_lock(&large_lock);
+  if (end < arena_slabs && ((entry = slab_table[end]) & SLAB_FREE)) {
+    unlink_run(slab_addr(end));
+    slab_table[end] = SLAB_LARGE_CONT;
+    end += entry & SLAB_RUN_MASK;
+  }
+  if (slab > 0 && ((entry = slab_table[slab - 1]) & SLAB_FREE)) {
+    slab_table[slab - 1] = SLAB_LARGE_CONT;
+    slab_table[slab] = SLAB_LARGE_CONT;
+    slab -= entry & SLAB_RUN_MASK;
+    unlink_run(slab_addr(slab));
+  }
+  run = mark_run(slab, end - slab);
+  run->prev = NULL;
+  run->next = large_free;
+  if (large_free != NULL) large_free->prev = run;
+  large_free = run;
+  pthread_mutex_unlock(&large_lock);
+}
+
+/* Interface */
+
+void orbit_arena_init(void) { pthread_once(&arena_once, arena_init); }
+
+void *orbit_arena_alloc(size_t size) {
+  pthread_once(&arena_once, arena_init);
+  if (unlikely(arena_base == NULL)) return NULL;
+  if (size <= ORBIT_ARENA_MAX_SMALL)
+    return alloc_class(orbit_arena_size_class(size));
+  return alloc_large(size);
+}
+
+void *orbit_arena_alloc_class(unsigned cls) {
+  pthread_once(&arena_once, arena_init);
+  if (unlikely(arena_base == NULL)) return NULL;
+  return alloc_class(cls);
+}
+
+void orbit_arena_free(void *ptr) {
+  uint32_t entry;
+  if (ptr == NULL) return;
+  entry = slab_table[slab_of(ptr)];
+  if (entry & SLAB_FREE) return;
+  if (entry & SLAB_LARGE)
+    free_large(ptr, entry & SLAB_RUN_MASK);
+  else if (entry != SLAB_UNUSED && !(entry & SLAB_LARGE_CONT))
+    free_small(ptr, entry - 1);
+}
+
+size_t orbit_arena_usable_size(const void *ptr) {
+  uint32_t entry = slab_table[slab_of(ptr)];
+  if (entry & SLAB_FREE) return 0;
+  if (entry & SLAB_LARGE)
+    return (size_t)(entry & SLAB_RUN_MASK) << ORBIT_ARENA_SLAB_SHIFT;
+  if (entry == SLAB_UNUSED || (entry & SLAB_LARGE_CONT)) return 0;
+  return orbit_arena_class_size(entry - 1);
+}
+
+void *orbit_arena_realloc(void *ptr, size_t size) {
+  size_t usable;
+  void *new_ptr;
+  if (ptr == NULL) return orbit_arena_alloc(size);
+  if (size == 0) {
+    orbit_arena_free(ptr);
+    return NULL;
+  }
+  usable = orbit_arena_usable_size(ptr);
+  // Shrink in place unless it frees at least half of the object
+  if (size <= usable && size > usable / 2) return ptr;
+  new_ptr = orbit_arena_alloc(size);
+  if (new_ptr == NULL) return NULL;
+  memcpy(new_ptr, ptr, size < usable ? size : usable);
+  orbit_arena_free(ptr);
+  return new_ptr;
+}
+
+void orbit_arena_get_region(struct orbit_arena_region *region) {
+  size_t used = atomic_load(&next_slab);
+  if (used > arena_slabs) used = arena_slabs;
+  region->base = arena_base;
+  region->reserved = arena_reserved;
+  region->used = used << ORBIT_ARENA_SLAB_SHIFT;
+}
@@ -0,0 +1,79 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _GOBJ_ARENA_H_
+#define _GOBJ_ARENA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Virtual address space reserved for tracked objects. Pages are only backed
+// once they are touched. Can be overridden with the ORBIT_ARENA_SIZE
+// environment variable (in bytes).
+#ifndef ORBIT_ARENA_RESERVE
+#define ORBIT_ARENA_RESERVE (64ULL << 30)
+#endif
+
+// The arena is carved into slabs, each holding objects of one size class.
+// Objects larger than ORBIT_ARENA_MAX_SMALL get whole slabs of their own.
+#define ORBIT_ARENA_SLAB_SHIFT 16
+#define ORBIT_ARENA_SLAB_SIZE (1UL << ORBIT_ARENA_SLAB_SHIFT)
+#define ORBIT_ARENA_MAX_SMALL (32UL << 10)
+#define ORBIT_ARENA_NUM_CLASSES 40
+
+struct orbit_arena_region {
+  // Start of the reserved region, NULL if the arena was never used
+  void *base;
+  size_t reserved;
+  // Every tracked object lies in [base, base + used)
+  size_t used;
+};
+
+/*
+ * Classes are 16-byte steps up to 128 bytes, then 4 steps per power of two
+ * up to ORBIT_ARENA_MAX_SMALL (160, 192, 224, 256, 320, ...). The
+ * instrumentor computes the class of constant sizes with these too.
+ */
+static inline unsigned orbit_arena_size_class(size_t size) {
+  unsigned lg;
+  if (size <= 128) return size == 0 ? 0 : (size - 1) >> 4;
+  lg = 63 - __builtin_clzl(size - 1);
+  return 8 + (lg - 7) * 4 + ((size - 1) >> (lg - 2)) - 4;
+}
+
+static inline size_t orbit_arena_class_size(unsigned cls) {
+  unsigned k, lg;
+  if (cls < 8) return (cls + 1) * 16;
+  k = cls - 8;
+  lg = 7 + k / 4;
+  return (size_t)(5 + k % 4) << (lg - 2);
+}
+
+// Reserve the region now rather than on the first allocation
+void orbit_arena_init(void);
+// Returns NULL when the arena is exhausted or cannot be mapped
+void *orbit_arena_alloc(size_t size);
+// The same for an object of size class `cls`, which must be below
+// ORBIT_ARENA_NUM_CLASSES, when the caller already knows it
+void *orbit_arena_alloc_class(unsigned cls);
+void orbit_arena_free(void *ptr);
+void *orbit_arena_realloc(void *ptr, size_t size);
+size_t orbit_arena_usable_size(const void *ptr);
+bool orbit_arena_contains(const void *ptr);
+void orbit_arena_get_region(struct orbit_arena_region *region);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _GOBJ_ARENA_H_ */
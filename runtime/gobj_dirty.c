@@ -0,0 +1,105 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Soft-dirty page tracking. Writing "4" to /proc/self/clear_refs clears the
+// soft-dirty bit of every page of the process; the kernel sets it again on
+// the next write to the page, and reports it as bit 55 of the page's entry in
+// /proc/self/pagemap. This needs a kernel built with CONFIG_MEM_SOFT_DIRTY.
+//
+
+#include "gobj_dirty.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define PM_SWAPPED (1ULL << 62)
+#define PM_PRESENT (1ULL << 63)
+// Page map entries read at once
+#define SCAN_CHUNK 512
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static bool supported;
+static size_t page_size;
+
+size_t orbit_page_size(void) {
+  if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+bool orbit_dirty_clear(void) {
+  int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  bool ok;
+  if (fd < 0) return false;
+  ok = write(fd, "4", 1) == 1;
+  close(fd);
+  return ok;
+}
+
+static bool read_entries(int fd, const void *addr, uint64_t *entries,
+                         size_t n) {
+  off_t off = (uintptr_t)addr / orbit_page_size() * sizeof(uint64_t);
+  return pread(fd, entries, n * sizeof(uint64_t), off) ==
+         (ssize_t)(n * sizeof(uint64_t));
+}
+
+// Clearing must reset the bit of a written page, and a write after that must
+// set it again; some kernels accept clear_refs but never set the bit.
+static void probe(void) {
+  volatile char *page;
+  uint64_t entry;
+  int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  page = mmap(NULL, orbit_page_size(), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  page[0] = 1;
+  if (orbit_dirty_clear() && read_entries(fd, (void *)page, &entry, 1) &&
+      !(entry & PM_SOFT_DIRTY)) {
+    page[0] = 2;
+    supported =
+        read_entries(fd, (void *)page, &entry, 1) && (entry & PM_SOFT_DIRTY);
+  }
+  munmap((void *)page, orbit_page_size());
+  close(fd);
+}
+
+bool orbit_dirty_supported(void) {
+  pthread_once(&probe_once, probe);
+  return supported;
+}
+
+bool orbit_dirty_scan(const void *base, size_t npages, uint64_t *bitmap) {
+  uint64_t entries[SCAN_CHUNK];
+  const char *addr = base;
+  size_t i, j;
+  int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  memset(bitmap, 0, (npages + 63) / 64 * sizeof(uint64_t));
+  for (i = 0; i < npages; i += SCAN_CHUNK) {
+    size_t n = npages - i < SCAN_CHUNK ? npages - i : SCAN_CHUNK;
+    if (!read_entries(fd, addr + i * orbit_page_size(), entries, n)) {
+      close(fd);
+      return false;
+    }
+    for (j = 0; j < n; j++) {
+      // A page that is not resident may have been dropped and refaulted
+      if ((entries[j] & PM_SOFT_DIRTY) ||
+          !(entries[j] & (PM_PRESENT | PM_SWAPPED)))
+        bitmap[(i + j) / 64] |= 1ULL << ((i + j) % 64);
+    }
+  }
+  close(fd);
+  return true;
+}
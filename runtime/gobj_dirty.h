@@ -0,0 +1,35 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _GOBJ_DIRTY_H_
+#define _GOBJ_DIRTY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Whether the kernel tracks soft-dirty pages for this process. The first call
+// probes it, which clears the soft-dirty bits of the whole process.
+bool orbit_dirty_supported(void);
+// Clear the soft-dirty bits of every page of the process
+bool orbit_dirty_clear(void);
+// Set bit i of `bitmap` for each page i of the `npages` pages from `base`
+// that was written since the last clear. Pages that are not resident are
+// reported dirty. Returns false if the page map cannot be read.
+bool orbit_dirty_scan(const void *base, size_t npages, uint64_t *bitmap);
+size_t orbit_page_size(void);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _GOBJ_DIRTY_H_ */
@@ -0,0 +1,295 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Index of the live tracked objects by address range. It is a three-level
+// radix tree keyed by the page number, whose leaves hold one record per page:
+// the objects starting on the page, sorted by address, and the object that
+// starts on an earlier page and covers the start of this one. Any pointer
+// into an object is resolved by looking at its page alone, and walking the
+// tree in order enumerates the objects sorted by address.
+//
+// Inner nodes are installed with compare-and-swap and never freed. Page
+// records are guarded by a lock picked by page number, so threads working on
+// different pages rarely contend.
+//
+
+#include "gobj_index.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_PAGE_SHIFT 12
+#define LEVEL_BITS 12
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+// Three levels cover the page numbers of 48-bit addresses
+#define PAGE_NUM_BITS (3 * LEVEL_BITS)
+#define STRIPE_BITS 6
+#define NUM_STRIPES (1 << STRIPE_BITS)
+#define MIN_CAPACITY 4
+
+struct page_objs {
+  // addr == 0 if no object covers the start of the page
+  struct orbit_gobj_entry cover;
+  struct orbit_gobj_entry *objs;
+  uint32_t cnt;
+  uint32_t cap;
+};
+
+struct leaf {
+  struct page_objs *pages[LEVEL_SIZE];
+};
+
+struct mid {
+  struct leaf *leaves[LEVEL_SIZE];
+};
+
+struct stripe {
+  pthread_mutex_t lock;
+  size_t cnt;
+  uint64_t bytes;
+} __attribute__((aligned(64)));
+
+static struct mid *root[LEVEL_SIZE];
+static struct stripe stripes[NUM_STRIPES] = {
+    [0 ... NUM_STRIPES - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+static inline struct stripe *stripe_of(uint64_t pn) {
+  return &stripes[(pn * 0x9e3779b97f4a7c15ull) >> (64 - STRIPE_BITS)];
+}
+
+// Install a zeroed node in `slot` unless another thread was first
+static void *install(void **slot, size_t size) {
+  void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE), *expected = NULL;
+  if (node != NULL) return node;
+  node = calloc(1, size);
+  if (node == NULL) return NULL;
+  if (!__atomic_compare_exchange_n(slot, &expected, node, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(node);
+    return expected;
+  }
+  return node;
+}
+
+// The record of page `pn`, with the stripe of the page locked
+static struct page_objs *get_page(uint64_t pn, bool create) {
+  struct mid **mid_slot;
+  struct leaf **leaf_slot;
+  struct mid *mid;
+  struct leaf *leaf;
+  struct page_objs **page;
+  if (pn >> PAGE_NUM_BITS) return NULL;
+
+  mid_slot = &root[pn >> (2 * LEVEL_BITS)];
+  mid = create ? install((void **)mid_slot, sizeof(*mid))
+               : __atomic_load_n(mid_slot, __ATOMIC_ACQUIRE);
+  if (mid == NULL) return NULL;
+  leaf_slot = &mid->leaves[(pn >> LEVEL_BITS) & (LEVEL_SIZE - 1)];
+  leaf = create ? install((void **)leaf_slot, sizeof(*leaf))
+                : __atomic_load_n(leaf_slot, __ATOMIC_ACQUIRE);
+  if (leaf == NULL) return NULL;
+  page = &leaf->pages[pn & (LEVEL_SIZE - 1)];
+  if (*page == NULL && create) *page = calloc(1, sizeof(**page));
+  return *page;
+}
+
+// Index of the first object of the page at or after `addr`
+static uint32_t lower_bound(const struct page_objs *page, uint64_t addr) {
+  uint32_t lo = 0, hi = page->cnt;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (page->objs[mid].addr < addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static inline uint64_t last_page(const struct orbit_gobj_entry *entry) {
+  return (entry->addr + (entry->size ? entry->size - 1 : 0)) >>
+         INDEX_PAGE_SHIFT;
+}
+
+// Set or clear the cover of the pages after the first one of `entry`
+static void set_cover(const struct orbit_gobj_entry *entry, bool covered) {
+  uint64_t pn, end = last_page(entry);
+  for (pn = (entry->addr >> INDEX_PAGE_SHIFT) + 1; pn <= end; pn++) {
+    struct stripe *stripe = stripe_of(pn);
+    struct page_objs *page;
+    pthread_mutex_lock(&stripe->lock);
+    page = get_page(pn, covered);
+    if (page != NULL) {
+      if (covered)
+        page->cover = *entry;
+      else if (page->cover.addr == entry->addr)
+        page->cover.addr = 0;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+  }
+}
+
+void orbit_index_insert(const void *addr, size_t size, uint32_t site,
+                        uint32_t weight) {
+  struct orbit_gobj_entry entry = {(uint64_t)(uintptr_t)addr, size, site,
+                                   weight};
+  uint64_t pn = entry.addr >> INDEX_PAGE_SHIFT;
+  struct stripe *stripe = stripe_of(pn);
+  struct page_objs *page;
+  uint32_t i;
+  if (entry.addr == 0) return;
+
+  pthread_mutex_lock(&stripe->lock);
+  page = get_page(pn, true);
+  if (page == NULL) {
+    pthread_mutex_unlock(&stripe->lock);
+    return;
+  }
+  if (page->cnt == page->cap) {
+    uint32_t cap = page->cap ? page->cap * 2 : MIN_CAPACITY;
+    struct orbit_gobj_entry *objs = realloc(page->objs, cap * sizeof(*objs));
+    if (objs == NULL) {
+      pthread_mutex_unlock(&stripe->lock);
+      return;
+    }
+    page->objs = objs;
+    page->cap = cap;
+  }
+  i = lower_bound(page, entry.addr);
+  memmove(&page->objs[i + 1], &page->objs[i],
+          (page->cnt - i) * sizeof(page->objs[0]));
+  page->objs[i] = entry;
+  page->cnt++;
+  stripe->cnt++;
+  stripe->bytes += size;
+  pthread_mutex_unlock(&stripe->lock);
+
+  set_cover(&entry, true);
+}
+
+bool orbit_index_erase(const void *addr, struct orbit_gobj_entry *entry) {
+  uint64_t key = (uint64_t)(uintptr_t)addr, pn = key >> INDEX_PAGE_SHIFT;
+  struct stripe *stripe = stripe_of(pn);
+  struct orbit_gobj_entry erased;
+  struct page_objs *page;
+  uint32_t i;
+
+  pthread_mutex_lock(&stripe->lock);
+  page = get_page(pn, false);
+  if (page == NULL || (i = lower_bound(page, key)) == page->cnt ||
+      page->objs[i].addr != key) {
+    pthread_mutex_unlock(&stripe->lock);
+    return false;
+  }
+  erased = page->objs[i];
+  memmove(&page->objs[i], &page->objs[i + 1],
+          (page->cnt - i - 1) * sizeof(page->objs[0]));
+  page->cnt--;
+  stripe->cnt--;
+  stripe->bytes -= erased.size;
+  pthread_mutex_unlock(&stripe->lock);
+
+  set_cover(&erased, false);
+  if (entry != NULL) *entry = erased;
+  return true;
+}
+
+bool orbit_index_find(const void *ptr, struct orbit_gobj_entry *entry) {
+  uint64_t key = (uint64_t)(uintptr_t)ptr, pn = key >> INDEX_PAGE_SHIFT;
+  struct stripe *stripe = stripe_of(pn);
+  const struct orbit_gobj_entry *found = NULL;
+  struct page_objs *page;
+  uint32_t i;
+
+  pthread_mutex_lock(&stripe->lock);
+  page = get_page(pn, false);
+  if (page != NULL) {
+    // The last object starting at or before `ptr`, else the one covering
+    // the start of the page
+    i = lower_bound(page, key + 1);
+    if (i > 0)
+      found = &page->objs[i - 1];
+    else if (page->cover.addr != 0)
+      found = &page->cover;
+    // A zero-sized object only contains its own address
+    if (found != NULL &&
+        key - found->addr >= (found->size ? found->size : 1))
+      found = NULL;
+    if (found != NULL && entry != NULL) *entry = *found;
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  return found != NULL;
+}
+
+size_t orbit_index_count(void) {
+  size_t cnt = 0;
+  unsigned i;
+  for (i = 0; i < NUM_STRIPES; i++)
+    cnt += __atomic_load_n(&stripes[i].cnt, __ATOMIC_RELAXED);
+  return cnt;
+}
+
+uint64_t orbit_index_bytes(void) {
+  uint64_t bytes = 0;
+  unsigned i;
+  for (i = 0; i < NUM_STRIPES; i++)
+    bytes += __atomic_load_n(&stripes[i].bytes, __ATOMIC_RELAXED);
+  return bytes;
+}
+
+void orbit_index_lock_all(void) {
+  unsigned i;
+  // Always in the same order
+  for (i = 0; i < NUM_STRIPES; i++) pthread_mutex_lock(&stripes[i].lock);
+}
+
+void orbit_index_unlock_all(void) {
+  unsigned i;
+  for (i = NUM_STRIPES; i > 0; i--)
+    pthread_mutex_unlock(&stripes[i - 1].lock);
+}
+
+void orbit_index_walk(bool (*fn)(const struct orbit_gobj_entry *, void *),
+                      void *arg) {
+  unsigned i, j, k;
+  uint32_t n;
+  for (i = 0; i < LEVEL_SIZE; i++) {
+    struct mid *mid = __atomic_load_n(&root[i], __ATOMIC_ACQUIRE);
+    if (mid == NULL) continue;
+    for (j = 0; j < LEVEL_SIZE; j++) {
+      struct leaf *leaf =
+          __atomic_load_n(&mid->leaves[j], __ATOMIC_ACQUIRE);
+      if (leaf == NULL) continue;
+      for (k = 0; k < LEVEL_SIZE; k++) {
+        struct page_objs *page = leaf->pages[k];
+        if (page == NULL) continue;
+        for (n = 0; n < page->cnt; n++)
+          if (!fn(&page->objs[n], arg)) return;
+      }
+    }
+  }
+}
+
+struct collect_state {
+  struct orbit_gobj_entry *entries;
+  size_t n;
+  size_t max;
+};
+
+static bool collect_one(const struct orbit_gobj_entry *entry, void *arg) {
+  struct collect_state *state = arg;
+  if (state->n == state->max) return false;
+  state->entries[state->n++] = *entry;
+  return true;
+}
+
+size_t orbit_index_collect(struct orbit_gobj_entry *entries, size_t max) {
+  struct collect_state state = {entries, 0, max};
+  orbit_index_walk(collect_one, &state);
+  return state.n;
+}
@@ -0,0 +1,54 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _GOBJ_INDEX_H_
+#define _GOBJ_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Live tracked object
+struct orbit_gobj_entry {
+  uint64_t addr;
+  uint64_t size;
+  uint32_t site;
+  // Sample weight of the allocation, 0 if it was not sampled
+  uint32_t weight;
+};
+
+void orbit_index_insert(const void *addr, size_t size, uint32_t site,
+                        uint32_t weight);
+// Returns false if `addr` was not the start of a live tracked object,
+// otherwise the object is stored to `entry` unless it is NULL
+bool orbit_index_erase(const void *addr, struct orbit_gobj_entry *entry);
+// Find the live tracked object that `ptr` points into
+bool orbit_index_find(const void *ptr, struct orbit_gobj_entry *entry);
+size_t orbit_index_count(void);
+uint64_t orbit_index_bytes(void);
+
+// Block inserts and erases on the whole index, e.g. while copying objects
+void orbit_index_lock_all(void);
+void orbit_index_unlock_all(void);
+// Call `fn` on the live objects in address order, until it returns false.
+// The index must be locked.
+void orbit_index_walk(bool (*fn)(const struct orbit_gobj_entry *, void *),
+                      void *arg);
+// Copy up to `max` live objects to `entries` in address order, returns how
+// many were copied. The index must be locked.
+size_t orbit_index_collect(struct orbit_gobj_entry *entries, size_t max);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _GOBJ_INDEX_H_ */
@@ -0,0 +1,130 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Slow path of the allocation sampler: (re)arming the per-thread countdown
+// and computing the weight of a sample. In byte mode the distance between
+// two samples is drawn from an exponential distribution, which makes the
+// sampling memoryless: an allocation of `size` bytes is sampled with
+// probability 1 - exp(-size / period) whatever came before it, and its
+// weight is the inverse of that.
+//
+
+#include "gobj_sampler.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+__thread int64_t orbit_sample_countdown
+    __attribute__((tls_model("initial-exec")));
+int orbit_sample_by_bytes;
+
+static pthread_once_t sample_once = PTHREAD_ONCE_INIT;
+static uint32_t sample_mode = ORBIT_SAMPLE_ALL;
+static uint64_t sample_period = 1;
+
+static __thread bool thread_armed;
+static __thread uint64_t thread_rng;
+
+static uint64_t env_period(const char *name) {
+  const char *env = getenv(name);
+  char *end;
+  unsigned long long v;
+  if (env == NULL || *env == '\0') return 0;
+  v = strtoull(env, &end, 10);
+  return *end == '\0' ? (uint64_t)v : 0;
+}
+
+static void sample_init(void) {
+  uint64_t bytes = env_period("ORBIT_SAMPLE_BYTES");
+  uint64_t every = env_period("ORBIT_SAMPLE_EVERY");
+  if (bytes > 0) {
+    sample_mode = ORBIT_SAMPLE_BYTES;
+    sample_period = bytes;
+    orbit_sample_by_bytes = 1;
+  } else if (every > 1) {
+    sample_mode = ORBIT_SAMPLE_EVERY;
+    sample_period = every;
+  }
+}
+
+// splitmix64, seeded per thread
+static uint64_t next_random(void) {
+  uint64_t z = (thread_rng += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// Uniform in (0, 1]
+static double next_uniform(void) {
+  return ((next_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static int64_t next_interval(void) {
+  double interval;
+  if (sample_mode != ORBIT_SAMPLE_BYTES) return (int64_t)sample_period;
+  interval = -log(next_uniform()) * (double)sample_period;
+  if (interval < 1) return 1;
+  if (interval > (double)(INT64_MAX / 2)) return INT64_MAX / 2;
+  return (int64_t)interval;
+}
+
+// Weight of a sampled allocation of `size` bytes in byte mode. It is rounded
+// at random to one of the two nearest integers, which keeps the sum of the
+// weights an unbiased estimate of the number of allocations.
+static uint32_t bytes_weight(size_t size) {
+  double weight, floor_weight;
+  if (size == 0) return 1;
+  weight = -1.0 / expm1(-(double)size / (double)sample_period);
+  if (weight >= (double)UINT32_MAX) return UINT32_MAX;
+  floor_weight = floor(weight);
+  if (next_uniform() <= weight - floor_weight) floor_weight += 1;
+  return floor_weight < 1 ? 1 : (uint32_t)floor_weight;
+}
+
+uint32_t orbit_sample_slow(size_t size) {
+  if (unlikely(!thread_armed)) {
+    struct timespec ts;
+    pthread_once(&sample_once, sample_init);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    thread_rng = (uint64_t)(uintptr_t)&thread_rng ^
+                 ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+    thread_armed = true;
+    // The first allocation of the thread is not special, start the
+    // countdown and account for it like any other
+    orbit_sample_countdown = next_interval();
+    if ((orbit_sample_countdown -=
+         orbit_sample_by_bytes ? (int64_t)size : 1) > 0)
+      return 0;
+  }
+
+  switch (sample_mode) {
+    case ORBIT_SAMPLE_EVERY:
+      orbit_sample_countdown += (int64_t)sample_period;
+      return sample_period > UINT32_MAX ? UINT32_MAX
+                                        : (uint32_t)sample_period;
+    case ORBIT_SAMPLE_BYTES:
+      // Memoryless: what is left of the interval this allocation ran over
+      // does not carry over to the next one
+      orbit_sample_countdown = next_interval();
+      return bytes_weight(size);
+    default:
+      orbit_sample_countdown = 1;
+      return 1;
+  }
+}
+
+void orbit_sample_get_config(uint32_t *mode, uint64_t *period) {
+  pthread_once(&sample_once, sample_init);
+  *mode = sample_mode;
+  *period = sample_period;
+}
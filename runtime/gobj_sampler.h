@@ -0,0 +1,58 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Sampling of the traced allocations. Each thread counts down to its next
+// sample, in allocations or in bytes, so an allocation that is not sampled
+// costs a decrement and a branch. The mode is read from the environment on
+// the first allocation:
+//
+//   ORBIT_SAMPLE_BYTES=B   sample with probability 1 - exp(-size / B), the
+//                          byte-based Poisson sampling of tcmalloc
+//   ORBIT_SAMPLE_EVERY=N   sample every Nth allocation of each thread
+//
+// With neither (or N = 1) every allocation is sampled. A sample carries its
+// weight, the number of allocations it stands for, so that totals can be
+// extrapolated from a sampled trace.
+//
+
+#ifndef _GOBJ_SAMPLER_H_
+#define _GOBJ_SAMPLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace_format.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Allocations (or bytes) left before the next sample of the thread. The
+// runtime is linked into the program rather than loaded, so the static TLS
+// model is safe and keeps the access to a single instruction. The
+// instrumentor's inline hooks (AllocInstrumenter::emitInlineHook) read and
+// update both variables from the program, so they are part of the interface
+// of the runtime.
+extern __thread int64_t orbit_sample_countdown
+    __attribute__((tls_model("initial-exec")));
+extern int orbit_sample_by_bytes;
+
+uint32_t orbit_sample_slow(size_t size);
+void orbit_sample_get_config(uint32_t *mode, uint64_t *period);
+
+// Returns the weight of the allocation if it is sampled, otherwise 0
+static inline uint32_t orbit_sample(size_t size) {
+  int64_t step = orbit_sample_by_bytes ? (int64_t)size : 1;
+  if (__builtin_expect((orbit_sample_countdown -= step) > 0, 1)) return 0;
+  return orbit_sample_slow(size);
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _GOBJ_SAMPLER_H_ */
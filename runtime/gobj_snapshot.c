@@ -0,0 +1,342 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Bulk copies of the live tracked objects. The live index is locked for the
+// duration of a snapshot, so objects are neither freed nor allocated while
+// they are copied; writes to the objects themselves are not blocked.
+//
+// Objects are copied in address order. Neighbors in the arena are merged into
+// a single copy when the gap between them is small, and large copies use
+// non-temporal stores so the snapshot does not evict the program's cache.
+//
+// Incremental snapshots mirror the arena in a buffer that the caller keeps
+// across snapshots. The soft-dirty bits are cleared on every snapshot, so the
+// next one only copies the pages of live objects written in between, plus the
+// objects that were allocated since. The bits cannot be read and cleared at
+// once, so this needs the writers quiescent: a write between the scan and the
+// clear to a page the scan saw clean would never be copied.
+//
+
+#include "gobj_tracker.h"
+
+#include "gobj_arena.h"
+#include "gobj_dirty.h"
+#include "gobj_index.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Copies below this size go through memcpy
+#define NT_THRESHOLD 256
+// Largest gap between two objects that is copied instead of split
+#define MERGE_GAP 256
+#define DATA_ALIGN 64
+
+#if defined(__AVX2__)
+#define VEC_SIZE 32
+typedef __m256i vec_t;
+#define vec_load(p) _mm256_loadu_si256((const vec_t *)(p))
+#define vec_stream(p, v) _mm256_stream_si256((vec_t *)(p), v)
+#elif defined(__SSE2__)
+#define VEC_SIZE 16
+typedef __m128i vec_t;
+#define vec_load(p) _mm_loadu_si128((const vec_t *)(p))
+#define vec_stream(p, v) _mm_stream_si128((vec_t *)(p), v)
+#endif
+
+static void copy_nt(void *dst, const void *src, size_t n) {
+#ifdef VEC_SIZE
+  char *d = dst;
+  const char *s = src;
+  size_t head;
+  if (n < NT_THRESHOLD) {
+    memcpy(d, s, n);
+    return;
+  }
+  // Streaming stores need an aligned destination
+  head = -(uintptr_t)d & (VEC_SIZE - 1);
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+  for (; n >= 4 * VEC_SIZE; n -= 4 * VEC_SIZE) {
+    vec_t v0 = vec_load(s), v1 = vec_load(s + VEC_SIZE);
+    vec_t v2 = vec_load(s + 2 * VEC_SIZE), v3 = vec_load(s + 3 * VEC_SIZE);
+    __builtin_prefetch(s + 8 * VEC_SIZE);
+    vec_stream(d, v0);
+    vec_stream(d + VEC_SIZE, v1);
+    vec_stream(d + 2 * VEC_SIZE, v2);
+    vec_stream(d + 3 * VEC_SIZE, v3);
+    s += 4 * VEC_SIZE;
+    d += 4 * VEC_SIZE;
+  }
+  for (; n >= VEC_SIZE; n -= VEC_SIZE) {
+    vec_stream(d, vec_load(s));
+    s += VEC_SIZE;
+    d += VEC_SIZE;
+  }
+  memcpy(d, s, n);
+#else
+  memcpy(dst, src, n);
+#endif
+}
+
+// Make the streaming stores visible before returning to the caller
+static inline void copy_fence(void) {
+#ifdef VEC_SIZE
+  _mm_sfence();
+#endif
+}
+
+// Live objects sorted by address, the index must be locked
+static struct orbit_gobj_entry *collect_sorted(size_t *cnt) {
+  size_t n = orbit_index_count();
+  struct orbit_gobj_entry *entries = malloc((n ? n : 1) * sizeof(*entries));
+  if (entries == NULL) return NULL;
+  *cnt = orbit_index_collect(entries, n);
+  return entries;
+}
+
+// Copy `entries[0..n)` to `data`, where merged runs keep their source layout.
+// Fills in the descriptors and returns the size of the data, or only computes
+// the size if `data` is NULL.
+static size_t copy_runs(const struct orbit_gobj_entry *entries, size_t n,
+                        char *data, uint64_t data_offset,
+                        struct orbit_gobj_desc *descs) {
+  size_t off = 0, i = 0;
+  while (i < n) {
+    uint64_t start = entries[i].addr, end = start + entries[i].size;
+    size_t j = i + 1;
+    while (j < n && entries[j].addr >= end &&
+           entries[j].addr - end <= MERGE_GAP) {
+      end = entries[j].addr + entries[j].size;
+      j++;
+    }
+    if (data != NULL) {
+      for (; i < j; i++) {
+        descs[i].guid = entries[i].site;
+        descs[i].addr = entries[i].addr;
+        descs[i].size = entries[i].size;
+        descs[i].offset = data_offset + off + (entries[i].addr - start);
+      }
+      copy_nt(data + off, (const void *)(uintptr_t)start, end - start);
+    }
+    i = j;
+    off += end - start;
+  }
+  return off;
+}
+
+size_t __orbit_gobj_snapshot(void *dst, size_t cap) {
+  struct orbit_snapshot_header *header = dst;
+  struct orbit_gobj_desc *descs;
+  struct orbit_gobj_entry *entries;
+  size_t n, data_offset, data_size, total;
+
+  orbit_index_lock_all();
+  entries = collect_sorted(&n);
+  if (entries == NULL) {
+    orbit_index_unlock_all();
+    return 0;
+  }
+  data_offset = sizeof(*header) + n * sizeof(*descs);
+  data_offset = (data_offset + DATA_ALIGN - 1) & ~(size_t)(DATA_ALIGN - 1);
+  data_size = copy_runs(entries, n, NULL, 0, NULL);
+  total = data_offset + data_size;
+
+  if (total <= cap) {
+    descs = (struct orbit_gobj_desc *)(header + 1);
+    copy_runs(entries, n, (char *)dst + data_offset, data_offset, descs);
+    copy_fence();
+    header->count = n;
+    header->data_offset = data_offset;
+    header->data_size = data_size;
+  }
+  orbit_index_unlock_all();
+  free(entries);
+  return total;
+}
+
+size_t __orbit_gobj_snapshot_sg(const struct iovec *iov, int iovcnt,
+                                struct orbit_gobj_desc *descs,
+                                size_t max_descs) {
+  struct orbit_gobj_entry *entries;
+  size_t n, i, seg_off = 0;
+  uint64_t offset = 0;
+  int seg = 0;
+
+  orbit_index_lock_all();
+  entries = collect_sorted(&n);
+  if (entries == NULL) {
+    orbit_index_unlock_all();
+    return 0;
+  }
+
+  for (i = 0; i < n && i < max_descs; i++) {
+    const char *src = (const char *)(uintptr_t)entries[i].addr;
+    size_t left = entries[i].size, room = 0;
+    int s;
+
+    // Check that the object fits in the remaining buffers first
+    for (s = seg; s < iovcnt && room < left; s++)
+      room += iov[s].iov_len - (s == seg ? seg_off : 0);
+    if (room < left) break;
+
+    descs[i].guid = entries[i].site;
+    descs[i].addr = entries[i].addr;
+    descs[i].size = entries[i].size;
+    descs[i].offset = offset;
+    offset += left;
+    while (left > 0) {
+      size_t chunk = iov[seg].iov_len - seg_off;
+      if (chunk > left) chunk = left;
+      copy_nt((char *)iov[seg].iov_base + seg_off, src, chunk);
+      src += chunk;
+      left -= chunk;
+      seg_off += chunk;
+      if (seg_off == iov[seg].iov_len) {
+        seg++;
+        seg_off = 0;
+      }
+    }
+  }
+  copy_fence();
+  orbit_index_unlock_all();
+  free(entries);
+  return i;
+}
+
+/* Incremental snapshots */
+
+// Guarded by the index lock
+static struct {
+  // Image filled by the last snapshot, NULL if the next must be full
+  void *image;
+  // Objects of the last snapshot, sorted by address
+  struct orbit_gobj_entry *entries;
+  size_t cnt;
+  uint64_t *dirty;
+  size_t dirty_pages;
+} last;
+
+static struct orbit_snapshot_stats snapshot_stats;
+
+static inline bool page_dirty(size_t page) {
+  return last.dirty[page / 64] & (1ULL << (page % 64));
+}
+
+// Copy the dirty pages of an object to the image, returns the bytes copied
+static size_t copy_dirty(char *image, uintptr_t base, uint64_t addr,
+                         uint64_t size) {
+  size_t page_size = orbit_page_size(), copied = 0;
+  uint64_t end = addr + size, run = addr, cur = addr;
+  while (cur < end) {
+    size_t page = (cur - base) / page_size;
+    uint64_t next = base + (page + 1) * page_size;
+    if (next > end) next = end;
+    if (!page_dirty(page)) {
+      if (run < cur) {
+        copy_nt(image + (run - base), (const void *)(uintptr_t)run, cur - run);
+        copied += cur - run;
+      }
+      run = next;
+    }
+    cur = next;
+  }
+  if (run < end) {
+    copy_nt(image + (run - base), (const void *)(uintptr_t)run, end - run);
+    copied += end - run;
+  }
+  return copied;
+}
+
+// Read the soft-dirty bits of the used part of the arena
+static bool scan_dirty(const struct orbit_arena_region *region) {
+  size_t pages = region->used / orbit_page_size();
+  if (pages > last.dirty_pages) {
+    uint64_t *dirty = realloc(last.dirty, (pages + 63) / 64 * sizeof(uint64_t));
+    if (dirty == NULL) return false;
+    last.dirty = dirty;
+    last.dirty_pages = pages;
+  }
+  return orbit_dirty_scan(region->base, pages, last.dirty);
+}
+
+size_t __orbit_gobj_snapshot_incremental(void *image, size_t cap,
+                                         struct orbit_gobj_desc *descs,
+                                         size_t max_descs, bool quiescent,
+                                         size_t *count) {
+  struct orbit_arena_region region;
+  struct orbit_gobj_entry *entries;
+  uintptr_t base;
+  size_t n, i, j = 0;
+  uint64_t copied = 0, live = 0;
+  // With writers running, the bits are left alone and every copy is full
+  bool tracking = quiescent && orbit_dirty_supported(), incremental, cleared;
+
+  orbit_index_lock_all();
+  entries = collect_sorted(&n);
+  if (entries == NULL) {
+    orbit_index_unlock_all();
+    return 0;
+  }
+  orbit_arena_get_region(&region);
+  base = (uintptr_t)region.base;
+  *count = n;
+  if (region.used > cap || n > max_descs) {
+    orbit_index_unlock_all();
+    free(entries);
+    return region.used;
+  }
+
+  incremental = tracking && image == last.image && last.entries != NULL &&
+                scan_dirty(&region);
+  cleared = tracking && orbit_dirty_clear();
+  incremental = incremental && cleared;
+
+  for (i = 0; i < n; i++) {
+    const struct orbit_gobj_entry *e = &entries[i];
+    descs[i].guid = e->site;
+    descs[i].addr = e->addr;
+    descs[i].size = e->size;
+    descs[i].offset = e->addr - base;
+    live += e->size;
+
+    // Objects that are new since the last snapshot are copied whole
+    while (j < last.cnt && last.entries[j].addr < e->addr) j++;
+    if (incremental && j < last.cnt && last.entries[j].addr == e->addr &&
+        last.entries[j].size == e->size) {
+      copied += copy_dirty(image, base, e->addr, e->size);
+    } else {
+      copy_nt((char *)image + (e->addr - base), (void *)(uintptr_t)e->addr,
+              e->size);
+      copied += e->size;
+    }
+  }
+  copy_fence();
+
+  if (incremental)
+    snapshot_stats.incremental++;
+  else
+    snapshot_stats.full++;
+  snapshot_stats.bytes_copied += copied;
+  snapshot_stats.bytes_saved += live - copied;
+  free(last.entries);
+  last.entries = entries;
+  last.cnt = n;
+  // Unless the bits were cleared, the next snapshot has to be a full one
+  last.image = cleared ? image : NULL;
+  orbit_index_unlock_all();
+  return region.used;
+}
+
+void __orbit_gobj_snapshot_get_stats(struct orbit_snapshot_stats *stats) {
+  orbit_index_lock_all();
+  *stats = snapshot_stats;
+  orbit_index_unlock_all();
+}
@@ -6,34 +6,58 @@
 //    Licensed under the Apache License, Version 2.0 (the "License");
 //
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "gobj_tracker.h"
 
-FILE *__orbit_tracker_file;
-#define MAX_FILE_NAME_SIZE 64
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "gobj_arena.h"
+#include "gobj_index.h"
+#include "gobj_sampler.h"
+#include "gobj_writes.h"
+#include "site_stats.h"
+#include "trace_writer.h"
 
-void *orbit_alloc(size_t size) { return malloc(size); }
+int __orbit_tracker_fd = -1;
+#define MAX_FILE_NAME_SIZE 64
 
 char *__orbit_tracker_file_name(char *buf) {
   snprintf(buf, 64, "orbit_gobj_pid_%d.dat", getpid());
   return buf;
 }
 
+// Only async-signal-safe calls here: the trace is already in the file and
+// only needs to be cut to size, then the signal's default action (a core
+// dump for a crash) is taken when the handler returns
 void termination_handler(int signum) {
-  fclose(__orbit_tracker_file);
-  exit(-1);
+  orbit_trace_stop();
+  orbit_stats_unlink();
+  raise(signum);
 }
 
 void __orbit_gobj_tracker_init() {
   char filename_buf[MAX_FILE_NAME_SIZE];
   char *filename = __orbit_tracker_file_name(filename_buf);
   fprintf(stderr, "opening orbit tracker output file %s\n", filename);
-  __orbit_tracker_file = fopen(filename, "w");
+  __orbit_tracker_fd =
+      open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (__orbit_tracker_fd < 0) {
+    perror("failed to open orbit tracker output file");
+    return;
+  }
+  // Threads write their events straight into the mapped file
+  if (!orbit_trace_start(__orbit_tracker_fd))
+    perror("failed to map orbit tracker output file");
+  orbit_writes_init();
 
   struct sigaction new_action, old_action;
   new_action.sa_handler = termination_handler;
   sigemptyset(&new_action.sa_mask);
-  new_action.sa_flags = 0;
-  new_action.sa_sigaction = &termination_handler;
+  new_action.sa_flags = SA_RESETHAND;
 
   sigaction(SIGINT, &new_action, NULL);
   sigaction(SIGFPE, &new_action, NULL);
@@ -46,21 +70,324 @@ void __orbit_gobj_tracker_init() {
 }
 
 inline void __orbit_track_gobj(char *addr, size_t size) {
-  fprintf(__orbit_tracker_file, "%zu => %p\n", size, addr);
+  uint32_t weight = orbit_sample(size);
+  if (weight != 0) orbit_trace_record(ORBIT_EVENT_ALLOC, 0, addr, size, weight);
+}
+
+// Only the trace is sampled. Every object is still indexed, as snapshots need
+// all of them, and counted, as the site counters are cheap and exact; the
+// index remembers the weight so that the free of a sampled object is traced
+// with it and the free of any other object is not.
+static inline void *track_alloc(void *addr, size_t size, uint32_t site) {
+  uint32_t weight = orbit_sample(size);
+  // The arena is exhausted: fall back to the general heap. Such objects are
+  // traced but not part of the live index or the site counters, as their
+  // frees are not seen.
+  if (addr != NULL) {
+    orbit_index_insert(addr, size, site, weight);
+    orbit_stats_alloc(site, size);
+    orbit_writes_mark(addr, size);
+  } else {
+    addr = malloc(size);
+  }
+  if (weight != 0)
+    orbit_trace_record(ORBIT_EVENT_ALLOC, site, addr, size, weight);
+  return addr;
+}
+
+inline void *__orbit_alloc_gobj(size_t size, uint32_t site) {
+  return track_alloc(orbit_arena_alloc(size), size, site);
+}
+
+// The class is only trusted if it holds `size`, which it always does unless
+// the program was instrumented against a runtime with other classes
+void *__orbit_alloc_gobj_class(size_t size, uint32_t cls, uint32_t site) {
+  if (cls >= ORBIT_ARENA_NUM_CLASSES || size > orbit_arena_class_size(cls))
+    return __orbit_alloc_gobj(size, site);
+  return track_alloc(orbit_arena_alloc_class(cls), size, site);
+}
+
+void *__orbit_calloc_gobj(size_t count, size_t size, uint32_t site) {
+  size_t total;
+  void *addr;
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // Arena objects may reuse freed memory
+  addr = __orbit_alloc_gobj(total, site);
+  if (addr != NULL) memset(addr, 0, total);
+  return addr;
+}
+
+// Like the objects __orbit_alloc_gobj puts on the general heap, these are not
+// in the live index or the site counters, as their frees are not seen
+void __orbit_alloc_hook(void *ptr, size_t size, uint32_t site) {
+  uint32_t weight;
+  if (ptr == NULL) return;
+  weight = orbit_sample(size);
+  if (weight != 0)
+    orbit_trace_record(ORBIT_EVENT_ALLOC, site, ptr, size, weight);
+}
+
+void __orbit_alloc_hook_sampled(void *ptr, size_t size, uint32_t site) {
+  uint32_t weight;
+  if (ptr == NULL) return;
+  weight = orbit_sample_slow(size);
+  if (weight != 0)
+    orbit_trace_record(ORBIT_EVENT_ALLOC, site, ptr, size, weight);
+}
+
+void __orbit_free_gobj(void *ptr) {
+  struct orbit_gobj_entry entry;
+  if (!orbit_arena_contains(ptr)) {
+    free(ptr);
+    return;
+  }
+  // Not recorded again if a deallocation site hook already saw the object
+  if (orbit_index_erase(ptr, &entry)) {
+    if (entry.weight != 0)
+      orbit_trace_record(ORBIT_EVENT_FREE, entry.site, ptr, entry.size,
+                         entry.weight);
+    orbit_stats_free(entry.site, entry.size);
+  }
+  orbit_arena_free(ptr);
+}
+
+void *__orbit_realloc_gobj(void *ptr, size_t size) {
+  struct orbit_gobj_entry entry = {(uint64_t)(uintptr_t)ptr, 0, 0, 0};
+  bool live;
+  void *new_ptr;
+  if (ptr == NULL) return __orbit_alloc_gobj(size, 0);
+  if (!orbit_arena_contains(ptr)) return realloc(ptr, size);
+  if (size == 0) {
+    __orbit_free_gobj(ptr);
+    return NULL;
+  }
+  live = orbit_index_erase(ptr, &entry);
+  // An object the index did not know is sampled as a new one
+  if (!live) entry.weight = orbit_sample(size);
+  new_ptr = orbit_arena_realloc(ptr, size);
+  if (new_ptr != NULL) {
+    orbit_index_insert(new_ptr, size, entry.site, entry.weight);
+    orbit_writes_mark(new_ptr, size);
+  } else {
+    // Move the object out of an exhausted arena
+    size_t usable = orbit_arena_usable_size(ptr);
+    new_ptr = malloc(size);
+    if (new_ptr == NULL) {
+      if (live) orbit_index_insert(ptr, entry.size, entry.site, entry.weight);
+      return NULL;
+    }
+    memcpy(new_ptr, ptr, size < usable ? size : usable);
+    orbit_arena_free(ptr);
+  }
+  if (entry.weight != 0)
+    orbit_trace_record(ORBIT_EVENT_REALLOC, entry.site, new_ptr, size,
+                       entry.weight);
+  // An object that moved out of the arena is no longer tracked
+  if (live && orbit_arena_contains(new_ptr))
+    orbit_stats_realloc(entry.site, entry.size, size);
+  else if (live)
+    orbit_stats_free(entry.site, entry.size);
+  return new_ptr;
+}
+
+void __orbit_free_hook(void *ptr, uint32_t site) {
+  struct orbit_gobj_entry entry;
+  if (ptr == NULL || !orbit_arena_contains(ptr)) return;
+  if (orbit_index_erase(ptr, &entry)) {
+    if (entry.weight != 0)
+      orbit_trace_record(ORBIT_EVENT_FREE, site, ptr, entry.size,
+                         entry.weight);
+    orbit_stats_free(entry.site, entry.size);
+  }
+}
+
+void __orbit_realloc_hook(void *old_ptr, void *new_ptr, size_t size,
+                          uint32_t site) {
+  struct orbit_gobj_entry entry;
+  // The reallocation failed and left the object in place
+  if (new_ptr == NULL && size != 0) return;
+  if (old_ptr == NULL || !orbit_arena_contains(old_ptr)) return;
+  // Already moved by __orbit_realloc_gobj
+  if (new_ptr != NULL && orbit_index_find(new_ptr, &entry) &&
+      entry.addr == (uint64_t)(uintptr_t)new_ptr)
+    return;
+  if (!orbit_index_erase(old_ptr, &entry)) return;
+  if (new_ptr == NULL) {
+    if (entry.weight != 0)
+      orbit_trace_record(ORBIT_EVENT_FREE, site, old_ptr, entry.size,
+                         entry.weight);
+    orbit_stats_free(entry.site, entry.size);
+    return;
+  }
+  if (orbit_arena_contains(new_ptr)) {
+    orbit_index_insert(new_ptr, size, entry.site, entry.weight);
+    orbit_stats_realloc(entry.site, entry.size, size);
+  } else {
+    orbit_stats_free(entry.site, entry.size);
+  }
+  if (entry.weight != 0)
+    orbit_trace_record(ORBIT_EVENT_REALLOC, site, new_ptr, size,
+                       entry.weight);
+}
+
+void __orbit_write_hook(void *ptr, size_t size) {
+  orbit_writes_mark(ptr, size);
 }
 
-inline void *__orbit_alloc_gobj(size_t size) {
-  printf("malloc call of size %d \n", size);
-  return orbit_alloc(size);
+bool __orbit_gobj_test_and_clear_written(const void *ptr) {
+  struct orbit_gobj_entry entry;
+  if (!orbit_index_find(ptr, &entry)) return false;
+  return orbit_writes_test_and_clear((const void *)(uintptr_t)entry.addr,
+                                     entry.size);
 }
 
+bool __orbit_gobj_find(const void *ptr, struct orbit_gobj_desc *desc) {
+  struct orbit_gobj_entry entry;
+  if (!orbit_index_find(ptr, &entry)) return false;
+  if (desc != NULL) {
+    desc->guid = entry.site;
+    desc->addr = entry.addr;
+    desc->size = entry.size;
+    desc->offset = 0;
+  }
+  return true;
+}
+
+size_t __orbit_gobj_live_count(void) { return orbit_index_count(); }
+
+uint64_t __orbit_gobj_live_bytes(void) { return orbit_index_bytes(); }
+
+struct for_each_state {
+  void (*fn)(const struct orbit_gobj_desc *, void *);
+  void *arg;
+  size_t cnt;
+};
+
+static bool visit(const struct orbit_gobj_entry *entry, void *arg) {
+  struct for_each_state *state = arg;
+  struct orbit_gobj_desc desc = {entry->site, entry->addr, entry->size, 0};
+  state->fn(&desc, state->arg);
+  state->cnt++;
+  return true;
+}
+
+size_t __orbit_gobj_for_each(void (*fn)(const struct orbit_gobj_desc *,
+                                        void *),
+                             void *arg) {
+  struct for_each_state state = {fn, arg, 0};
+  orbit_index_lock_all();
+  orbit_index_walk(visit, &state);
+  orbit_index_unlock_all();
+  return state.cnt;
+}
+
+// Records and site counters are visible in their files as soon as they are
+// made, this only makes the trace durable
 bool __orbit_gobj_tracker_dump() {
-  fflush(__orbit_tracker_file);
+  orbit_trace_flush();
   return true;
 }
 
 void __orbit_gobj_tracker_finish() {
+  struct orbit_trace_stats stats;
+  if (__orbit_tracker_fd < 0) return;
+  orbit_trace_stop();
+  orbit_trace_get_stats(&stats);
+  fprintf(stderr,
+          "orbit tracker: %lu events recorded, %lu lost to a full trace, "
+          "%lu dropped, %lu bytes written by %u writers\n",
+          (unsigned long)stats.recorded, (unsigned long)stats.overflows,
+          (unsigned long)stats.dropped, (unsigned long)stats.bytes_written,
+          stats.writers);
   // close the tracker file
-  fflush(__orbit_tracker_file);
-  fclose(__orbit_tracker_file);
+  close(__orbit_tracker_fd);
+  __orbit_tracker_fd = -1;
 }
+
+/*
+ * Objects from the arena are released through the program's own
+ * deallocation paths (the instrumented hooks only observe them), which end
+ * in free() and realloc(). Interpose on both, and route arena pointers to
+ * the arena. Everything else goes to the next definition in the lookup
+ * order, i.e. the allocator the program is linked with (glibc, or e.g. an
+ * unprefixed tcmalloc or jemalloc linked after the runtime), which is also
+ * the one that returned it. malloc_usable_size is interposed for the same
+ * reason. The aligned allocators (posix_memalign, aligned_alloc, memalign)
+ * are never replaced, so their objects never come from the arena.
+ */
+#if defined(__GLIBC__) && !defined(ORBIT_NO_INTERPOSE)
+
+extern void __libc_free(void *ptr);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static void (*next_free)(void *ptr);
+static void *(*next_realloc)(void *ptr, size_t size);
+static size_t (*next_usable_size)(void *ptr);
+static __thread bool resolving;
+
+// dlsym may allocate and free, which must not come back here; until the
+// next definitions are known, glibc's are the only ones the process can
+// have used
+static void resolve_next(void) {
+  void *sym;
+  if (resolving) return;
+  resolving = true;
+  if ((sym = dlsym(RTLD_NEXT, "realloc")) != NULL)
+    __atomic_store_n(&next_realloc, (void *(*)(void *, size_t))sym,
+                     __ATOMIC_RELEASE);
+  if ((sym = dlsym(RTLD_NEXT, "malloc_usable_size")) != NULL)
+    __atomic_store_n(&next_usable_size, (size_t(*)(void *))sym,
+                     __ATOMIC_RELEASE);
+  if ((sym = dlsym(RTLD_NEXT, "free")) != NULL)
+    __atomic_store_n(&next_free, (void (*)(void *))sym, __ATOMIC_RELEASE);
+  resolving = false;
+}
+
+__attribute__((constructor)) static void interpose_init(void) {
+  resolve_next();
+}
+
+void free(void *ptr) {
+  void (*fn)(void *);
+  if (orbit_arena_contains(ptr)) {
+    __orbit_free_gobj(ptr);
+    return;
+  }
+  fn = __atomic_load_n(&next_free, __ATOMIC_ACQUIRE);
+  if (fn == NULL) {
+    resolve_next();
+    fn = __atomic_load_n(&next_free, __ATOMIC_ACQUIRE);
+  }
+  if (fn != NULL)
+    fn(ptr);
+  else
+    __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+  void *(*fn)(void *, size_t);
+  if (orbit_arena_contains(ptr)) return __orbit_realloc_gobj(ptr, size);
+  fn = __atomic_load_n(&next_realloc, __ATOMIC_ACQUIRE);
+  if (fn == NULL) {
+    resolve_next();
+    fn = __atomic_load_n(&next_realloc, __ATOMIC_ACQUIRE);
+  }
+  return fn != NULL ? fn(ptr, size) : __libc_realloc(ptr, size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+  size_t (*fn)(void *);
+  if (orbit_arena_contains(ptr)) return orbit_arena_usable_size(ptr);
+  fn = __atomic_load_n(&next_usable_size, __ATOMIC_ACQUIRE);
+  if (fn == NULL) {
+    resolve_next();
+    fn = __atomic_load_n(&next_usable_size, __ATOMIC_ACQUIRE);
+  }
+  // glibc does not export its own under another name
+  return fn != NULL ? fn(ptr) : 0;
+}
+
+#endif
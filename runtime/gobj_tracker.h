@@ -12,18 +12,122 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern inline char *__orbit_tracker_file_name(char *buf);
-extern inline void __orbit_track_gobj(char *addr, size_t size);
-extern inline void *__orbit_alloc_gobj(size_t size);
+// A tracked object in a snapshot
+struct orbit_gobj_desc {
+  // GUID of the allocation site
+  uint64_t guid;
+  uint64_t addr;
+  uint64_t size;
+  // Where the copy starts, from the start of the snapshot buffer (or of the
+  // concatenated buffers for the scatter-gather variant, or of the image for
+  // the incremental one)
+  uint64_t offset;
+};
+
+// Layout of a snapshot buffer: this header, `count` descriptors, then the
+// copied data starting at `data_offset`
+struct orbit_snapshot_header {
+  uint64_t count;
+  uint64_t data_offset;
+  uint64_t data_size;
+};
+
+// Counters of the incremental snapshots
+struct orbit_snapshot_stats {
+  // Snapshots that copied every live object
+  uint64_t full;
+  // Snapshots that only copied what was written since the previous one
+  uint64_t incremental;
+  uint64_t bytes_copied;
+  // Bytes of live objects skipped because their pages were clean
+  uint64_t bytes_saved;
+};
+
+char *__orbit_tracker_file_name(char *buf);
+void __orbit_track_gobj(char *addr, size_t size);
+// `site` is the GUID of the instrumented site, 0 if unknown
+void *__orbit_alloc_gobj(size_t size, uint32_t site);
+// The same for a constant `size`, with its arena size class `cls` computed
+// by the instrumentor, so that the arena does not look it up
+void *__orbit_alloc_gobj_class(size_t size, uint32_t cls, uint32_t site);
+// The same for calloc-like allocators: `count` objects of `size` bytes,
+// cleared, or NULL if the product overflows
+void *__orbit_calloc_gobj(size_t count, size_t size, uint32_t site);
+// Called after an allocation site the tracker cannot take over, e.g. a pool
+// allocator, with the pointer it returned. The object stays where it is and
+// is only traced.
+void __orbit_alloc_hook(void *ptr, size_t size, uint32_t site);
+// Slow path of __orbit_alloc_hook, for sites where the instrumentor inlined
+// the rest: the allocation was already counted down on the sampler of
+// runtime/gobj_sampler.h, which reached its next sample
+void __orbit_alloc_hook_sampled(void *ptr, size_t size, uint32_t site);
+void __orbit_free_gobj(void *ptr);
+void *__orbit_realloc_gobj(void *ptr, size_t size);
+// Called before a deallocation site of the program, with the pointer freed
+void __orbit_free_hook(void *ptr, uint32_t site);
+// Called after a reallocation site of the program, with the pointer passed
+// to it, the pointer it returned and the requested size
+void __orbit_realloc_hook(void *old_ptr, void *new_ptr, size_t size,
+                          uint32_t site);
+// Called after an instrumented store of `size` bytes to `ptr` that may write
+// into a tracked object. The instrumentor drops the hooks of the stores that
+// an earlier hook already covers, and runs the hooks of the stores a loop
+// makes to the same place once before the loop, so a mark may come before
+// the write it stands for, but never across a call.
+void __orbit_write_hook(void *ptr, size_t size);
+// Whether the live tracked object that `ptr` points into was allocated or
+// written by an instrumented store since the last call for it, which clears
+// the mark. Stores in code that was not instrumented, e.g. in libraries, are
+// not seen. A thread sees all of its own writes, e.g. when it calls this at
+// the point where it syncs with the orbit. As a mark may come before its
+// write on a stretch of code without calls, a clear that runs on another
+// thread in the middle of that stretch loses the write.
+bool __orbit_gobj_test_and_clear_written(const void *ptr);
+// Whether `ptr` points into a live tracked object. If so, and `desc` is not
+// NULL, the object is described in `desc` (with a zero offset).
+bool __orbit_gobj_find(const void *ptr, struct orbit_gobj_desc *desc);
+size_t __orbit_gobj_live_count(void);
+uint64_t __orbit_gobj_live_bytes(void);
+// Call `fn` on every live tracked object in address order, returns the
+// number of objects. Tracked objects cannot be allocated or freed meanwhile,
+// so `fn` must not do either.
+size_t __orbit_gobj_for_each(void (*fn)(const struct orbit_gobj_desc *,
+                                        void *),
+                             void *arg);
+// Copy all the live tracked objects to `dst`. Returns the size of the
+// snapshot; if that is larger than `cap`, nothing is copied.
+size_t __orbit_gobj_snapshot(void *dst, size_t cap);
+// Copy the live tracked objects back to back into the buffers of `iov`, and
+// describe them in `descs`. Returns the number of objects copied, stopping at
+// the first object that does not fit or when `descs` is full.
+size_t __orbit_gobj_snapshot_sg(const struct iovec *iov, int iovcnt,
+                                struct orbit_gobj_desc *descs,
+                                size_t max_descs);
+// Mirror the live tracked objects into `image`, where each object is copied
+// at its offset from the start of the arena, and describe them in `descs`.
+// Returns the size of the image; if that is larger than `cap`, or the objects
+// (stored to `count`) do not fit in `descs`, nothing is copied. When `image`
+// holds the previous snapshot, only the pages written since then are copied;
+// without soft-dirty page tracking every snapshot is a full one. Only pass
+// `quiescent` when no thread writes to the tracked objects until this
+// returns, as a concurrent write may be missed by this snapshot and the next;
+// otherwise the snapshot is a full one, and so is the next.
+size_t __orbit_gobj_snapshot_incremental(void *image, size_t cap,
+                                         struct orbit_gobj_desc *descs,
+                                         size_t max_descs, bool quiescent,
+                                         size_t *count);
+void __orbit_gobj_snapshot_get_stats(struct orbit_snapshot_stats *stats);
 void __orbit_gobj_tracker_init();
 bool __orbit_gobj_tracker_dump();
 void __orbit_gobj_tracker_finish();
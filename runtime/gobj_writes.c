@@ -0,0 +1,60 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Write tracking for the objects of the arena. The instrumentor hooks the
+// stores that the analysis found may write into a tracked object, and each
+// hook sets the bytes of the granules it wrote in a map that mirrors the
+// arena. Unlike soft-dirty pages, this tells the objects that share a page
+// apart, but only sees the stores of instrumented code.
+//
+// The map is reserved at the size of the arena's reservation and only the
+// pages for the used part of the arena are ever touched.
+//
+
+#include "gobj_writes.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gobj_arena.h"
+
+uint8_t *orbit_write_map;
+uintptr_t orbit_write_base;
+size_t orbit_write_span;
+
+void orbit_writes_init(void) {
+  struct orbit_arena_region region;
+  void *map;
+  if (orbit_write_span != 0) return;
+  orbit_arena_init();
+  orbit_arena_get_region(&region);
+  if (region.base == NULL) return;
+  map = mmap(NULL, region.reserved >> ORBIT_WRITE_GRANULE_SHIFT,
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) return;
+  memset(map, 1, region.used >> ORBIT_WRITE_GRANULE_SHIFT);
+  orbit_write_map = map;
+  orbit_write_base = (uintptr_t)region.base;
+  __atomic_store_n(&orbit_write_span, region.reserved, __ATOMIC_RELEASE);
+}
+
+bool orbit_writes_test_and_clear(const void *ptr, size_t size) {
+  uintptr_t off = (uintptr_t)ptr - orbit_write_base;
+  size_t i, last;
+  bool written = false;
+  if (off >= orbit_write_span || size == 0) return false;
+  if (size > orbit_write_span - off) size = orbit_write_span - off;
+  last = (off + size - 1) >> ORBIT_WRITE_GRANULE_SHIFT;
+  // Most granules are clean; only exchange the ones that are not
+  for (i = off >> ORBIT_WRITE_GRANULE_SHIFT; i <= last; i++) {
+    if (__atomic_load_n(&orbit_write_map[i], __ATOMIC_RELAXED) != 0 &&
+        __atomic_exchange_n(&orbit_write_map[i], 0, __ATOMIC_RELAXED) != 0)
+      written = true;
+  }
+  return written;
+}
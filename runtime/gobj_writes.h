@@ -0,0 +1,52 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _GOBJ_WRITES_H_
+#define _GOBJ_WRITES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Writes are tracked per granule of the arena. Arena objects start on a
+// granule boundary, so a granule never holds two objects.
+#define ORBIT_WRITE_GRANULE_SHIFT 4
+
+// One byte per granule of the arena's reservation, set when it is written
+extern uint8_t *orbit_write_map;
+extern uintptr_t orbit_write_base;
+// Bytes of the arena covered by the map, 0 until orbit_writes_init
+extern size_t orbit_write_span;
+
+// Map the write map over the arena, and mark the objects allocated so far
+// written, as their writes were not seen
+void orbit_writes_init(void);
+
+// Mark [ptr, ptr + size) written. Anything outside the arena is ignored.
+static inline void orbit_writes_mark(const void *ptr, size_t size) {
+  uintptr_t off = (uintptr_t)ptr - orbit_write_base;
+  size_t i, last;
+  if (off >= orbit_write_span || size == 0) return;
+  if (size > orbit_write_span - off) size = orbit_write_span - off;
+  last = (off + size - 1) >> ORBIT_WRITE_GRANULE_SHIFT;
+  for (i = off >> ORBIT_WRITE_GRANULE_SHIFT; i <= last; i++)
+    __atomic_store_n(&orbit_write_map[i], 1, __ATOMIC_RELAXED);
+}
+
+// Whether any of [ptr, ptr + size) was marked, and clear it
+bool orbit_writes_test_and_clear(const void *ptr, size_t size);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _GOBJ_WRITES_H_ */
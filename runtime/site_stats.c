@@ -0,0 +1,166 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Per-site allocation counters, kept in a shared memory segment so that a
+// reader can poll them without involving the process (see
+// site_stats_format.h for the layout). Threads are spread over the shards
+// round-robin, which keeps the counters of a hot site from bouncing between
+// all the cores. A forked child drops its parent's segment and creates its
+// own on its first event.
+//
+
+#include "site_stats.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+// Guards the creation of the segment, which is redone in a forked child
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stats_tried;
+static pthread_once_t handlers_once = PTHREAD_ONCE_INIT;
+static struct orbit_stats_header *stats_header;
+static struct orbit_site_counters *stats_slots;
+static size_t stats_size;
+static char stats_path[64];
+static unsigned next_shard;
+
+static __thread struct orbit_site_counters *thread_shard;
+
+// The child must neither add to its parent's counters nor remove its
+// parent's segment. Only the forking thread survives, so only its shard is
+// left to forget.
+static void detach_in_child(void) {
+  if (stats_header != NULL) munmap(stats_header, stats_size);
+  stats_header = NULL;
+  stats_slots = NULL;
+  thread_shard = NULL;
+  next_shard = 0;
+  stats_tried = false;
+  pthread_mutex_init(&stats_lock, NULL);
+}
+
+static void register_handlers(void) {
+  pthread_atfork(NULL, NULL, detach_in_child);
+  // Readers that have it mapped keep it after the process exits
+  atexit(orbit_stats_unlink);
+}
+
+static void stats_init(void) {
+  const char *env = getenv("ORBIT_STATS");
+  struct orbit_stats_header *header;
+  int fd;
+  if (env != NULL && strcmp(env, "0") == 0) return;
+
+  stats_size = sizeof(*header) + (size_t)ORBIT_STATS_SHARDS *
+                                     ORBIT_STATS_SITES *
+                                     sizeof(struct orbit_site_counters);
+  snprintf(stats_path, sizeof(stats_path), ORBIT_STATS_PREFIX "%d", getpid());
+  fd = open(stats_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return;
+  // tmpfs only backs the pages of the slots that are used
+  if (ftruncate(fd, stats_size) != 0) {
+    close(fd);
+    unlink(stats_path);
+    return;
+  }
+  header = mmap(NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    unlink(stats_path);
+    return;
+  }
+
+  header->version = ORBIT_STATS_VERSION;
+  header->header_size = sizeof(*header);
+  header->pid = getpid();
+  header->site_cnt = ORBIT_STATS_SITES;
+  header->shard_cnt = ORBIT_STATS_SHARDS;
+  stats_slots = (struct orbit_site_counters *)(header + 1);
+  // Readers check the magic last
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header->magic, ORBIT_STATS_MAGIC, sizeof(header->magic));
+  stats_header = header;
+  // Inherited by the children, which must not register them again
+  pthread_once(&handlers_once, register_handlers);
+}
+
+static struct orbit_site_counters *find_slot(uint32_t site) {
+  struct orbit_site_counters *shard = thread_shard;
+  uint32_t i, n;
+  if (site == 0) site = ORBIT_STATS_NO_SITE;
+  if (unlikely(shard == NULL)) {
+    if (!__atomic_load_n(&stats_tried, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&stats_lock);
+      if (!stats_tried) {
+        stats_init();
+        __atomic_store_n(&stats_tried, true, __ATOMIC_RELEASE);
+      }
+      pthread_mutex_unlock(&stats_lock);
+    }
+    if (stats_header == NULL) return NULL;
+    shard = stats_slots + (size_t)(__atomic_fetch_add(&next_shard, 1,
+                                                      __ATOMIC_RELAXED) %
+                                   ORBIT_STATS_SHARDS) *
+                              ORBIT_STATS_SITES;
+    thread_shard = shard;
+  }
+
+  i = orbit_stats_home(site, ORBIT_STATS_SITES);
+  for (n = 0; n < ORBIT_STATS_SITES; n++) {
+    struct orbit_site_counters *slot = &shard[i];
+    uint32_t guid = __atomic_load_n(&slot->guid, __ATOMIC_ACQUIRE), expected;
+    if (guid == site) return slot;
+    if (guid == 0) {
+      expected = 0;
+      if (__atomic_compare_exchange_n(&slot->guid, &expected, site, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+          expected == site)
+        return slot;
+    }
+    i = (i + 1) & (ORBIT_STATS_SITES - 1);
+  }
+  __atomic_fetch_add(&stats_header->overflow, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+#define ADD(field, v) __atomic_fetch_add(&(field), (v), __ATOMIC_RELAXED)
+
+void orbit_stats_alloc(uint32_t site, size_t size) {
+  struct orbit_site_counters *slot = find_slot(site);
+  if (slot == NULL) return;
+  ADD(slot->allocs, 1);
+  ADD(slot->alloc_bytes, size);
+}
+
+void orbit_stats_free(uint32_t site, size_t size) {
+  struct orbit_site_counters *slot = find_slot(site);
+  if (slot == NULL) return;
+  ADD(slot->frees, 1);
+  ADD(slot->free_bytes, size);
+}
+
+void orbit_stats_realloc(uint32_t site, size_t old_size, size_t new_size) {
+  struct orbit_site_counters *slot = find_slot(site);
+  if (slot == NULL) return;
+  ADD(slot->reallocs, 1);
+  ADD(slot->free_bytes, old_size);
+  ADD(slot->alloc_bytes, new_size);
+}
+
+void orbit_stats_unlink(void) {
+  // Only the process that created the segment removes it
+  if (stats_header != NULL && stats_header->pid == (uint32_t)getpid())
+    unlink(stats_path);
+}
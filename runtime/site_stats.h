@@ -0,0 +1,44 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _SITE_STATS_H_
+#define _SITE_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "site_stats_format.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Slots per shard, the number of distinct sites that can be counted
+#ifndef ORBIT_STATS_SITES
+#define ORBIT_STATS_SITES 4096
+#endif
+#ifndef ORBIT_STATS_SHARDS
+#define ORBIT_STATS_SHARDS 16
+#endif
+
+// The segment is created on the first event, unless the ORBIT_STATS
+// environment variable is "0", and again on the first event of a forked
+// child, which counts from zero. Frees and reallocations are counted against
+// the allocation site of the object.
+void orbit_stats_alloc(uint32_t site, size_t size);
+void orbit_stats_free(uint32_t site, size_t size);
+void orbit_stats_realloc(uint32_t site, size_t old_size, size_t new_size);
+// Remove the segment, done when the program exits. A forked child never
+// removes its parent's.
+void orbit_stats_unlink(void);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _SITE_STATS_H_ */
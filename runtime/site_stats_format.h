@@ -0,0 +1,64 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Layout of the per-site statistics segment, shared between the runtime and
+// the readers. The segment is the file ORBIT_STATS_PREFIX<pid> in tmpfs:
+//
+//   struct orbit_stats_header
+//   shard_cnt shards, each of site_cnt struct orbit_site_counters
+//
+// Each thread updates the counters of one shard, so a site has up to one
+// slot per shard and its totals are the sums over all the shards. A slot is
+// claimed by setting its guid, after which the slot never changes hands.
+// Counters are updated with relaxed atomic adds; a reader may see the
+// counters of one slot from slightly different points in time.
+//
+
+#ifndef _SITE_STATS_FORMAT_H_
+#define _SITE_STATS_FORMAT_H_
+
+#include <stdint.h>
+
+#define ORBIT_STATS_MAGIC "ORBSTATS"
+#define ORBIT_STATS_VERSION 1
+#define ORBIT_STATS_PREFIX "/dev/shm/orbit_stats."
+// Counts the events without a known site, as GUID 0 marks free slots
+#define ORBIT_STATS_NO_SITE 0xffffffffu
+
+struct orbit_stats_header {
+  char magic[8];
+  uint32_t version;
+  // Offset of the first shard
+  uint32_t header_size;
+  uint32_t pid;
+  // Slots per shard, a power of two
+  uint32_t site_cnt;
+  uint32_t shard_cnt;
+  uint32_t reserved;
+  // Events of sites that found no free slot in their shard
+  uint64_t overflow;
+} __attribute__((aligned(64)));
+
+struct orbit_site_counters {
+  // Site GUID, 0 for a free slot
+  uint32_t guid;
+  uint32_t reserved;
+  uint64_t allocs;
+  uint64_t alloc_bytes;
+  uint64_t frees;
+  uint64_t free_bytes;
+  // A reallocation counts as a free of the old size and an allocation of the
+  // new one in the byte counters, but not in allocs and frees
+  uint64_t reallocs;
+} __attribute__((aligned(64)));
+
+// Slot of `guid` is searched linearly from this one
+static inline uint32_t orbit_stats_home(uint32_t guid, uint32_t site_cnt) {
+  return (uint32_t)((guid * 0x9e3779b1u) & (site_cnt - 1));
+}
+
+#endif /* _SITE_STATS_FORMAT_H_ */
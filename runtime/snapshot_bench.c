@@ -0,0 +1,98 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Microbenchmark of the bulk snapshot API: allocate tracked objects of random
+// sizes, then time full snapshots and report the copy bandwidth, next to a
+// plain memcpy of the same amount of data, and time incremental snapshots.
+//
+// Usage: orbit-snapshot-bench [objects] [max object size] [iterations]
+//
+
+#include <time.h>
+
+#include "gobj_tracker.h"
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t objects = argc > 1 ? strtoull(argv[1], NULL, 0) : 100000;
+  size_t max_size = argc > 2 ? strtoull(argv[2], NULL, 0) : 4096;
+  int iterations = argc > 3 ? atoi(argv[3]) : 10;
+  size_t i, total = 0, cap, data_size;
+  struct orbit_snapshot_header *header;
+  struct orbit_snapshot_stats stats;
+  struct orbit_gobj_desc *descs;
+  size_t count;
+  char *buf, *src;
+  double start, elapsed;
+  int it;
+
+  srand(42);
+  for (i = 0; i < objects; i++) {
+    size_t size = 16 + (size_t)rand() % max_size;
+    char *obj = __orbit_alloc_gobj(size, 0);
+    memset(obj, (int)i, size);
+    total += size;
+  }
+
+  cap = __orbit_gobj_snapshot(NULL, 0);
+  buf = malloc(cap);
+  if (buf == NULL) {
+    fprintf(stderr, "failed to allocate a %zu byte snapshot buffer\n", cap);
+    return 1;
+  }
+  // Fault the buffer in before timing
+  memset(buf, 0, cap);
+
+  start = seconds();
+  for (it = 0; it < iterations; it++) __orbit_gobj_snapshot(buf, cap);
+  elapsed = seconds() - start;
+  header = (struct orbit_snapshot_header *)buf;
+  data_size = header->data_size;
+  printf("snapshot: %lu objects, %.1f MB of objects, %.1f MB copied, "
+         "%.2f GB/s\n",
+         (unsigned long)header->count, total / 1e6, data_size / 1e6,
+         (double)data_size * iterations / elapsed / 1e9);
+
+  src = malloc(data_size);
+  memset(src, 1, data_size);
+  start = seconds();
+  for (it = 0; it < iterations; it++)
+    memcpy(buf + header->data_offset, src, data_size);
+  elapsed = seconds() - start;
+  printf("memcpy:   %.2f GB/s\n",
+         (double)data_size * iterations / elapsed / 1e9);
+  free(buf);
+
+  // Incremental snapshots with 1% of the objects written in between
+  cap = __orbit_gobj_snapshot_incremental(NULL, 0, NULL, 0, true, &count);
+  buf = malloc(cap);
+  descs = malloc(count * sizeof(*descs));
+  if (buf == NULL || descs == NULL) {
+    fprintf(stderr, "failed to allocate a %zu byte image\n", cap);
+    return 1;
+  }
+  __orbit_gobj_snapshot_incremental(buf, cap, descs, count, true, &count);
+  start = seconds();
+  for (it = 0; it < iterations; it++) {
+    for (i = 0; i < count; i += 100)
+      ((char *)(uintptr_t)descs[i].addr)[0] = (char)it;
+    __orbit_gobj_snapshot_incremental(buf, cap, descs, count, true, &count);
+  }
+  elapsed = seconds() - start;
+  __orbit_gobj_snapshot_get_stats(&stats);
+  printf("incremental: %.2f ms per snapshot, %lu full, %lu incremental, "
+         "%.1f MB copied, %.1f MB saved\n",
+         elapsed * 1e3 / iterations, (unsigned long)stats.full,
+         (unsigned long)stats.incremental, stats.bytes_copied / 1e6,
+         stats.bytes_saved / 1e6);
+  return 0;
+}
@@ -0,0 +1,257 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// On-disk format of the gobj trace, shared by the runtime writer and the
+// decoder tool.
+//
+// A trace file is a file header followed by a sequence of blocks. Each block
+// has a fixed-size header and a payload of variable-length records. Delta
+// encoding restarts at every block, so a reader can skip from block header to
+// block header and start decoding anywhere.
+//
+// Since version 3 the file is written through a shared mapping: the blocks
+// are fixed-size chunks of `chunk_size` bytes, each filled by one thread at
+// a time, and the payload past `payload_size` is unused. A chunk that was
+// claimed but never initialized has no block magic. Only the chunks below
+// `data_end` hold blocks; if the process died without stopping the trace,
+// the file is longer than that and `data_end` is where it ends. Within a
+// block, `payload_size` and then `record_cnt` are updated after each record
+// is written, so every record they cover is complete even after a crash.
+//
+// Record encoding, all integers are LEB128 varints:
+//
+//   u8      kind | ORBIT_REC_* flags
+//   varint  tid                      (unless ORBIT_REC_SAME_TID)
+//   varint  zigzag(timestamp delta)
+//   varint  zigzag(address delta)
+//   varint  size                     (unless ORBIT_REC_SAME_SIZE)
+//   varint  site GUID                (only if ORBIT_REC_HAS_SITE)
+//   varint  sample weight            (only if ORBIT_REC_HAS_WEIGHT)
+//
+// Deltas and the "same" flags are relative to the previous record of the
+// same block. A record without a weight stands for one event.
+//
+// Version 2 added the sample weight and the sampling fields of the file
+// header; version 1 files decode the same way with every weight being 1.
+// Version 3 added the chunks.
+//
+
+#ifndef _TRACE_FORMAT_H_
+#define _TRACE_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ORBIT_TRACE_MAGIC "ORBTRACE"
+#define ORBIT_TRACE_VERSION 3
+#define ORBIT_BLOCK_MAGIC 0x4b4c424fu /* "OBLK" */
+
+// Longest possible encoding of one record
+#define ORBIT_MAX_RECORD_SIZE (1 + 5 + 10 + 10 + 10 + 5 + 5)
+
+enum orbit_event_kind {
+  ORBIT_EVENT_ALLOC = 1,
+  ORBIT_EVENT_FREE = 2,
+  ORBIT_EVENT_REALLOC = 3,
+};
+
+enum orbit_trace_clock {
+  ORBIT_CLOCK_TSC = 0,
+  ORBIT_CLOCK_MONOTONIC_NS = 1,
+};
+
+enum orbit_sample_mode {
+  // Every allocation is recorded
+  ORBIT_SAMPLE_ALL = 0,
+  // Every Nth allocation of each thread
+  ORBIT_SAMPLE_EVERY = 1,
+  // Poisson sampling with a mean of N bytes between two samples
+  ORBIT_SAMPLE_BYTES = 2,
+};
+
+enum orbit_record_flags {
+  ORBIT_REC_KIND_MASK = 0x0f,
+  ORBIT_REC_SAME_TID = 0x10,
+  ORBIT_REC_SAME_SIZE = 0x20,
+  ORBIT_REC_HAS_SITE = 0x40,
+  ORBIT_REC_HAS_WEIGHT = 0x80,
+};
+
+struct orbit_trace_file_header {
+  char magic[8];
+  uint16_t version;
+  uint16_t clock;
+  uint32_t header_size;
+  uint32_t pid;
+  // How the allocations were sampled, and the N of the mode. Not present in
+  // version 1 headers, where everything was recorded.
+  uint32_t sample_mode;
+  uint64_t sample_period;
+  // Version 3: end of the last claimed chunk, and the size of the chunks
+  uint64_t data_end;
+  uint32_t chunk_size;
+  uint32_t reserved;
+};
+
+struct orbit_trace_block_header {
+  uint32_t magic;
+  // Bytes of encoded records following this header
+  uint32_t payload_size;
+  uint32_t record_cnt;
+  uint32_t reserved;
+  // Range of the timestamps in the block, for seeking by time
+  uint64_t first_timestamp;
+  uint64_t last_timestamp;
+};
+
+// Decoded (or not yet encoded) event
+struct orbit_trace_event {
+  uint64_t timestamp;
+  uint64_t addr;
+  uint64_t size;
+  // GUID of the instrumented site that produced the event, as listed in the
+  // instrumentor's site table. Frees and reallocations only seen through
+  // free() and realloc() carry the allocation site of the object instead.
+  uint32_t site;
+  uint32_t tid;
+  // Number of events this one stands for when the allocations are sampled.
+  // Frees and reallocations carry the weight of the sampled allocation.
+  uint32_t weight;
+  uint16_t kind;
+};
+
+// Delta encoding state, reset at the start of each block
+struct orbit_trace_codec {
+  uint64_t timestamp;
+  uint64_t addr;
+  uint64_t size;
+  uint32_t tid;
+  int first;
+};
+
+static inline void orbit_codec_reset(struct orbit_trace_codec *codec) {
+  codec->timestamp = 0;
+  codec->addr = 0;
+  codec->size = 0;
+  codec->tid = 0;
+  codec->first = 1;
+}
+
+static inline uint8_t *orbit_put_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+// Returns NULL if the varint runs past `end`
+static inline const uint8_t *orbit_get_varint(const uint8_t *p,
+                                              const uint8_t *end,
+                                              uint64_t *v) {
+  uint64_t result = 0;
+  unsigned shift = 0;
+  while (p < end && shift < 64) {
+    uint8_t byte = *p++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *v = result;
+      return p;
+    }
+    shift += 7;
+  }
+  return NULL;
+}
+
+static inline uint64_t orbit_zigzag(uint64_t delta) {
+  return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static inline uint64_t orbit_unzigzag(uint64_t v) {
+  return (v >> 1) ^ (uint64_t)(-(int64_t)(v & 1));
+}
+
+// Encode one event at `p`, which must have ORBIT_MAX_RECORD_SIZE bytes left
+static inline uint8_t *orbit_encode_event(struct orbit_trace_codec *codec,
+                                          const struct orbit_trace_event *ev,
+                                          uint8_t *p) {
+  uint8_t head = ev->kind & ORBIT_REC_KIND_MASK;
+  if (!codec->first && ev->tid == codec->tid) head |= ORBIT_REC_SAME_TID;
+  if (!codec->first && ev->size == codec->size) head |= ORBIT_REC_SAME_SIZE;
+  if (ev->site != 0) head |= ORBIT_REC_HAS_SITE;
+  if (ev->weight != 1) head |= ORBIT_REC_HAS_WEIGHT;
+  *p++ = head;
+  if (!(head & ORBIT_REC_SAME_TID)) p = orbit_put_varint(p, ev->tid);
+  p = orbit_put_varint(p, orbit_zigzag(ev->timestamp - codec->timestamp));
+  p = orbit_put_varint(p, orbit_zigzag(ev->addr - codec->addr));
+  if (!(head & ORBIT_REC_SAME_SIZE)) p = orbit_put_varint(p, ev->size);
+  if (head & ORBIT_REC_HAS_SITE) p = orbit_put_varint(p, ev->site);
+  if (head & ORBIT_REC_HAS_WEIGHT) p = orbit_put_varint(p, ev->weight);
+
+  codec->timestamp = ev->timestamp;
+  codec->addr = ev->addr;
+  codec->size = ev->size;
+  codec->tid = ev->tid;
+  codec->first = 0;
+  return p;
+}
+
+// Decode one event, returns NULL on a truncated or corrupted record
+static inline const uint8_t *orbit_decode_event(
+    struct orbit_trace_codec *codec, const uint8_t *p, const uint8_t *end,
+    struct orbit_trace_event *ev) {
+  uint64_t v;
+  uint8_t head;
+  if (p >= end) return NULL;
+  head = *p++;
+  ev->kind = head & ORBIT_REC_KIND_MASK;
+
+  if (head & ORBIT_REC_SAME_TID) {
+    ev->tid = codec->tid;
+  } else {
+    if ((p = orbit_get_varint(p, end, &v)) == NULL) return NULL;
+    ev->tid = (uint32_t)v;
+  }
+  if ((p = orbit_get_varint(p, end, &v)) == NULL) return NULL;
+  ev->timestamp = codec->timestamp + orbit_unzigzag(v);
+  if ((p = orbit_get_varint(p, end, &v)) == NULL) return NULL;
+  ev->addr = codec->addr + orbit_unzigzag(v);
+  if (head & ORBIT_REC_SAME_SIZE) {
+    ev->size = codec->size;
+  } else {
+    if ((p = orbit_get_varint(p, end, &v)) == NULL) return NULL;
+    ev->size = v;
+  }
+  ev->site = 0;
+  if (head & ORBIT_REC_HAS_SITE) {
+    if ((p = orbit_get_varint(p, end, &v)) == NULL) return NULL;
+    ev->site = (uint32_t)v;
+  }
+  ev->weight = 1;
+  if (head & ORBIT_REC_HAS_WEIGHT) {
+    if ((p = orbit_get_varint(p, end, &v)) == NULL) return NULL;
+    ev->weight = (uint32_t)v;
+  }
+
+  codec->timestamp = ev->timestamp;
+  codec->addr = ev->addr;
+  codec->size = ev->size;
+  codec->tid = ev->tid;
+  codec->first = 0;
+  return p;
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _TRACE_FORMAT_H_ */
@@ -0,0 +1,299 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Trace writer. The trace file is created at its full size and mapped
+// shared, and each allocating thread encodes its events straight into a
+// chunk of it, in the format described in trace_format.h. A thread claims a
+// new chunk with an atomic add when its chunk is full; otherwise recording
+// an event takes no lock and no system call. Each record is committed by
+// updating the size and record count of its block after it is written, and
+// the pages belong to the file, not to the process: when the process
+// crashes, every committed record is already in the page cache, and the
+// kernel writes it back without any help.
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "trace_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gobj_sampler.h"
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+_Static_assert(ORBIT_TRACE_CHUNK_SIZE >
+                   sizeof(struct orbit_trace_block_header) +
+                       ORBIT_MAX_RECORD_SIZE,
+               "ORBIT_TRACE_CHUNK_SIZE is too small");
+
+enum writer_state { WRITER_OWNED, WRITER_ORPHANED };
+
+// Appends to one chunk at a time, owned by one thread at a time
+struct orbit_trace_writer {
+  struct orbit_trace_block_header *block;
+  uint8_t *pos;
+  uint8_t *end;
+  struct orbit_trace_codec codec;
+  _Atomic uint64_t recorded;
+  _Atomic uint64_t overflows;
+  uint32_t tid;
+  _Atomic int state;
+  struct orbit_trace_writer *next;
+};
+
+static __thread struct orbit_trace_writer *thread_writer;
+static _Atomic(struct orbit_trace_writer *) all_writers;
+static _Atomic uint32_t writer_cnt;
+static _Atomic uint64_t dropped;
+static _Atomic bool recording;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t writer_key;
+
+static int trace_fd = -1;
+static uint8_t *trace_map;
+static uint64_t trace_size;
+static struct orbit_trace_file_header *trace_header;
+// Offset of the next chunk to claim
+static _Atomic uint64_t next_chunk;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRACE_CLOCK ORBIT_CLOCK_TSC
+#else
+#define TRACE_CLOCK ORBIT_CLOCK_MONOTONIC_NS
+#endif
+
+static inline uint64_t now(void) {
+#if TRACE_CLOCK == ORBIT_CLOCK_TSC
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Thread exit: hand the writer over to the next thread that needs one, which
+// goes on filling its chunk
+static void release_writer(void *arg) {
+  struct orbit_trace_writer *writer = arg;
+  thread_writer = NULL;
+  atomic_store_explicit(&writer->state, WRITER_ORPHANED,
+                        memory_order_release);
+}
+
+static void make_writer_key(void) {
+  pthread_key_create(&writer_key, release_writer);
+}
+
+static struct orbit_trace_writer *acquire_writer(void) {
+  struct orbit_trace_writer *writer;
+  pthread_once(&key_once, make_writer_key);
+
+  for (writer = atomic_load(&all_writers); writer != NULL;
+       writer = writer->next) {
+    int expected = WRITER_ORPHANED;
+    if (atomic_compare_exchange_strong(&writer->state, &expected,
+                                       WRITER_OWNED))
+      goto claimed;
+  }
+
+  // Writers are mapped directly so that tracing never recurses into malloc
+  writer = mmap(NULL, sizeof(*writer), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (writer == MAP_FAILED) return NULL;
+  atomic_store(&writer->state, WRITER_OWNED);
+  writer->next = atomic_load(&all_writers);
+  while (!atomic_compare_exchange_weak(&all_writers, &writer->next, writer)) {
+  }
+  atomic_fetch_add(&writer_cnt, 1);
+
+claimed:
+  writer->tid = (uint32_t)syscall(SYS_gettid);
+  pthread_setspecific(writer_key, writer);
+  thread_writer = writer;
+  return writer;
+}
+
+// Move the end of the used part of the file past `end`
+static void publish_data_end(uint64_t end) {
+  uint64_t cur = __atomic_load_n(&trace_header->data_end, __ATOMIC_RELAXED);
+  while (cur < end &&
+         !__atomic_compare_exchange_n(&trace_header->data_end, &cur, end,
+                                      true, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED)) {
+  }
+}
+
+// Claim a new chunk for `writer`, returns false if the file is full
+static bool next_block(struct orbit_trace_writer *writer) {
+  uint64_t off = atomic_fetch_add(&next_chunk, ORBIT_TRACE_CHUNK_SIZE);
+  struct orbit_trace_block_header *block;
+  if (off + ORBIT_TRACE_CHUNK_SIZE > trace_size) return false;
+  // Back the chunk with disk space now, a full disk would otherwise surface
+  // as a SIGBUS on first touch. Not every file system can do it.
+  if (fallocate(trace_fd, 0, off, ORBIT_TRACE_CHUNK_SIZE) != 0 &&
+      errno == ENOSPC)
+    return false;
+  publish_data_end(off + ORBIT_TRACE_CHUNK_SIZE);
+
+  // The file was created empty, so the rest of the header is already zero
+  block = (struct orbit_trace_block_header *)(trace_map + off);
+  __atomic_store_n(&block->magic, ORBIT_BLOCK_MAGIC, __ATOMIC_RELEASE);
+  writer->block = block;
+  writer->pos = (uint8_t *)(block + 1);
+  writer->end = trace_map + off + ORBIT_TRACE_CHUNK_SIZE;
+  orbit_codec_reset(&writer->codec);
+  return true;
+}
+
+void orbit_trace_record(uint16_t kind, uint32_t site, const void *addr,
+                        size_t size, uint32_t weight) {
+  struct orbit_trace_writer *writer = thread_writer;
+  struct orbit_trace_block_header *block;
+  struct orbit_trace_event ev;
+
+  if (unlikely(!atomic_load_explicit(&recording, memory_order_acquire))) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+  if (unlikely(writer == NULL)) {
+    writer = acquire_writer();
+    if (writer == NULL) {
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return;
+    }
+  }
+  if (unlikely(writer->end - writer->pos < ORBIT_MAX_RECORD_SIZE) &&
+      !next_block(writer)) {
+    atomic_store_explicit(
+        &writer->overflows,
+        atomic_load_explicit(&writer->overflows, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    return;
+  }
+
+  ev.timestamp = now();
+  ev.addr = (uint64_t)(uintptr_t)addr;
+  ev.size = size;
+  ev.site = site;
+  ev.tid = writer->tid;
+  ev.weight = weight;
+  ev.kind = kind;
+  writer->pos = orbit_encode_event(&writer->codec, &ev, writer->pos);
+
+  // Commit: the record is complete before the block covers it
+  block = writer->block;
+  if (block->record_cnt == 0) block->first_timestamp = ev.timestamp;
+  block->last_timestamp = ev.timestamp;
+  __atomic_store_n(&block->payload_size,
+                   (uint32_t)(writer->pos - (uint8_t *)(block + 1)),
+                   __ATOMIC_RELEASE);
+  __atomic_store_n(&block->record_cnt, block->record_cnt + 1,
+                   __ATOMIC_RELEASE);
+  atomic_store_explicit(
+      &writer->recorded,
+      atomic_load_explicit(&writer->recorded, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+// The child must not append to the chunks of its parent's threads
+static void stop_in_child(void) {
+  atomic_store(&recording, false);
+}
+
+static void register_atfork(void) {
+  pthread_atfork(NULL, NULL, stop_in_child);
+}
+
+bool orbit_trace_start(int fd) {
+  static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+  struct orbit_trace_file_header *header;
+  const char *env = getenv("ORBIT_TRACE_SIZE");
+  uint64_t size = ORBIT_TRACE_DEFAULT_SIZE;
+  void *map;
+
+  if (env != NULL && *env != '\0') size = strtoull(env, NULL, 0);
+  if (size < sizeof(*header) + ORBIT_TRACE_CHUNK_SIZE)
+    size = sizeof(*header) + ORBIT_TRACE_CHUNK_SIZE;
+  // A sparse file: only the chunks that are claimed take space
+  if (ftruncate(fd, size) != 0) return false;
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+             fd, 0);
+  if (map == MAP_FAILED) {
+    // Do not leave a large empty file behind
+    if (ftruncate(fd, 0) != 0) perror("failed to truncate orbit trace");
+    return false;
+  }
+
+  header = map;
+  header->version = ORBIT_TRACE_VERSION;
+  header->clock = TRACE_CLOCK;
+  header->header_size = sizeof(*header);
+  header->pid = getpid();
+  orbit_sample_get_config(&header->sample_mode, &header->sample_period);
+  header->data_end = sizeof(*header);
+  header->chunk_size = ORBIT_TRACE_CHUNK_SIZE;
+  memcpy(header->magic, ORBIT_TRACE_MAGIC, sizeof(header->magic));
+
+  trace_fd = fd;
+  trace_map = map;
+  trace_size = size;
+  trace_header = header;
+  atomic_store(&next_chunk, sizeof(*header));
+  pthread_once(&atfork_once, register_atfork);
+  atomic_store_explicit(&recording, true, memory_order_release);
+  return true;
+}
+
+void orbit_trace_flush(void) {
+  if (trace_header == NULL) return;
+  msync(trace_map, __atomic_load_n(&trace_header->data_end, __ATOMIC_ACQUIRE),
+        MS_SYNC);
+}
+
+void orbit_trace_stop(void) {
+  uint64_t end;
+  if (!atomic_exchange(&recording, false)) return;
+  // Claims racing with this get an offset past the end of the file and fail,
+  // while appends to the chunks already claimed all land below `end`. The
+  // file stays mapped for them.
+  end = atomic_exchange(&next_chunk, UINT64_MAX / 2);
+  if (end > trace_size) end = trace_size;
+  __atomic_store_n(&trace_header->data_end, end, __ATOMIC_RELEASE);
+  // On failure the file keeps its full size, readers stop at data_end
+  if (ftruncate(trace_fd, end) != 0) return;
+}
+
+void orbit_trace_get_stats(struct orbit_trace_stats *stats) {
+  struct orbit_trace_writer *writer;
+  memset(stats, 0, sizeof(*stats));
+  for (writer = atomic_load(&all_writers); writer != NULL;
+       writer = writer->next) {
+    stats->recorded +=
+        atomic_load_explicit(&writer->recorded, memory_order_relaxed);
+    stats->overflows +=
+        atomic_load_explicit(&writer->overflows, memory_order_relaxed);
+  }
+  stats->dropped = atomic_load(&dropped);
+  if (trace_header != NULL)
+    stats->bytes_written =
+        __atomic_load_n(&trace_header->data_end, __ATOMIC_ACQUIRE);
+  stats->writers = atomic_load(&writer_cnt);
+}
@@ -0,0 +1,62 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#ifndef _TRACE_WRITER_H_
+#define _TRACE_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace_format.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size of the chunk of the trace file each thread appends to
+#ifndef ORBIT_TRACE_CHUNK_SIZE
+#define ORBIT_TRACE_CHUNK_SIZE (64u << 10)
+#endif
+// Size the trace file is created with, ORBIT_TRACE_SIZE overrides it
+#ifndef ORBIT_TRACE_DEFAULT_SIZE
+#define ORBIT_TRACE_DEFAULT_SIZE (4ull << 30)
+#endif
+
+struct orbit_trace_stats {
+  // Events written to the trace file
+  uint64_t recorded;
+  // Events lost because the trace file was full
+  uint64_t overflows;
+  // Events lost because tracing was not running
+  uint64_t dropped;
+  uint64_t bytes_written;
+  uint32_t writers;
+};
+
+// Size the trace file `fd`, map it, and write its header. Events recorded
+// before this are dropped.
+bool orbit_trace_start(int fd);
+// Append an event to the calling thread's chunk of the trace file, never
+// blocks. `site` is the GUID of the instrumented site, or 0 if unknown, and
+// `weight` the sample weight of the object.
+void orbit_trace_record(uint16_t kind, uint32_t site, const void *addr,
+                        size_t size, uint32_t weight);
+// Wait for the recorded events to reach the disk. They are in the file as
+// soon as they are recorded, this only matters if the machine goes down.
+void orbit_trace_flush(void);
+// Stop accepting events and truncate the file to what was used. This is
+// async-signal-safe, so that a signal handler can close the trace.
+void orbit_trace_stop(void);
+void orbit_trace_get_stats(struct orbit_trace_stats *stats);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* _TRACE_WRITER_H_ */
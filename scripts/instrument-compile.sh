@@ -21,6 +21,9 @@ Usage:
 
   -r, --runtime:    path to libOrbitTracker.a/.so runtime 
 
+  -j, --jobs:       split the instrumented bitcode into this many partitions
+                    and compile them in parallel
+
       --dry-run:    dry run, do not
 
   -o, --output:     output file name
@@ -53,6 +56,10 @@ function parse_args()
         runtime_path="$2"
         shift 2
         ;;
+      -j|--jobs)
+        jobs="$2"
+        shift 2
+        ;;
       -h|--help)
         display_usage
         exit 0
@@ -76,6 +83,7 @@ link_libs=
 with_runtime=1
 plugin_args=""
 link_flags=""
+jobs=1
 
 parse_args "$@"
 set -- "${args[@]}"
@@ -128,20 +136,43 @@ if [ $with_runtime -eq 0 ]; then
   instrumenter_args="$instrumenter_args -use-printf"
 fi
 
+if [ $jobs -gt 1 ]; then
+  instrumenter_args="$instrumenter_args -split=$jobs"
+fi
+
 $maybe $instrumenter $instrumenter_args $source_bc_file -o $output_bc
 
 # Newer clang can directly compile bitcode to executable, Yay!
+inputs=$output_bc
+if [ $jobs -gt 1 ]; then
+  # The instrumentor wrote output.0.bc, output.1.bc, ... instead, compile
+  # them all at once
+  inputs=
+  pids=()
+  for ((i = 0; i < jobs; i++)); do
+    part=${output_bc%.bc}.$i
+    $maybe clang -c $part.bc -o $part.o &
+    pids+=($!)
+    inputs="$inputs $part.o"
+  done
+  for pid in "${pids[@]}"; do
+    if ! wait $pid; then
+      echo "Failed to compile a partition of $output_bc"
+      exit 1
+    fi
+  done
+fi
+
 if [ $with_runtime -eq 0 ]; then
   # when using regular printf for instrumentation, we do not need to link 
   # with the runtime tracker library
-  $maybe clang -o $output_exe $output_bc
+  $maybe clang -o $output_exe $inputs
 else
   # otherwise, we need to link with the library to produce the executable
   # here we are linking with static lib, which is less flexible but faster
-  $maybe clang $output_bc -o $output_exe -L $runtime_path -l:libOrbitTracker.a
-  $maybe clang $output_bc -o $output_exe -L $runtime_path -l:libOrbitTracker.a 
+  $maybe clang $inputs -o $output_exe -L $runtime_path -l:libOrbitTracker.a -lpthread -lm -ldl
   # another way is to link with the shared lib, which is flexible but slower
-  # $maybe clang $output_bc -o $output_exe -L $runtime_path -lOrbitTracker 
+  # $maybe clang $inputs -o $output_exe -L $runtime_path -lOrbitTracker 
 fi
 
 # Old way of producing executable through the assembly
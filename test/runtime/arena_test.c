@@ -0,0 +1,153 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Arena: alloc, free and realloc of small and large objects across threads.
+// Every object is filled with a pattern of its own, so objects that overlap
+// or lose their contents on realloc fail the checks.
+//
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "check.h"
+#include "gobj_arena.h"
+
+#define THREADS 4
+#define OBJECTS 2000
+#define ROUNDS 3
+
+struct object {
+  unsigned char *ptr;
+  size_t size;
+  unsigned char fill;
+};
+
+static struct object objects[THREADS][OBJECTS];
+static pthread_barrier_t barrier;
+
+static size_t next_rand(uint64_t *state) {
+  *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+  return (size_t)(*state >> 33);
+}
+
+// Mostly small objects, and some that take whole slabs
+static size_t pick_size(uint64_t *state) {
+  size_t r = next_rand(state);
+  if (r % 16 == 0)
+    return ORBIT_ARENA_MAX_SMALL + r % (4 * ORBIT_ARENA_SLAB_SIZE);
+  return 1 + r % 1024;
+}
+
+static void check_object(const struct object *obj) {
+  size_t i;
+  struct orbit_arena_region region;
+  orbit_arena_get_region(&region);
+  CHECK(obj->ptr >= (unsigned char *)region.base &&
+        obj->ptr + obj->size <= (unsigned char *)region.base + region.used);
+  CHECK(orbit_arena_usable_size(obj->ptr) >= obj->size);
+  for (i = 0; i < obj->size; i++) CHECK(obj->ptr[i] == obj->fill);
+}
+
+static void fill_object(struct object *obj, unsigned char fill) {
+  obj->fill = fill;
+  memset(obj->ptr, fill, obj->size);
+}
+
+static void *run(void *arg) {
+  uintptr_t t = (uintptr_t)arg;
+  uint64_t state = t + 1;
+  unsigned round, i;
+  for (round = 0; round < ROUNDS; round++) {
+    struct object *mine = objects[t];
+    // Free the objects that the previous thread allocated in this round
+    struct object *theirs = objects[(t + THREADS - 1) % THREADS];
+
+    for (i = 0; i < OBJECTS; i++) {
+      mine[i].size = pick_size(&state);
+      mine[i].ptr = orbit_arena_alloc(mine[i].size);
+      CHECK(mine[i].ptr != NULL);
+      fill_object(&mine[i], (unsigned char)(t * 64 + i));
+    }
+    for (i = 0; i < OBJECTS; i += 3) {
+      size_t size = pick_size(&state), kept;
+      check_object(&mine[i]);
+      kept = size < mine[i].size ? size : mine[i].size;
+      mine[i].ptr = orbit_arena_realloc(mine[i].ptr, size);
+      CHECK(mine[i].ptr != NULL);
+      mine[i].size = kept;
+      check_object(&mine[i]);
+      mine[i].size = size;
+      fill_object(&mine[i], mine[i].fill + 1);
+    }
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < OBJECTS; i++) {
+      check_object(&theirs[i]);
+      orbit_arena_free(theirs[i].ptr);
+    }
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+static void test_threads(void) {
+  pthread_t threads[THREADS];
+  uintptr_t t;
+  pthread_barrier_init(&barrier, NULL, THREADS);
+  for (t = 0; t < THREADS; t++)
+    pthread_create(&threads[t], NULL, run, (void *)t);
+  for (t = 0; t < THREADS; t++) pthread_join(threads[t], NULL);
+  pthread_barrier_destroy(&barrier);
+}
+
+// Freed runs of slabs merge with their free neighbors, in any order
+static void test_large_merge(void) {
+  size_t big = 3 * ORBIT_ARENA_SLAB_SIZE;
+  char *a = orbit_arena_alloc(big), *b = orbit_arena_alloc(big);
+  char *c = orbit_arena_alloc(big), *d = orbit_arena_alloc(big);
+  char *e, *f;
+  CHECK(a != NULL && b == a + big && c == b + big && d == c + big);
+  orbit_arena_free(a);
+  orbit_arena_free(c);
+  orbit_arena_free(b);
+  e = orbit_arena_alloc(3 * big);
+  CHECK(e == a);
+  CHECK(orbit_arena_usable_size(e) == 3 * big);
+  // A smaller object takes the tail of a free run, the rest stays free
+  orbit_arena_free(e);
+  f = orbit_arena_alloc(ORBIT_ARENA_SLAB_SIZE);
+  CHECK(f == a + 3 * big - ORBIT_ARENA_SLAB_SIZE);
+  e = orbit_arena_alloc(3 * big - ORBIT_ARENA_SLAB_SIZE);
+  CHECK(e == a);
+  orbit_arena_free(f);
+  orbit_arena_free(e);
+  orbit_arena_free(d);
+}
+
+static void test_small(void) {
+  unsigned cls;
+  for (cls = 0; cls < ORBIT_ARENA_NUM_CLASSES; cls++) {
+    size_t size = orbit_arena_class_size(cls);
+    char *p = orbit_arena_alloc_class(cls), *q = orbit_arena_alloc(size);
+    CHECK(orbit_arena_size_class(size) == cls);
+    CHECK(size <= ORBIT_ARENA_MAX_SMALL);
+    CHECK(p != NULL && q != NULL && p != q);
+    CHECK(orbit_arena_usable_size(p) == size);
+    CHECK(orbit_arena_contains(p) && orbit_arena_contains(q));
+    orbit_arena_free(p);
+    orbit_arena_free(q);
+  }
+  CHECK(!orbit_arena_contains(&cls));
+}
+
+int main(void) {
+  test_large_merge();
+  test_small();
+  test_threads();
+  printf("arena_test: ok\n");
+  return 0;
+}
@@ -0,0 +1,27 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Checks for the runtime tests. Unlike assert(), they are never compiled
+// out, and a failure exits with a message and a non-zero status.
+//
+
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                   \
+      exit(1);                                                          \
+    }                                                                   \
+  } while (0)
+
+#endif /* _CHECK_H_ */
@@ -0,0 +1,131 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Live object index: insert, find and erase, including interior pointers,
+// objects that span pages, and threads working on neighboring objects.
+//
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "check.h"
+#include "gobj_index.h"
+
+#define PAGE 4096ul
+// The index never dereferences the addresses, any range works
+#define BASE 0x100000000000ul
+
+#define THREADS 4
+#define PER_THREAD 2000
+
+static const void *at(uint64_t off) { return (const void *)(BASE + off); }
+
+static void test_single_page(void) {
+  struct orbit_gobj_entry entry;
+  orbit_index_insert(at(64), 32, 7, 1);
+  orbit_index_insert(at(16), 16, 8, 0);
+  orbit_index_insert(at(256), 0, 9, 0);
+
+  CHECK(orbit_index_find(at(64), &entry));
+  CHECK(entry.addr == BASE + 64 && entry.size == 32 && entry.site == 7 &&
+        entry.weight == 1);
+  CHECK(orbit_index_find(at(95), &entry) && entry.addr == BASE + 64);
+  CHECK(!orbit_index_find(at(96), NULL));
+  CHECK(orbit_index_find(at(31), &entry) && entry.site == 8);
+  CHECK(!orbit_index_find(at(32), NULL));
+  CHECK(!orbit_index_find(at(0), NULL));
+  // A zero-sized object only contains its own address
+  CHECK(orbit_index_find(at(256), &entry) && entry.site == 9);
+  CHECK(!orbit_index_find(at(257), NULL));
+  CHECK(orbit_index_count() == 3 && orbit_index_bytes() == 48);
+
+  CHECK(orbit_index_erase(at(64), &entry) && entry.site == 7);
+  CHECK(!orbit_index_erase(at(64), NULL));
+  // Only the start of an object erases it
+  CHECK(!orbit_index_erase(at(20), NULL));
+  CHECK(!orbit_index_find(at(80), NULL));
+  CHECK(orbit_index_erase(at(16), NULL) && orbit_index_erase(at(256), NULL));
+  CHECK(orbit_index_count() == 0 && orbit_index_bytes() == 0);
+}
+
+static void test_spanning(void) {
+  struct orbit_gobj_entry entry;
+  uint64_t start = 16 * PAGE + 3000, size = 3 * PAGE;
+  orbit_index_insert(at(start), size, 11, 0);
+  // Objects starting on the pages the big one covers
+  orbit_index_insert(at(start + size), 64, 12, 0);
+  orbit_index_insert(at(16 * PAGE + 100), 100, 13, 0);
+
+  CHECK(orbit_index_find(at(start), &entry) && entry.site == 11);
+  CHECK(orbit_index_find(at(17 * PAGE), &entry) && entry.site == 11);
+  CHECK(orbit_index_find(at(18 * PAGE + 5), &entry) && entry.site == 11);
+  CHECK(orbit_index_find(at(start + size - 1), &entry) && entry.site == 11);
+  CHECK(orbit_index_find(at(start + size), &entry) && entry.site == 12);
+  CHECK(orbit_index_find(at(16 * PAGE + 150), &entry) && entry.site == 13);
+  CHECK(!orbit_index_find(at(16 * PAGE + 200), NULL));
+
+  CHECK(orbit_index_erase(at(start), NULL));
+  CHECK(!orbit_index_find(at(17 * PAGE), NULL));
+  CHECK(!orbit_index_find(at(19 * PAGE), NULL));
+  CHECK(orbit_index_find(at(start + size + 10), &entry) && entry.site == 12);
+  CHECK(orbit_index_erase(at(start + size), NULL));
+  CHECK(orbit_index_erase(at(16 * PAGE + 100), NULL));
+  CHECK(orbit_index_count() == 0);
+}
+
+static void test_order(void) {
+  struct orbit_gobj_entry entries[8];
+  uint64_t offs[] = {5 * PAGE, 64, 2 * PAGE + 8, 32};
+  unsigned i;
+  for (i = 0; i < 4; i++) orbit_index_insert(at(offs[i]), 16, i + 1, 0);
+  orbit_index_lock_all();
+  CHECK(orbit_index_collect(entries, 8) == 4);
+  orbit_index_unlock_all();
+  CHECK(entries[0].addr == BASE + 32 && entries[1].addr == BASE + 64 &&
+        entries[2].addr == BASE + 2 * PAGE + 8 &&
+        entries[3].addr == BASE + 5 * PAGE);
+  for (i = 0; i < 4; i++) CHECK(orbit_index_erase(at(offs[i]), NULL));
+}
+
+// Each thread owns every THREADS-th object, so the threads keep sharing
+// pages and the locks of their stripes
+static void *churn(void *arg) {
+  uintptr_t t = (uintptr_t)arg;
+  struct orbit_gobj_entry entry;
+  unsigned i;
+  for (i = 0; i < PER_THREAD; i++)
+    orbit_index_insert(at((i * THREADS + t) * 48), 40, t + 1, 0);
+  for (i = 0; i < PER_THREAD; i++) {
+    CHECK(orbit_index_find(at((i * THREADS + t) * 48 + 39), &entry));
+    CHECK(entry.site == t + 1);
+  }
+  for (i = 0; i < PER_THREAD; i += 2)
+    CHECK(orbit_index_erase(at((i * THREADS + t) * 48), NULL));
+  return NULL;
+}
+
+static void test_threads(void) {
+  pthread_t threads[THREADS];
+  uintptr_t t;
+  unsigned i;
+  for (t = 0; t < THREADS; t++)
+    pthread_create(&threads[t], NULL, churn, (void *)t);
+  for (t = 0; t < THREADS; t++) pthread_join(threads[t], NULL);
+  CHECK(orbit_index_count() == THREADS * PER_THREAD / 2);
+  for (i = 0; i < THREADS * PER_THREAD; i++)
+    CHECK(orbit_index_erase(at(i * 48), NULL) == (i / THREADS % 2 == 1));
+  CHECK(orbit_index_count() == 0 && orbit_index_bytes() == 0);
+}
+
+int main(void) {
+  test_single_page();
+  test_spanning();
+  test_order();
+  test_threads();
+  printf("index_test: ok\n");
+  return 0;
+}
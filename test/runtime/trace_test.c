@@ -0,0 +1,210 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Trace writer: events recorded by several threads are decoded back from the
+// file as they were recorded, and so is the trace of a writer killed in the
+// middle of its work, up to its last committed record.
+//
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "trace_writer.h"
+
+#define THREADS 4
+#define EVENTS 20000
+// Events the killed writer records before it is killed, at least and at most
+#define KILL_AFTER 50000
+#define KILL_BEFORE (8 * KILL_AFTER)
+
+struct trace {
+  struct orbit_trace_file_header header;
+  struct orbit_trace_event *events;
+  size_t cnt;
+  // Size of the file, which the writer cuts down to data_end when stopped
+  uint64_t file_size;
+};
+
+static void append(struct trace *trace, const struct orbit_trace_event *ev) {
+  if ((trace->cnt & (trace->cnt - 1)) == 0) {
+    trace->events = realloc(trace->events,
+                            (trace->cnt ? trace->cnt * 2 : 1) *
+                                sizeof(*trace->events));
+    CHECK(trace->events != NULL);
+  }
+  trace->events[trace->cnt++] = *ev;
+}
+
+// Decode the trace the way the decoder tool does: chunk by chunk up to
+// data_end, skipping the chunks that were claimed but never set up
+static void decode(int fd, struct trace *trace) {
+  struct stat st;
+  const uint8_t *map, *p, *end;
+  memset(trace, 0, sizeof(*trace));
+  CHECK(fstat(fd, &st) == 0);
+  trace->file_size = st.st_size;
+  CHECK((size_t)st.st_size >= sizeof(trace->header));
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  CHECK(map != MAP_FAILED);
+  memcpy(&trace->header, map, sizeof(trace->header));
+  CHECK(memcmp(trace->header.magic, ORBIT_TRACE_MAGIC, 8) == 0);
+  CHECK(trace->header.version == ORBIT_TRACE_VERSION);
+  CHECK(trace->header.chunk_size == ORBIT_TRACE_CHUNK_SIZE);
+  CHECK(trace->header.data_end <= (uint64_t)st.st_size);
+
+  end = map + trace->header.data_end;
+  for (p = map + trace->header.header_size; p < end;
+       p += trace->header.chunk_size) {
+    struct orbit_trace_block_header block;
+    struct orbit_trace_codec codec;
+    const uint8_t *rec, *payload_end;
+    uint32_t i;
+    CHECK((size_t)(end - p) >= trace->header.chunk_size);
+    memcpy(&block, p, sizeof(block));
+    if (block.magic == 0) continue;
+    CHECK(block.magic == ORBIT_BLOCK_MAGIC);
+    CHECK(block.payload_size <= trace->header.chunk_size - sizeof(block));
+    rec = p + sizeof(block);
+    payload_end = rec + block.payload_size;
+    orbit_codec_reset(&codec);
+    for (i = 0; i < block.record_cnt; i++) {
+      struct orbit_trace_event ev;
+      rec = orbit_decode_event(&codec, rec, payload_end, &ev);
+      CHECK(rec != NULL);
+      append(trace, &ev);
+    }
+    CHECK(rec == payload_end);
+  }
+  munmap((void *)map, st.st_size);
+}
+
+static int make_trace_file(void) {
+  char path[] = "/tmp/orbit_trace_test_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  unlink(path);
+  return fd;
+}
+
+// Event `i` of writer `t`, so that the decoded events can be checked
+static void record(uint32_t t, uint64_t i) {
+  orbit_trace_record(i % 5 == 0 ? ORBIT_EVENT_FREE : ORBIT_EVENT_ALLOC, t + 1,
+                     (const void *)(uintptr_t)(((uint64_t)t << 40) | i * 16),
+                     i % 7 == 0 ? 4096 : 32 + i % 3, 1 + i % 4);
+}
+
+static void check_event(const struct orbit_trace_event *ev, uint32_t t,
+                        uint64_t i) {
+  CHECK(ev->kind == (i % 5 == 0 ? ORBIT_EVENT_FREE : ORBIT_EVENT_ALLOC));
+  CHECK(ev->site == t + 1);
+  CHECK(ev->addr == (((uint64_t)t << 40) | i * 16));
+  CHECK(ev->size == (i % 7 == 0 ? 4096 : 32 + i % 3));
+  CHECK(ev->weight == 1 + i % 4);
+}
+
+static void *run(void *arg) {
+  uint32_t t = (uint32_t)(uintptr_t)arg;
+  uint64_t i;
+  for (i = 0; i < EVENTS; i++) record(t, i);
+  return NULL;
+}
+
+static void test_threads(void) {
+  int fd = make_trace_file();
+  pthread_t threads[THREADS];
+  uint64_t next[THREADS] = {0};
+  uint32_t tids[THREADS] = {0};
+  struct orbit_trace_stats stats;
+  struct trace trace;
+  uintptr_t t;
+  size_t i;
+
+  CHECK(orbit_trace_start(fd));
+  for (t = 0; t < THREADS; t++)
+    pthread_create(&threads[t], NULL, run, (void *)t);
+  for (t = 0; t < THREADS; t++) pthread_join(threads[t], NULL);
+  orbit_trace_stop();
+  orbit_trace_get_stats(&stats);
+  CHECK(stats.recorded == THREADS * EVENTS);
+  CHECK(stats.overflows == 0);
+
+  decode(fd, &trace);
+  CHECK(trace.file_size == trace.header.data_end);
+  CHECK(trace.cnt == THREADS * EVENTS);
+  // A thread's chunks come in the order it claimed them, so its events are
+  // decoded in the order they were recorded
+  for (i = 0; i < trace.cnt; i++) {
+    const struct orbit_trace_event *ev = &trace.events[i];
+    t = ev->site - 1;
+    CHECK(t < THREADS);
+    if (next[t] == 0) tids[t] = ev->tid;
+    CHECK(ev->tid == tids[t]);
+    check_event(ev, t, next[t]++);
+  }
+  for (t = 0; t < THREADS; t++) CHECK(next[t] == EVENTS);
+  free(trace.events);
+  close(fd);
+}
+
+// The writer is killed while it records. Every record that was committed
+// must decode, in order and without gaps, with nothing after the last one.
+static void test_killed(void) {
+  int fd = make_trace_file(), ready[2];
+  struct trace trace;
+  char c;
+  size_t i;
+  pid_t pid;
+
+  CHECK(pipe(ready) == 0);
+  pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    uint64_t n;
+    close(ready[0]);
+    if (!orbit_trace_start(fd)) _exit(1);
+    // Past KILL_BEFORE, it waits to be killed before the file fills up
+    for (n = 0; n < KILL_BEFORE; n++) {
+      record(0, n);
+      if (n == KILL_AFTER && write(ready[1], "x", 1) != 1) _exit(1);
+    }
+    for (;;) pause();
+  }
+  close(ready[1]);
+  CHECK(read(ready[0], &c, 1) == 1);
+  kill(pid, SIGKILL);
+  CHECK(waitpid(pid, NULL, 0) == pid);
+  close(ready[0]);
+
+  decode(fd, &trace);
+  // Nobody stopped the trace, so the file keeps its full size
+  CHECK(trace.file_size > trace.header.data_end);
+  CHECK(trace.header.pid == (uint32_t)pid);
+  CHECK(trace.cnt > KILL_AFTER && trace.cnt <= KILL_BEFORE);
+  for (i = 0; i < trace.cnt; i++) check_event(&trace.events[i], 0, i);
+  free(trace.events);
+  close(fd);
+}
+
+int main(void) {
+  // Enough for the events of both tests, and quick to create
+  setenv("ORBIT_TRACE_SIZE", "16777216", 1);
+  // Before this process has writers of its own, which the child would
+  // inherit
+  test_killed();
+  test_threads();
+  printf("trace_test: ok\n");
+  return 0;
+}
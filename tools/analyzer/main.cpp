@@ -0,0 +1,142 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+
+#include <chrono>
+#include <iostream>
+
+#include <llvm/Support/CommandLine.h>
+
+#include "Instrument/SiteTable.h"
+#include "ObiWanAnalysis/ObiWanAnalysis.h"
+#include "Utils/LLVM.h"
+
+using namespace std;
+using namespace llvm;
+using namespace llvm::instrument;
+
+cl::opt<string> inputFilename(cl::Positional, cl::desc("<input file>"),
+                              cl::Required);
+cl::list<string> TargetFunctions("target-functions", cl::desc("<Function>"),
+                                 cl::OneOrMore);
+cl::list<string> AllocCallers(
+    "alloc-callers",
+    cl::desc("Only analyze allocation sites inside these functions"),
+    cl::ZeroOrMore);
+cl::opt<bool> lazyLoad(
+    "lazy", cl::desc("Lazily load the bitcode and only read function bodies "
+                     "when the analysis first enters them"));
+cl::opt<bool> canonicalizeModule(
+    "canonicalize",
+    cl::desc("Run the analysis on a copy of the module canonicalized with "
+             "mem2reg, SROA and instcombine, and map the results back"));
+
+cl::opt<bool> useMemorySSA(
+    "memssa",
+    cl::desc("Only follow loads that the store which led the analysis to "
+             "the pointer may reach, according to MemorySSA"));
+cl::opt<bool> usePointsTo(
+    "points-to",
+    cl::desc("Resolve indirect calls and prune the walk with a "
+             "unification-based points-to analysis"));
+cl::opt<string> allocRulesFilename(
+    "alloc-rules",
+    cl::desc("Read more allocation rules from this file, see "
+             "readAllocRules in include/Utils/LLVM.h"),
+    cl::value_desc("file"));
+cl::opt<string> siteListFilename(
+    "site-list",
+    cl::desc("Write the allocation points to this table of sites, for the "
+             "instrumentor's -sites-from"),
+    cl::value_desc("file"));
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv);
+
+  LLVMContext context;
+  unique_ptr<Module> M = parseModule(context, inputFilename, lazyLoad);
+  if (!M) {
+    errs() << "Failed to parse '" << inputFilename << "' file:\n";
+    return 1;
+  }
+  FunctionMaterializer materializer(*M);
+
+  AllocRules::Initializer init = getDefaultAllocRules(*M);
+  if (!allocRulesFilename.empty() && !readAllocRules(allocRulesFilename, init))
+    return 1;
+  const AllocRules rules(init);
+  unique_ptr<ShadowModule> shadow;
+  if (canonicalizeModule) {
+    auto start = chrono::steady_clock::now();
+    // Cloning needs every body
+    if (!materializer.materializeAll()) return 1;
+    shadow = make_unique<ShadowModule>(*M);
+    shadow->canonicalize();
+    errs() << "Canonicalized the shadow module in " << secondsSince(start)
+           << "s\n";
+  }
+
+  MemorySSACache mssa;
+  UserGraphContext ctx;
+  ctx.materializer = &materializer;
+  if (useMemorySSA) ctx.mssa = &mssa;
+  unique_ptr<pointsto::PointsToAnalysis> pts;
+  if (usePointsTo) {
+    auto start = chrono::steady_clock::now();
+    // The points-to sets are computed over the whole module up front
+    if (!materializer.materializeAll()) return 1;
+    pts = make_unique<pointsto::PointsToAnalysis>(shadow ? shadow->get() : *M);
+    ctx.pts = pts.get();
+    errs() << "Computed points-to sets (" << pts->getNodeCnt() << " nodes, "
+           << pts->getIndirectCallCnt() << " indirect calls) in "
+           << secondsSince(start) << "s\n";
+  }
+
+  set<string> callers(AllocCallers.begin(), AllocCallers.end());
+  set<string> targetFunctionSet(TargetFunctions.begin(), TargetFunctions.end());
+  size_t found = 0;
+  vector<AllocSite> sites;
+  auto start = chrono::steady_clock::now();
+  for (auto &target_name : targetFunctionSet) {
+    Function *targetFun = getFunctionWithName(target_name, *M);
+    if (targetFun == NULL) {
+      errs() << "Could not find target function " << target_name << "\n";
+      continue;
+    }
+    auto points =
+        shadow
+            ? findAllocationPoints(targetFun, *shadow, rules, ctx, callers)
+            : findAllocationPoints(targetFun, rules, ctx, callers);
+    found += points.size();
+    for (Instruction *point : points) {
+      Function *callee = CallSite(point).getCalledFunction();
+      sites.push_back(describeSite(
+          point, callee,
+          rules.realloc.count(callee) != 0 ? "realloc" : "alloc"));
+    }
+  }
+  errs() << "Found heapCalls " << found << " in " << secondsSince(start)
+         << "s\n";
+  materializer.printStats(errs());
+  if (materializer.hasFailed()) {
+    errs() << "Some function bodies could not be read, the allocation points "
+              "may be incomplete\n";
+    return 1;
+  }
+  if (useMemorySSA)
+    errs() << "Built MemorySSA for " << mssa.getFunctionCnt() << " functions\n";
+  if (!siteListFilename.empty()) {
+    if (!writeSiteTable(siteListFilename, sites)) return 1;
+    errs() << "Saved " << sites.size() << " allocation points to "
+           << siteListFilename << "\n";
+  }
+  return 0;
+}
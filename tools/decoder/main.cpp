@@ -0,0 +1,317 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Decode a binary gobj trace written by the OrbitTracker runtime into text or
+// CSV, or print aggregate statistics about it. The file is mapped rather than
+// read, and blocks outside the requested time range are skipped by their
+// headers without decoding. The trace of a process that crashed is read up
+// to its last committed record. Given the site table written by the
+// instrumentor, site GUIDs are shown with their source location. For a
+// sampled trace, the summary also extrapolates the totals from the sample
+// weights.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "trace_format.h"
+
+using namespace std;
+using namespace llvm;
+
+enum class OutputFormat { Text, CSV, Summary };
+
+cl::opt<string> inputFilename(cl::Positional, cl::desc("<trace file>"),
+                              cl::Required);
+cl::opt<string> outputFilename("o", cl::desc("Output file (default: stdout)"),
+                               cl::value_desc("file"), cl::init("-"));
+cl::opt<OutputFormat> outputFormat(
+    "format", cl::desc("Output format"), cl::init(OutputFormat::Text),
+    cl::values(clEnumValN(OutputFormat::Text, "text", "one event per line"),
+               clEnumValN(OutputFormat::CSV, "csv", "comma separated values"),
+               clEnumValN(OutputFormat::Summary, "summary",
+                          "aggregate statistics only")));
+cl::opt<uint64_t> startTime("start",
+                            cl::desc("Skip events before this timestamp"),
+                            cl::init(0));
+cl::opt<uint64_t> endTime("end", cl::desc("Skip events after this timestamp"),
+                          cl::init(UINT64_MAX));
+cl::opt<string> siteTableFilename(
+    "sites", cl::desc("Site table written by the instrumentor, to show the "
+                      "source location of each site"),
+    cl::value_desc("file"));
+cl::opt<unsigned> topSites("top-sites",
+                           cl::desc("Number of sites listed in the summary"),
+                           cl::init(10));
+
+// GUID -> "file:line:column function"
+static unordered_map<uint32_t, string> siteLocations;
+
+static bool loadSiteTable(StringRef path) {
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    errs() << "Failed to open '" << path
+           << "': " << buffer.getError().message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 0> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    if (line.startswith("#")) continue;
+    // guid, kind, location, function, allocator
+    SmallVector<StringRef, 5> fields;
+    line.split(fields, '\t');
+    uint32_t guid;
+    if (fields.size() < 4 || fields[0].getAsInteger(10, guid)) {
+      errs() << "Malformed line in '" << path << "': " << line << "\n";
+      return false;
+    }
+    siteLocations[guid] = (fields[2] + " " + fields[3]).str();
+  }
+  return true;
+}
+
+static StringRef siteLocation(uint32_t site) {
+  auto it = siteLocations.find(site);
+  return it == siteLocations.end() ? StringRef() : StringRef(it->second);
+}
+
+static const char *kindName(uint16_t kind) {
+  switch (kind) {
+    case ORBIT_EVENT_ALLOC: return "alloc";
+    case ORBIT_EVENT_FREE: return "free";
+    case ORBIT_EVENT_REALLOC: return "realloc";
+    default: return "unknown";
+  }
+}
+
+struct Summary {
+  uint64_t blocks = 0;
+  uint64_t skippedBlocks = 0;
+  uint64_t events = 0;
+  uint64_t firstTimestamp = UINT64_MAX;
+  uint64_t lastTimestamp = 0;
+  map<uint16_t, uint64_t> kindCnt;
+  uint64_t allocatedBytes = 0;
+  // Sums weighted by the sample weights, the estimated totals
+  map<uint16_t, uint64_t> kindWeight;
+  uint64_t allocatedWeightedBytes = 0;
+  unordered_map<uint32_t, uint64_t> threadCnt;
+  unordered_map<uint32_t, pair<uint64_t, uint64_t>> siteCnt;
+
+  void add(const orbit_trace_event &ev) {
+    events++;
+    firstTimestamp = std::min(firstTimestamp, ev.timestamp);
+    lastTimestamp = std::max(lastTimestamp, ev.timestamp);
+    kindCnt[ev.kind]++;
+    kindWeight[ev.kind] += ev.weight;
+    threadCnt[ev.tid]++;
+    if (ev.kind != ORBIT_EVENT_FREE) {
+      allocatedBytes += ev.size;
+      allocatedWeightedBytes += ev.size * ev.weight;
+      auto &site = siteCnt[ev.site];
+      site.first += ev.weight;
+      site.second += ev.size * ev.weight;
+    }
+  }
+
+  void print(raw_ostream &os, bool sampled) {
+    os << "blocks:     " << blocks << " (" << skippedBlocks << " skipped)\n";
+    os << "events:     " << events << "\n";
+    for (auto &[kind, cnt] : kindCnt) {
+      os << "  " << kindName(kind) << ": " << cnt;
+      if (sampled) os << " (estimated " << kindWeight[kind] << ")";
+      os << "\n";
+    }
+    os << "allocated:  " << allocatedBytes << " bytes";
+    if (sampled) os << " (estimated " << allocatedWeightedBytes << ")";
+    os << "\n";
+    os << "threads:    " << threadCnt.size() << "\n";
+    if (events > 0)
+      os << "timestamps: " << firstTimestamp << " - " << lastTimestamp << "\n";
+
+    vector<pair<uint32_t, pair<uint64_t, uint64_t>>> sites(siteCnt.begin(),
+                                                           siteCnt.end());
+    std::sort(sites.begin(), sites.end(), [](auto &a, auto &b) {
+      return a.second.first > b.second.first;
+    });
+    if (sites.size() > topSites) sites.resize(topSites);
+    os << (sampled ? "top sites (guid: estimated events, bytes):\n"
+                   : "top sites (guid: events, bytes):\n");
+    for (auto &[site, cnt] : sites) {
+      os << "  " << site << ": " << cnt.first << ", " << cnt.second;
+      if (!siteLocation(site).empty()) os << "  " << siteLocation(site);
+      os << "\n";
+    }
+  }
+};
+
+static void printEvent(raw_ostream &os, const orbit_trace_event &ev) {
+  if (outputFormat == OutputFormat::CSV) {
+    os << kindName(ev.kind) << ',' << ev.timestamp << ',' << ev.tid << ','
+       << ev.site << ',' << format_hex(ev.addr, 0) << ',' << ev.size << ','
+       << ev.weight;
+    if (!siteLocations.empty()) os << ",\"" << siteLocation(ev.site) << '"';
+    os << '\n';
+  } else {
+    os << kindName(ev.kind) << ' ' << ev.size << " => "
+       << format_hex(ev.addr, 0) << " tid=" << ev.tid << " ts=" << ev.timestamp
+       << " site=" << ev.site;
+    if (ev.weight != 1) os << " weight=" << ev.weight;
+    if (!siteLocation(ev.site).empty())
+      os << " (" << siteLocation(ev.site) << ')';
+    os << '\n';
+  }
+}
+
+// Decode all the blocks of the mapped file, returns false on corruption.
+// With a `chunkSize`, each block starts a chunk of that size rather than
+// right after the previous one.
+static bool decode(const uint8_t *p, const uint8_t *end, uint32_t chunkSize,
+                   raw_ostream &os, Summary &summary) {
+  while (p < end) {
+    orbit_trace_block_header block;
+    const uint8_t *next =
+        chunkSize ? p + std::min<size_t>(chunkSize, end - p) : nullptr;
+    if ((size_t)(end - p) < sizeof(block)) {
+      errs() << "Truncated block header after block " << summary.blocks
+             << "\n";
+      return false;
+    }
+    memcpy(&block, p, sizeof(block));
+    p += sizeof(block);
+    // A chunk claimed by a thread that died before it set it up
+    if (chunkSize && block.magic == 0) {
+      p = next;
+      continue;
+    }
+    if (block.magic != ORBIT_BLOCK_MAGIC ||
+        block.payload_size > (size_t)((next ? next : end) - p)) {
+      errs() << "Corrupted or truncated block " << summary.blocks << "\n";
+      return false;
+    }
+    const uint8_t *payload_end = p + block.payload_size;
+    if (!next) next = payload_end;
+    summary.blocks++;
+    if (block.last_timestamp < startTime || block.first_timestamp > endTime) {
+      summary.skippedBlocks++;
+      p = next;
+      continue;
+    }
+
+    orbit_trace_codec codec;
+    orbit_codec_reset(&codec);
+    for (uint32_t i = 0; i < block.record_cnt; i++) {
+      orbit_trace_event ev;
+      p = orbit_decode_event(&codec, p, payload_end, &ev);
+      if (p == nullptr) {
+        errs() << "Corrupted record " << i << " in block "
+               << summary.blocks - 1 << "\n";
+        return false;
+      }
+      if (ev.timestamp < startTime || ev.timestamp > endTime) continue;
+      summary.add(ev);
+      if (outputFormat != OutputFormat::Summary) printEvent(os, ev);
+    }
+    p = next;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv);
+  if (!siteTableFilename.empty() && !loadSiteTable(siteTableFilename))
+    return 1;
+
+  auto buffer = MemoryBuffer::getFile(inputFilename, -1, false);
+  if (!buffer) {
+    errs() << "Failed to open '" << inputFilename
+           << "': " << buffer.getError().message() << "\n";
+    return 1;
+  }
+  const uint8_t *begin = (const uint8_t *)(*buffer)->getBufferStart();
+  const uint8_t *end = (const uint8_t *)(*buffer)->getBufferEnd();
+
+  // Version 1 headers end before the sampling fields
+  const size_t minHeaderSize = offsetof(orbit_trace_file_header, sample_mode);
+  orbit_trace_file_header header = {};
+  if ((size_t)(end - begin) < minHeaderSize) {
+    errs() << "'" << inputFilename << "' is not an orbit trace\n";
+    return 1;
+  }
+  memcpy(&header, begin, minHeaderSize);
+  if (memcmp(header.magic, ORBIT_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.header_size < minHeaderSize ||
+      header.header_size > (size_t)(end - begin)) {
+    errs() << "'" << inputFilename << "' is not an orbit trace\n";
+    return 1;
+  }
+  memcpy(&header, begin, std::min<size_t>(header.header_size, sizeof(header)));
+  if (header.version == 0 || header.version > ORBIT_TRACE_VERSION) {
+    errs() << "Unsupported trace version " << header.version << "\n";
+    return 1;
+  }
+
+  std::error_code ec;
+  raw_fd_ostream os(outputFilename, ec, sys::fs::F_None);
+  if (ec) {
+    errs() << "Failed to open '" << outputFilename << "': " << ec.message()
+           << "\n";
+    return 1;
+  }
+  if (outputFormat == OutputFormat::CSV)
+    os << "kind,timestamp,tid,site,addr,size,weight"
+       << (siteLocations.empty() ? "\n" : ",location\n");
+
+  // Blocks past data_end are not part of the trace. The file is longer than
+  // that only if the process died before it stopped tracing.
+  const uint8_t *dataEnd = end;
+  uint32_t chunkSize = 0;
+  if (header.version >= 3) {
+    if (header.data_end < header.header_size || header.chunk_size == 0) {
+      errs() << "'" << inputFilename << "' has a corrupted header\n";
+      return 1;
+    }
+    dataEnd = begin + std::min<uint64_t>(header.data_end, end - begin);
+    chunkSize = header.chunk_size;
+  }
+
+  Summary summary;
+  auto start = chrono::steady_clock::now();
+  bool ok =
+      decode(begin + header.header_size, dataEnd, chunkSize, os, summary);
+  double secs =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  if (outputFormat == OutputFormat::Summary) {
+    os << "pid:        " << header.pid << "\n";
+    os << "clock:      "
+       << (header.clock == ORBIT_CLOCK_TSC ? "tsc" : "monotonic ns") << "\n";
+    if (dataEnd != end)
+      os << "stopped:    no, the process died while tracing\n";
+    if (header.sample_mode == ORBIT_SAMPLE_EVERY)
+      os << "sampling:   every " << header.sample_period
+         << " allocations\n";
+    else if (header.sample_mode == ORBIT_SAMPLE_BYTES)
+      os << "sampling:   every " << header.sample_period
+         << " bytes on average\n";
+    summary.print(os, header.sample_mode != ORBIT_SAMPLE_ALL);
+  }
+  double mb = (dataEnd - begin) / (1024.0 * 1024.0);
+  errs() << "Decoded " << summary.events << " events (" << format("%.1f", mb)
+         << " MB) in " << format("%.3f", secs) << "s\n";
+  return ok ? 0 : 1;
+}
@@ -5,11 +5,22 @@
 //    All rights reserved.
 //    Licensed under the Apache License, Version 2.0 (the "License");
 //
+// Slice a bitcode file down to the functions that matter for the analysis:
+// those on a call path between a function that calls an allocator and one
+// of the target functions, plus the globals they use.
+//
 
+#include <fstream>
 #include <iostream>
+#include <queue>
 
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Verifier.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
+#include "CallGraph/CallGraph.h"
+#include "ObiWanAnalysis/ObiWanAnalysis.h"
 #include "Utils/LLVM.h"
 #include "Utils/String.h"
 
@@ -17,11 +28,148 @@ using namespace std;
 using namespace llvm;
 
 cl::list<std::string> TargetFunctions("function", cl::desc("<Function>"),
-                                      cl::ZeroOrMore);
+                                      cl::OneOrMore);
 cl::opt<string> inputFilename(cl::Positional, cl::desc("<input file>"),
                               cl::Required);
+cl::opt<string> outputFilename(
+    "o", cl::desc("File to write the sliced bitcode"),
+    cl::value_desc("file"));
+
+typedef set<Function *> FunctionSet;
+
+// Build the direct call graph of the module. Calls through a constant cast
+// of a function are resolved the same way as in the analysis.
+void buildCallGraph(Module &M, ::CallGraph &cg) {
+  for (Function &F : M) {
+    if (F.isDeclaration()) continue;
+    for (Instruction &I : instructions(F)) {
+      if (!isa<CallInst>(&I) && !isa<InvokeInst>(&I)) continue;
+      auto [caller, callee, _] = extractCallerCallee(CallSite(&I), 0);
+      if (callee == nullptr || callee->isIntrinsic()) continue;
+      cg.addEdge(caller, callee);
+    }
+  }
+}
+
+// All functions reachable from the roots (including the roots) by following
+// edges of the given type: CALL edges lead to callees, RETURN edges lead to
+// callers.
+FunctionSet reachable(::CallGraph &cg, const FunctionSet &roots,
+                      EdgeType type) {
+  FunctionSet visited(roots.begin(), roots.end());
+  queue<Function *> queue;
+  for (Function *F : roots) queue.push(F);
+  while (!queue.empty()) {
+    Function *F = queue.front();
+    queue.pop();
+    auto edges = cg.callGraph.find(F);
+    if (edges == cg.callGraph.end()) continue;
+    for (Edge *edge : edges->second) {
+      if (edge->edgeType != type) continue;
+      if (visited.insert(edge->dst).second) queue.push(edge->dst);
+    }
+  }
+  return visited;
+}
 
-void extractFunc(Function *F) {}
+/*
+ * An allocated object flows up from the allocator's caller to some common
+ * ancestor, and then down into the target. The slice keeps the functions on
+ * either leg of such a path, and everything the targets call, since the
+ * analysis looks for usage points inside the callees of the targets.
+ */
+FunctionSet computeSlice(Module &M, ::CallGraph &cg,
+                         const FunctionSet &targets, const AllocRules &rules) {
+  FunctionSet alloc_callers;
+  for (Function &F : M) {
+    if (F.isDeclaration() || rules.should_ignore(&F)) continue;
+    for (Instruction &I : instructions(F)) {
+      CallSite cs(&I);
+      if (!cs.isCall() && !cs.isInvoke()) continue;
+      // Through a cast of the allocator too, as in buildCallGraph
+      Function *callee =
+          dyn_cast<Function>(cs.getCalledValue()->stripPointerCasts());
+      if (rules.alloc.count(callee) || rules.realloc.count(callee)) {
+        alloc_callers.insert(&F);
+        break;
+      }
+    }
+  }
+
+  FunctionSet alloc_up = reachable(cg, alloc_callers, EdgeType::RETURN);
+  FunctionSet target_up = reachable(cg, targets, EdgeType::RETURN);
+  FunctionSet common;
+  for (Function *F : alloc_up)
+    if (target_up.count(F)) common.insert(F);
+  FunctionSet common_down = reachable(cg, common, EdgeType::CALL);
+
+  FunctionSet slice = reachable(cg, targets, EdgeType::CALL);
+  for (Function *F : common_down) {
+    if (alloc_up.count(F) || target_up.count(F)) slice.insert(F);
+  }
+  errs() << "Found " << alloc_callers.size() << " allocator callers, "
+         << common.size() << " common ancestors with the targets\n";
+  return slice;
+}
+
+/*
+ * Global variables the sliced functions refer to, through any nesting of
+ * constant expressions and aggregates, and then the ones the initializers
+ * of those refer to (vtables, tables of function pointers, ...), until
+ * nothing new is found. Functions only keep a body if they are in the
+ * slice, the others are referred to as declarations.
+ */
+set<const GlobalValue *> findUsedGlobals(const FunctionSet &slice) {
+  set<const GlobalValue *> globals;
+  set<const Constant *> visited;
+  vector<const Constant *> worklist;
+  auto visit = [&](const Value *v) {
+    const Constant *c = dyn_cast<Constant>(v);
+    if (c != nullptr && visited.insert(c).second) worklist.push_back(c);
+  };
+  for (Function *F : slice) {
+    for (Instruction &I : instructions(F)) {
+      for (Value *op : I.operands()) visit(op);
+    }
+  }
+  while (!worklist.empty()) {
+    const Constant *c = worklist.back();
+    worklist.pop_back();
+    if (const GlobalVariable *gv = dyn_cast<GlobalVariable>(c)) {
+      globals.insert(gv);
+      if (gv->hasInitializer()) visit(gv->getInitializer());
+    } else if (!isa<GlobalValue>(c)) {
+      for (const Use &op : c->operands()) visit(op.get());
+    }
+  }
+  return globals;
+}
+
+// Drop the declarations that nothing in the slice refers to anymore
+void removeUnusedDeclarations(Module &M) {
+  vector<GlobalValue *> unused;
+  for (Function &F : M) {
+    F.removeDeadConstantUsers();
+    if (F.isDeclaration() && !F.isIntrinsic() && F.use_empty())
+      unused.push_back(&F);
+  }
+  for (GlobalVariable &G : M.globals()) {
+    G.removeDeadConstantUsers();
+    if (G.isDeclaration() && G.use_empty()) unused.push_back(&G);
+  }
+  for (GlobalValue *GV : unused) GV->eraseFromParent();
+}
+
+bool saveModule(Module *M, string outFile) {
+  if (verifyModule(*M, &errs())) {
+    errs() << "Error: module failed verification.\n";
+    return false;
+  }
+  ofstream ofs(outFile);
+  raw_os_ostream ostream(ofs);
+  WriteBitcodeToFile(M, ostream);
+  return true;
+}
 
 int main(int argc, char *argv[]) {
   cl::ParseCommandLineOptions(argc, argv);
@@ -32,18 +180,52 @@ int main(int argc, char *argv[]) {
     errs() << "Failed to parse '" << inputFilename << "' file:\n";
     return 1;
   }
-  set<string> targetFunctionSet(TargetFunctions.begin(), TargetFunctions.end());
-  set<Function *> Functions;
-  for (Module::iterator I = M->begin(), E = M->end(); I != E; ++I) {
-    Function &F = *I;
-    errs() << "Func name is " << F.getName() << "pointer " << &F << "\n";
-    if (!F.isDeclaration()) {
-      if (targetFunctionSet.empty() ||
-          targetFunctionSet.count(F.getName()) != 0) {
-        errs() << "Extracting variables from " << F.getName() << "()\n";
-        extractFunc(&F);
-        Functions.insert(&F);
-      }
+  const AllocRules rules(getDefaultAllocRules(*M));
+
+  FunctionSet targets;
+  for (auto &name : TargetFunctions) {
+    // Accept both demangled and mangled names
+    Function *F = getFunctionWithName(name, *M);
+    if (F == nullptr) F = M->getFunction(name);
+    if (F == nullptr || F->isDeclaration()) {
+      errs() << "Could not find target function " << name << "\n";
+      continue;
     }
+    targets.insert(F);
+  }
+  if (targets.empty()) return 1;
+
+  ::CallGraph cg;
+  buildCallGraph(*M, cg);
+  FunctionSet slice = computeSlice(*M, cg, targets, rules);
+  set<const GlobalValue *> globals = findUsedGlobals(slice);
+
+  // Clone everything as declarations, and only keep the bodies of the slice
+  // and the initializers of the globals it uses. Debug info attached to the
+  // kept functions is cloned along with them.
+  ValueToValueMapTy VMap;
+  unique_ptr<Module> sliced =
+      CloneModule(M.get(), VMap, [&](const GlobalValue *GV) {
+        if (const Function *F = dyn_cast<Function>(GV))
+          return slice.count(const_cast<Function *>(F)) != 0;
+        return globals.count(GV) != 0;
+      });
+  removeUnusedDeclarations(*sliced);
+
+  unsigned defined = 0;
+  for (Function &F : *M)
+    if (!F.isDeclaration()) defined++;
+  errs() << "Sliced " << slice.size() << " out of " << defined
+         << " functions, " << globals.size() << " globals\n";
+
+  if (outputFilename.empty()) {
+    outputFilename = getFileBaseName(inputFilename, false) + "-slice.bc";
+  }
+  if (!saveModule(sliced.get(), outputFilename)) {
+    errs() << "Failed to save the sliced bitcode file to " << outputFilename
+           << "\n";
+    return 1;
   }
+  errs() << "Saved the sliced bitcode file to " << outputFilename << "\n";
+  return 0;
 }
@@ -11,8 +11,10 @@
 
 #include <llvm/IR/Verifier.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
 
 #include "Instrument/InstrumentAllocPass.h"
+#include "ObiWanAnalysis/ObiWanAnalysis.h"
 #include "Utils/LLVM.h"
 #include "Utils/String.h"
 
@@ -26,18 +28,116 @@ cl::opt<string> outputFilename(
     "o", cl::desc("File to write the instrumented bitcode"),
     cl::value_desc("file"));
 
+cl::opt<unsigned> splitParts(
+    "split", cl::init(1),
+    cl::desc("Write the instrumented bitcode as this many partitions, split "
+             "by function, to <output>.<n>.bc, so that they can be compiled "
+             "in parallel and linked together"),
+    cl::value_desc("n"));
+
 cl::opt<bool> usePrintf(
     "use-printf", cl::desc("Whether to instrument using regular printf"));
 
-bool runOnFunction(AllocInstrumenter *instrumenter, Function &F) {
-  bool instrumented = false;
-  // TODO: replace this demo logic
-  Instruction *instr;
-  for (inst_iterator ii = inst_begin(F), ie = inst_end(F); ii != ie; ++ii) {
-    instr = &*ii;
-    instrumented |= instrumenter->instrumentInstr(instr);
+cl::opt<string> siteTableFilename(
+    "site-table",
+    cl::desc("File to write the table of instrumented sites "
+             "(default: <output>.sites)"),
+    cl::value_desc("file"));
+
+cl::opt<bool> hookFrees(
+    "hook-frees", cl::init(true),
+    cl::desc("Also hook the deallocation and reallocation sites given by the "
+             "allocation rules"));
+
+cl::opt<bool> replaceAllocs(
+    "replace-allocs", cl::init(true),
+    cl::desc("Replace the calls to movable allocators with allocations from "
+             "the tracker's arena; otherwise keep the calls and observe them "
+             "like the others"));
+
+cl::opt<bool> inlineHooks(
+    "inline-hooks",
+    cl::desc("Inline the sampling test of the hooks of the allocators that "
+             "are observed rather than replaced"));
+
+cl::opt<bool> coalesceLoops(
+    "coalesce-loops",
+    cl::desc("Count the observed allocations of a loop with a known trip "
+             "count down once before the loop, and skip their hooks in the "
+             "loop when none is sampled"));
+
+cl::opt<bool> trackWrites(
+    "track-writes",
+    cl::desc("Also hook the stores that may write into the objects of the "
+             "instrumented allocation sites, so that the runtime knows which "
+             "objects were written"));
+
+cl::opt<unsigned> planThreads(
+    "j", cl::init(0),
+    cl::desc("Number of threads that describe the sites before they are "
+             "instrumented (default: one per core); the output does not "
+             "depend on it"),
+    cl::value_desc("threads"));
+
+cl::opt<string> allocRulesFilename(
+    "alloc-rules",
+    cl::desc("Read more allocation rules from this file, see "
+             "readAllocRules in include/Utils/LLVM.h"),
+    cl::value_desc("file"));
+
+cl::opt<string> sitesFrom(
+    "sites-from",
+    cl::desc("Only instrument the allocation sites listed in this table of "
+             "sites, e.g. written by the analyzer's -site-list"),
+    cl::value_desc("file"));
+
+cl::list<string> targetFunctions(
+    "target-functions",
+    cl::desc("Run the analysis first, and only instrument the allocation "
+             "sites that reach these functions"),
+    cl::ZeroOrMore);
+
+// Add the allocation points that reach the target functions to `points`,
+// and their GUIDs to `guids`
+bool selectAllocationPoints(Module &M, const AllocRules &rules,
+                            FunctionMaterializer &materializer,
+                            vector<Instruction *> &points,
+                            set<uint32_t> &guids) {
+  UserGraphContext ctx;
+  ctx.materializer = &materializer;
+  for (auto &target_name : targetFunctions) {
+    Function *target = getFunctionWithName(target_name, M);
+    if (target == NULL) {
+      errs() << "Could not find target function " << target_name << "\n";
+      return false;
+    }
+    for (Instruction *point : findAllocationPoints(target, rules, ctx)) {
+      Function *callee = CallSite(point).getCalledFunction();
+      guids.insert(computeSiteGuid(
+          point, callee,
+          rules.realloc.count(callee) != 0 ? "realloc" : "alloc"));
+      points.push_back(point);
+    }
+  }
+  return true;
+}
+
+// The allocation sites in the module, only those in `selected` unless it is
+// NULL
+vector<Instruction *> findAllocationSites(const AllocRules &rules,
+                                          const set<uint32_t> *selected) {
+  vector<Instruction *> points;
+  for (auto &alloc : rules.alloc) {
+    for (const User *user : alloc.first->users()) {
+      CallSite cs((Value *)user);
+      if (!cs || cs.getCalledFunction() != alloc.first) continue;
+      if (selected == NULL ||
+          selected->count(computeSiteGuid(cs.getInstruction(), alloc.first,
+                                          "alloc")) != 0)
+        points.push_back(cs.getInstruction());
+    }
   }
-  return instrumented;
+  return points;
 }
 
 bool saveModule(Module *M, string outFile) {
@@ -51,6 +151,32 @@ bool saveModule(Module *M, string outFile) {
   return true;
 }
 
+// Split the module by function into `parts` modules that link back into
+// it, with the local symbols they share made hidden globals, and write them
+// to <outFile without .bc>.<n>.bc
+bool saveModuleParts(unique_ptr<Module> M, string outFile, unsigned parts) {
+  if (verifyModule(*M, &errs())) {
+    errs() << "Error: module failed verification.\n";
+    return false;
+  }
+  if (outFile.size() > 3 && outFile.compare(outFile.size() - 3, 3, ".bc") == 0)
+    outFile.resize(outFile.size() - 3);
+  unsigned n = 0;
+  bool ok = true;
+  SplitModule(std::move(M), parts, [&](unique_ptr<Module> part) {
+    string partFile = outFile + "." + to_string(n++) + ".bc";
+    ofstream ofs(partFile);
+    raw_os_ostream ostream(ofs);
+    WriteBitcodeToFile(part.get(), ostream);
+    ostream.flush();
+    if (!ofs) {
+      errs() << "Failed to write " << partFile << "\n";
+      ok = false;
+    }
+  });
+  return ok;
+}
+
 int main(int argc, char *argv[]) {
   cl::ParseCommandLineOptions(argc, argv);
 
@@ -60,32 +186,81 @@ int main(int argc, char *argv[]) {
     errs() << "Failed to parse '" << inputFilename << "' file:\n";
     return 1;
   }
+  FunctionMaterializer materializer(*M);
   AllocInstrumenter instrumenter(usePrintf);
+  AllocRules::Initializer init = getDefaultAllocRules(*M);
+  if (!allocRulesFilename.empty() && !readAllocRules(allocRulesFilename, init))
+    return 1;
+  const AllocRules rules(init);
+  instrumenter.setAllocRules(&rules);
+  instrumenter.setHookFrees(hookFrees);
+  instrumenter.setReplaceAllocs(replaceAllocs);
+  instrumenter.setInlineHooks(inlineHooks);
+  instrumenter.setCoalesceLoops(coalesceLoops);
+  instrumenter.setPlanThreads(planThreads);
+  set<uint32_t> selected;
+  vector<Instruction *> points;
+  if (!sitesFrom.empty() && !readSiteGuids(sitesFrom, selected)) return 1;
+  if (!targetFunctions.empty() &&
+      !selectAllocationPoints(*M, rules, materializer, points, selected))
+    return 1;
+  bool selecting = !sitesFrom.empty() || !targetFunctions.empty();
+  if (selecting) {
+    errs() << "Selected " << selected.size() << " allocation sites\n";
+    instrumenter.setSelectedSites(&selected);
+  }
+  vector<Instruction *> writes;
+  if (trackWrites) {
+    materializer.materializeAll();
+    if (targetFunctions.empty())
+      points = findAllocationSites(rules, selecting ? &selected : NULL);
+    UserGraphContext ctx;
+    ctx.materializer = &materializer;
+    writes = findObjectWrites(points, rules, ctx);
+  }
   if (!instrumenter.initHookFuncs(M.get(), context)) {
     errs() << "Failed to initialize hook functions\n";
     return 1;
   }
-  set<Function *> Functions;
-  for (Module::iterator I = M->begin(), E = M->end(); I != E; ++I) {
-    Function &F = *I;
-    if (!F.isDeclaration()) {
-      runOnFunction(&instrumenter, F);
-      Functions.insert(&F);
-    }
+  // Before the allocation sites are replaced
+  if (trackWrites) {
+    instrumenter.instrumentWrites(writes);
+    errs() << "Hooked " << instrumenter.getWriteHookCnt() << " of "
+           << writes.size() << " writes to tracked objects, "
+           << instrumenter.getElidedWriteCnt() << " were redundant\n";
   }
+  instrumenter.instrumentModule(*M);
   llvm::errs() << "Instrumented " << instrumenter.getInstrumentedCnt() 
     << " instructions in total\n";
+  if (coalesceLoops)
+    errs() << "Coalesced the hooks of " << instrumenter.getCoalescedCnt()
+           << " allocation sites in loops\n";
+  if (replaceAllocs)
+    errs() << "Folded the size class into " << instrumenter.getSizeClassCnt()
+           << " allocation sites of a constant size\n";
 
   string inputFileBasenameNoExt = getFileBaseName(inputFilename, false);
   if (outputFilename.empty()) {
     outputFilename = inputFileBasenameNoExt + "-instrumented.bc";
   }
 
-  if (!saveModule(M.get(), outputFilename)) {
-    errs() << "Failed to save the instrumented bitcode file to "
-           << outputFilename << "\n";
-    return 1;
+  if (splitParts > 1) {
+    if (!saveModuleParts(std::move(M), outputFilename, splitParts)) return 1;
+    errs() << "Saved the instrumented bitcode in " << splitParts
+           << " partitions\n";
+  } else {
+    if (!saveModule(M.get(), outputFilename)) {
+      errs() << "Failed to save the instrumented bitcode file to "
+             << outputFilename << "\n";
+      return 1;
+    }
+    errs() << "Saved the instrumented bitcode file to " << outputFilename
+           << "\n";
   }
-  errs() << "Saved the instrumented bitcode file to " << outputFilename << "\n";
+
+  if (siteTableFilename.empty()) siteTableFilename = outputFilename + ".sites";
+  if (!instrumenter.writeSiteTable(siteTableFilename)) return 1;
+  errs() << "Saved the table of " << instrumenter.getSites().size()
+         << " sites to " << siteTableFilename << "\n";
   return 0;
 }
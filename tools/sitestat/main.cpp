@@ -0,0 +1,217 @@
+// The Obi-wan Project
+//
+// Copyright (c) 2021, Johns Hopkins University - Order Lab.
+//
+//    All rights reserved.
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//
+// Poll the per-site allocation counters of a running, instrumented process.
+// The counters are read from the shared memory segment the OrbitTracker
+// runtime publishes them in, so the process is not involved at all.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "site_stats_format.h"
+
+using namespace std;
+using namespace llvm;
+
+enum class SortKey { Live, Allocs, Bytes };
+
+cl::opt<unsigned> pid(cl::Positional, cl::desc("<pid>"), cl::Required);
+cl::opt<unsigned> interval("interval",
+                           cl::desc("Milliseconds between two polls"),
+                           cl::init(1000));
+cl::opt<unsigned> pollCount("n",
+                            cl::desc("Number of polls, 0 to poll until the "
+                                     "process exits"),
+                            cl::init(1));
+cl::opt<unsigned> topSites("top", cl::desc("Number of sites listed"),
+                           cl::init(20));
+cl::opt<SortKey> sortKey(
+    "sort", cl::desc("Order of the sites"), cl::init(SortKey::Live),
+    cl::values(clEnumValN(SortKey::Live, "live", "live bytes"),
+               clEnumValN(SortKey::Allocs, "allocs", "allocations"),
+               clEnumValN(SortKey::Bytes, "bytes", "allocated bytes")));
+cl::opt<string> siteTableFilename(
+    "sites", cl::desc("Site table written by the instrumentor, to show the "
+                      "source location of each site"),
+    cl::value_desc("file"));
+
+struct SiteTotals {
+  uint32_t guid = 0;
+  uint64_t allocs = 0;
+  uint64_t allocBytes = 0;
+  uint64_t frees = 0;
+  uint64_t freeBytes = 0;
+  uint64_t reallocs = 0;
+
+  int64_t liveObjects() const { return (int64_t)(allocs - frees); }
+  int64_t liveBytes() const { return (int64_t)(allocBytes - freeBytes); }
+};
+
+// GUID -> "file:line:column function"
+static unordered_map<uint32_t, string> siteLocations;
+
+static bool loadSiteTable(StringRef path) {
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    errs() << "Failed to open '" << path
+           << "': " << buffer.getError().message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 0> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    if (line.startswith("#")) continue;
+    // guid, kind, location, function, allocator
+    SmallVector<StringRef, 5> fields;
+    line.split(fields, '\t');
+    uint32_t guid;
+    if (fields.size() < 4 || fields[0].getAsInteger(10, guid)) {
+      errs() << "Malformed line in '" << path << "': " << line << "\n";
+      return false;
+    }
+    siteLocations[guid] = (fields[2] + " " + fields[3]).str();
+  }
+  return true;
+}
+
+// Sum the slots of a site over all the shards
+static vector<SiteTotals> readTotals(const orbit_stats_header *header) {
+  auto slots = (const orbit_site_counters *)((const char *)header +
+                                             header->header_size);
+  unordered_map<uint32_t, SiteTotals> sites;
+  size_t n = (size_t)header->shard_cnt * header->site_cnt;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t guid = __atomic_load_n(&slots[i].guid, __ATOMIC_ACQUIRE);
+    if (guid == 0) continue;
+    SiteTotals &site = sites[guid];
+    site.guid = guid;
+    site.allocs += __atomic_load_n(&slots[i].allocs, __ATOMIC_RELAXED);
+    site.allocBytes +=
+        __atomic_load_n(&slots[i].alloc_bytes, __ATOMIC_RELAXED);
+    site.frees += __atomic_load_n(&slots[i].frees, __ATOMIC_RELAXED);
+    site.freeBytes +=
+        __atomic_load_n(&slots[i].free_bytes, __ATOMIC_RELAXED);
+    site.reallocs += __atomic_load_n(&slots[i].reallocs, __ATOMIC_RELAXED);
+  }
+  vector<SiteTotals> totals;
+  for (auto &entry : sites) totals.push_back(entry.second);
+  return totals;
+}
+
+static int64_t sortValue(const SiteTotals &site) {
+  switch (sortKey) {
+    case SortKey::Allocs: return (int64_t)site.allocs;
+    case SortKey::Bytes: return (int64_t)site.allocBytes;
+    default: return site.liveBytes();
+  }
+}
+
+static void print(raw_ostream &os, vector<SiteTotals> &sites,
+                  const unordered_map<uint32_t, uint64_t> &lastAllocs,
+                  double secs, uint64_t overflow) {
+  SiteTotals all;
+  for (auto &site : sites) {
+    all.allocs += site.allocs;
+    all.allocBytes += site.allocBytes;
+    all.frees += site.frees;
+    all.freeBytes += site.freeBytes;
+  }
+  os << "sites: " << sites.size() << "  allocs: " << all.allocs
+     << "  frees: " << all.frees << "  live: " << all.liveObjects()
+     << " objects, " << all.liveBytes() << " bytes";
+  if (overflow) os << "  overflow: " << overflow;
+  os << "\n";
+
+  std::sort(sites.begin(), sites.end(), [](auto &a, auto &b) {
+    return sortValue(a) > sortValue(b);
+  });
+  if (sites.size() > topSites) sites.resize(topSites);
+  os << "      guid       allocs        frees   reallocs       live"
+        "     live bytes   allocs/s  location\n";
+  for (auto &site : sites) {
+    auto last = lastAllocs.find(site.guid);
+    double rate = 0;
+    if (secs > 0 && last != lastAllocs.end())
+      rate = (site.allocs - last->second) / secs;
+    auto loc = siteLocations.find(site.guid);
+    os << format("%10u %12llu %12llu %10llu %10lld %14lld %10.0f  %s\n",
+                 site.guid, (unsigned long long)site.allocs,
+                 (unsigned long long)site.frees,
+                 (unsigned long long)site.reallocs,
+                 (long long)site.liveObjects(), (long long)site.liveBytes(),
+                 rate,
+                 loc == siteLocations.end() ? "" : loc->second.c_str());
+  }
+  os << "\n";
+  os.flush();
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv);
+  if (!siteTableFilename.empty() && !loadSiteTable(siteTableFilename))
+    return 1;
+
+  string path = ORBIT_STATS_PREFIX + to_string(pid);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    errs() << "Failed to open '" << path << "', is " << pid
+           << " running with the OrbitTracker runtime?\n";
+    return 1;
+  }
+  // Read-only and shared: polling never faults pages into the process
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED || (size_t)st.st_size < sizeof(orbit_stats_header)) {
+    errs() << "Failed to map '" << path << "'\n";
+    return 1;
+  }
+  auto header = (const orbit_stats_header *)map;
+  if (memcmp(header->magic, ORBIT_STATS_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != ORBIT_STATS_VERSION ||
+      header->header_size + (uint64_t)header->shard_cnt * header->site_cnt *
+                                sizeof(orbit_site_counters) >
+          (uint64_t)st.st_size) {
+    errs() << "'" << path << "' is not an orbit stats segment\n";
+    return 1;
+  }
+
+  unordered_map<uint32_t, uint64_t> lastAllocs;
+  auto last = chrono::steady_clock::now();
+  for (unsigned i = 0; pollCount == 0 || i < pollCount; i++) {
+    if (i > 0) this_thread::sleep_for(chrono::milliseconds(interval));
+    auto now = chrono::steady_clock::now();
+    vector<SiteTotals> sites = readTotals(header);
+    double secs = chrono::duration<double>(now - last).count();
+    unordered_map<uint32_t, uint64_t> allocs;
+    for (auto &site : sites) allocs[site.guid] = site.allocs;
+    print(outs(), sites, lastAllocs, i > 0 ? secs : 0,
+          __atomic_load_n(&header->overflow, __ATOMIC_RELAXED));
+    lastAllocs = move(allocs);
+    last = now;
+    // The segment outlives the process as long as it is mapped
+    if (kill(pid, 0) != 0 && errno == ESRCH) break;
+  }
+  return 0;
+}